@@ -0,0 +1,184 @@
+/*
+ * KernelTalk: kernel based chat
+ *
+ * This header is shared between the kernel module and user-space programs. It
+ * describes the ioctl() interface of the character device.
+ */
+
+#ifndef KERNELTALK_H
+#define KERNELTALK_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define KERNELTALK_IOC_MAGIC 'k'
+
+/*
+ * Delivery barrier. Blocks until every other client on the channel has read
+ * past the last byte written through this file. The argument points to a
+ * timeout in milliseconds; KERNELTALK_SYNC_FOREVER waits without a timeout and
+ * 0 only checks. Fails with ETIMEDOUT if the readers did not catch up in time.
+ *
+ * fsync() on the device is the same barrier without a timeout.
+ */
+#define KERNELTALK_SYNC_FOREVER ((__u32)~0U)
+#define KERNELTALK_IOC_SYNC _IOW(KERNELTALK_IOC_MAGIC, 1, __u32)
+
+/*
+ * Batch transfer. Every successful write() commits one record, and the batch
+ * ioctls move many records in a single call, like sendmmsg() and recvmmsg().
+ * read() and write() still see the channel as a plain byte stream.
+ *
+ * Both ioctls return the number of messages transferred. SENDMMSG blocks until
+ * every message is committed unless the file is non-blocking or DONTWAIT is
+ * given; a message never gets split. RECVMMSG waits for at least one record
+ * and then returns whatever is available, up to count.
+ */
+struct kerneltalk_msg
+{
+	__u64 buf;		/* user pointer to the message data */
+	__u32 len;		/* in: size of buf, out: bytes transferred */
+	__u32 flags;	/* in: KERNELTALK_MSG_MORE (SENDMMSG), out: KERNELTALK_MSG_* (RECVMMSG) */
+	__u64 seq;		/* out: record sequence number */
+	__u64 stamp_ns; /* out: commit time, CLOCK_MONOTONIC */
+	__s32 pid;		/* out: process id of the writer */
+	__u32 reserved;
+};
+
+#define KERNELTALK_MSG_TRUNC 0x1   /* record did not fit, the rest was dropped */
+#define KERNELTALK_MSG_PARTIAL 0x2 /* head of the record was consumed by read() */
+#define KERNELTALK_MSG_MORE 0x4	   /* more is coming, see KERNELTALK_IOC_CORK */
+
+struct kerneltalk_mmsg
+{
+	__u64 msgs;	 /* user pointer to an array of struct kerneltalk_msg */
+	__u32 count; /* number of entries in msgs */
+	__u32 flags; /* KERNELTALK_MMSG_* */
+};
+
+#define KERNELTALK_MMSG_DONTWAIT 0x1 /* behave as if the file was O_NONBLOCK */
+
+#define KERNELTALK_IOC_SENDMMSG _IOW(KERNELTALK_IOC_MAGIC, 2, struct kerneltalk_mmsg)
+#define KERNELTALK_IOC_RECVMMSG _IOW(KERNELTALK_IOC_MAGIC, 3, struct kerneltalk_mmsg)
+
+/*
+ * Cheap queries and cursor moves that don't copy data. FIONREAD is also
+ * supported and returns the pending byte count as an int.
+ *
+ * PENDING reports the read position and what is left to read; a record that
+ * was partly consumed by read() counts as one record.
+ */
+struct kerneltalk_pending
+{
+	__u64 pos;	   /* position of the next byte to read */
+	__u64 bytes;   /* unread bytes */
+	__u64 records; /* unread records */
+};
+
+#define KERNELTALK_IOC_PENDING _IOR(KERNELTALK_IOC_MAGIC, 4, struct kerneltalk_pending)
+
+/*
+ * PEEK copies unread data like read() but leaves the read position alone. It
+ * waits for data unless the file is non-blocking and returns the number of
+ * bytes copied. While the client catches up from a spill (see the
+ * module's spill parameter), it copies at most the rest of the current record.
+ */
+struct kerneltalk_peek
+{
+	__u64 buf;	 /* user pointer to the destination */
+	__u32 len;	 /* size of buf */
+	__u32 flags; /* reserved, must be 0 */
+};
+
+#define KERNELTALK_IOC_PEEK _IOW(KERNELTALK_IOC_MAGIC, 5, struct kerneltalk_peek)
+
+/*
+ * SKIP throws away up to count unread bytes, or whole records with
+ * KERNELTALK_SKIP_RECORDS, without copying them. It never waits and returns
+ * the number of bytes or records skipped.
+ */
+struct kerneltalk_skip
+{
+	__u64 count;
+	__u32 flags; /* KERNELTALK_SKIP_* */
+	__u32 reserved;
+};
+
+#define KERNELTALK_SKIP_RECORDS 0x1
+
+#define KERNELTALK_IOC_SKIP _IOW(KERNELTALK_IOC_MAGIC, 6, struct kerneltalk_skip)
+
+/*
+ * Shared memory. The device can be mapped read-only with MAP_SHARED. It starts
+ * with a struct kerneltalk_ctrl, the ring buffer starts at ring_offset. A
+ * reader finds its position with KERNELTALK_IOC_PENDING, copies the bytes up
+ * to head out of the ring (position modulo ring_size) and then consumes them
+ * with KERNELTALK_IOC_SKIP. If the module keeps per-node replicas of the ring,
+ * the mapping shows the one on the node of the task calling mmap().
+ *
+ * rec_end has the end position of the last nr_recs records, record n at
+ * rec_end[n % nr_recs]; it is written before rec_head moves past n, so a
+ * reader can find the bounds of every record it has not consumed with
+ * KERNELTALK_IOC_SKIP yet. nr_recs is a power of two that grows with the ring,
+ * and the array fills the pages up to ring_offset. A write() that finds every
+ * record slot in use extends the newest record instead of waiting, so that
+ * record's end may still grow after rec_head moved past it: head moves with it.
+ *
+ * seq is bumped after every commit, after head and rec_head are updated, so it
+ * works as a doorbell: spin on it for a while, then sleep with
+ * KERNELTALK_IOC_WAIT, which returns once seq differs from the value passed in
+ * (FUTEX_WAIT semantics; modules cannot issue futex wakeups themselves).
+ */
+struct kerneltalk_ctrl
+{
+	__u32 seq;		   /* commit counter, 32-bit aligned for futex use */
+	__u32 ring_size;   /* size of the ring in bytes */
+	__u32 ring_offset; /* offset of the ring from the start of the mapping */
+	__u32 nr_recs;	   /* entries in rec_end, a power of two */
+	__u64 head;	   /* position where the next write goes */
+	__u64 rec_head; /* number of the next record */
+	__u64 rec_end[];
+};
+
+struct kerneltalk_wait
+{
+	__u32 seq;		  /* value of kerneltalk_ctrl.seq last seen */
+	__u32 timeout_ms; /* KERNELTALK_SYNC_FOREVER waits without a timeout */
+};
+
+#define KERNELTALK_IOC_WAIT _IOW(KERNELTALK_IOC_MAGIC, 7, struct kerneltalk_wait)
+
+/*
+ * Notification. A client is notified when its unread byte count rises to its
+ * low-water mark (1 unless set with SET_LOWAT): the registered eventfd is
+ * signalled and, with O_ASYNC/fcntl(F_SETOWN), SIGIO is raised. This is edge
+ * triggered: the next notification comes after the client has read below the
+ * mark again. poll() only reports the device readable at the mark, too.
+ *
+ * SET_EVENTFD takes a pointer to the eventfd; -1 unregisters it.
+ */
+#define KERNELTALK_IOC_SET_EVENTFD _IOW(KERNELTALK_IOC_MAGIC, 8, __s32)
+#define KERNELTALK_IOC_SET_LOWAT _IOW(KERNELTALK_IOC_MAGIC, 9, __u32)
+
+/*
+ * Corking. While a client is corked, what it writes is staged in a buffer of
+ * its own instead of the ring, and all of it becomes visible at once, with a
+ * single wakeup, when it uncorks. A message sent with KERNELTALK_MSG_MORE is
+ * staged the same way until the client's next message without it, or its
+ * next write(). Other writers' messages never wait for a client's stage.
+ *
+ * The stage holds up to the smallest ring the channel may have, at most 1 MiB;
+ * when it fills up it is flushed. A message too big for it goes straight to
+ * the ring after the rest. Staged data is flushed anyway once the timeout has
+ * passed since the first of it was written, and by SYNC and fsync(); if there
+ * is no room then, it goes out as soon as there is. What is still staged when
+ * the client closes and doesn't fit the ring right away is lost.
+ *
+ * CORK takes a pointer to that timeout in milliseconds, at most
+ * KERNELTALK_CORK_MAX_MS; 0 uncorks. KERNELTALK_MSG_MORE without a cork uses
+ * the module's cork_ms.
+ */
+#define KERNELTALK_CORK_MAX_MS 1000
+#define KERNELTALK_IOC_CORK _IOW(KERNELTALK_IOC_MAGIC, 10, __u32)
+
+#endif /* KERNELTALK_H */
@@ -0,0 +1,448 @@
+/*
+ * KernelTalk: kernel based chat
+ *
+ * C++20 coroutines on top of libkerneltalk. A reactor runs an epoll loop, and
+ * channels opened on it are awaited instead of blocking:
+ *
+ *     kerneltalk::task<> printer(kerneltalk::channel &ch)
+ *     {
+ *         for (;;)
+ *         {
+ *             kerneltalk::message msg = co_await ch.receive();
+ *             std::cout << msg.str();
+ *         }
+ *     }
+ *
+ *     kerneltalk::reactor r;
+ *     kerneltalk::channel ch(r, "/dev/kerneltalk");
+ *     r.spawn(printer(ch));
+ *     r.run();
+ *
+ * A message is a view of the record in the mapped ring when the channel maps
+ * it, so receiving copies and allocates nothing. The channel moves past the
+ * message when it is destroyed (or released), and only one message per
+ * channel can be held at a time.
+ *
+ * Header only; link with libkerneltalk.
+ */
+
+#ifndef KERNELTALK_HPP
+#define KERNELTALK_HPP
+
+#include <cerrno>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "kerneltalk.h"
+#include "libkerneltalk.h"
+
+namespace kerneltalk
+{
+
+template <typename T = void>
+class task;
+
+namespace detail
+{
+
+struct promise_base
+{
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+    std::exception_ptr error;
+
+    // tasks are lazy, they start when awaited or spawned
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    struct final_awaiter
+    {
+        bool await_ready() noexcept { return false; }
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+        {
+            return h.promise().continuation;
+        }
+        void await_resume() noexcept {}
+    };
+    final_awaiter final_suspend() noexcept { return {}; }
+
+    void unhandled_exception() { error = std::current_exception(); }
+};
+
+template <typename T>
+struct promise : promise_base
+{
+    std::optional<T> value;
+
+    task<T> get_return_object();
+    void return_value(T v) { value.emplace(std::move(v)); }
+    T result()
+    {
+        if (error)
+            std::rethrow_exception(error);
+        return std::move(*value);
+    }
+};
+
+template <>
+struct promise<void> : promise_base
+{
+    task<void> get_return_object();
+    void return_void() {}
+    void result()
+    {
+        if (error)
+            std::rethrow_exception(error);
+    }
+};
+
+inline std::system_error error(const char *what)
+{
+    return std::system_error(errno, std::generic_category(), what);
+}
+
+} // namespace detail
+
+/*
+ * A coroutine returning T. Awaiting it runs it and resumes the caller when it
+ * is done, with its result or its exception.
+ */
+template <typename T>
+class task
+{
+public:
+    using promise_type = detail::promise<T>;
+
+    explicit task(std::coroutine_handle<promise_type> h) : h_(h) {}
+    task(task &&other) noexcept : h_(std::exchange(other.h_, {})) {}
+    task &operator=(task &&other) noexcept
+    {
+        if (this != &other)
+        {
+            if (h_)
+                h_.destroy();
+            h_ = std::exchange(other.h_, {});
+        }
+        return *this;
+    }
+    ~task()
+    {
+        if (h_)
+            h_.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+    {
+        h_.promise().continuation = caller;
+        return h_;
+    }
+    T await_resume() { return h_.promise().result(); }
+
+private:
+    friend class reactor;
+    std::coroutine_handle<promise_type> h_;
+};
+
+template <typename T>
+task<T> detail::promise<T>::get_return_object()
+{
+    return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void> detail::promise<void>::get_return_object()
+{
+    return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+/*
+ * A file descriptor in the reactor, with at most one coroutine waiting to
+ * read and one waiting to write. out is the event a writer waits for.
+ */
+struct watch
+{
+    int fd = -1;
+    bool added = false;
+    std::uint32_t out = EPOLLOUT;
+    std::coroutine_handle<> reader;
+    std::coroutine_handle<> writer;
+};
+
+class reactor
+{
+public:
+    reactor() : epfd_(epoll_create1(EPOLL_CLOEXEC))
+    {
+        if (epfd_ < 0)
+            throw detail::error("epoll_create1");
+    }
+    ~reactor() { close(epfd_); }
+    reactor(const reactor &) = delete;
+    reactor &operator=(const reactor &) = delete;
+
+    /*
+     * Start a coroutine, which runs until it first waits. The reactor keeps
+     * it until it finishes.
+     */
+    void spawn(task<void> t)
+    {
+        std::coroutine_handle<> h = t.h_;
+        spawned_.push_back(std::move(t));
+        h.resume();
+    }
+
+    /*
+     * Run until every spawned coroutine has finished. An exception escaping
+     * one of them comes out of here.
+     */
+    void run()
+    {
+        epoll_event events[64];
+        std::vector<std::coroutine_handle<>> ready;
+        int i, n;
+
+        reap();
+        while (!spawned_.empty())
+        {
+            n = epoll_wait(epfd_, events, 64, -1);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                throw detail::error("epoll_wait");
+
+            // collect first: resuming may close channels we still look at
+            for (i = 0; i < n; i++)
+                take(*static_cast<watch *>(events[i].data.ptr), events[i].events, ready);
+            for (std::coroutine_handle<> h : ready)
+                h.resume();
+            ready.clear();
+            reap();
+        }
+    }
+
+    struct wait_awaiter
+    {
+        reactor &r;
+        watch &w;
+        bool out;
+
+        bool await_ready() noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            (out ? w.writer : w.reader) = h;
+            r.arm(w);
+        }
+        void await_resume() noexcept {}
+    };
+
+    wait_awaiter readable(watch &w) { return {*this, w, false}; }
+    wait_awaiter writable(watch &w) { return {*this, w, true}; }
+
+    void forget(watch &w)
+    {
+        if (w.added)
+            epoll_ctl(epfd_, EPOLL_CTL_DEL, w.fd, nullptr);
+        w.added = false;
+    }
+
+private:
+    // one-shot, so a wakeup is only delivered to the coroutines waiting now
+    void arm(watch &w)
+    {
+        epoll_event ev = {};
+
+        ev.events = EPOLLONESHOT | (w.reader ? EPOLLIN : 0u) | (w.writer ? w.out : 0u);
+        ev.data.ptr = &w;
+        if (epoll_ctl(epfd_, w.added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, w.fd, &ev) < 0)
+            throw detail::error("epoll_ctl");
+        w.added = true;
+    }
+
+    void take(watch &w, std::uint32_t events, std::vector<std::coroutine_handle<>> &ready)
+    {
+        bool failed = events & (EPOLLERR | EPOLLHUP);
+
+        if (w.reader && (failed || (events & EPOLLIN)))
+            ready.push_back(std::exchange(w.reader, {}));
+        if (w.writer && (failed || (events & w.out)))
+            ready.push_back(std::exchange(w.writer, {}));
+        if (w.reader || w.writer)
+            arm(w);
+    }
+
+    void reap()
+    {
+        std::exception_ptr error;
+
+        for (auto it = spawned_.begin(); it != spawned_.end();)
+        {
+            if (!it->h_.done())
+            {
+                ++it;
+                continue;
+            }
+            if (it->h_.promise().error && !error)
+                error = it->h_.promise().error;
+            it = spawned_.erase(it);
+        }
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    int epfd_;
+    std::vector<task<void>> spawned_;
+};
+
+class channel;
+
+/*
+ * A received message. Move-only; the channel moves past it when it is
+ * destroyed or released, so the data must not be used after that.
+ */
+class message
+{
+public:
+    message() = default;
+    message(message &&other) noexcept
+        : ch_(std::exchange(other.ch_, nullptr)), view_(other.view_) {}
+    message &operator=(message &&other) noexcept
+    {
+        if (this != &other)
+        {
+            release();
+            ch_ = std::exchange(other.ch_, nullptr);
+            view_ = other.view_;
+        }
+        return *this;
+    }
+    ~message() { release(); }
+
+    std::span<const std::byte> data() const
+    {
+        return {static_cast<const std::byte *>(view_.data), view_.len};
+    }
+    std::string_view str() const
+    {
+        return {static_cast<const char *>(view_.data), view_.len};
+    }
+    const kt_msginfo &info() const { return view_.info; }
+
+    inline void release() noexcept;
+
+private:
+    friend class channel;
+    message(channel *ch, const struct kt_view &view) : ch_(ch), view_(view) {}
+
+    channel *ch_ = nullptr;
+    struct kt_view view_ = {};
+};
+
+/*
+ * A channel opened non-blocking on a reactor. One coroutine may receive and
+ * another send at the same time. Buffers passed to send() must stay valid
+ * until it completes, as usual for awaited calls.
+ */
+class channel
+{
+public:
+    channel(reactor &r, const char *path, int flags = 0)
+        : r_(r), ch_(kt_open(path, flags | KT_NONBLOCK))
+    {
+        if (!ch_)
+            throw detail::error(path);
+        w_.fd = kt_fd(ch_);
+        // a shm channel's fd only becomes readable, for room too
+        if (kt_mode(ch_) == KT_MODE_SHM)
+            w_.out = EPOLLIN;
+    }
+    ~channel()
+    {
+        r_.forget(w_);
+        kt_close(ch_);
+    }
+    channel(const channel &) = delete;
+    channel &operator=(const channel &) = delete;
+
+    task<message> receive()
+    {
+        struct kt_view view;
+
+        if (viewing_)
+            throw std::logic_error("kerneltalk: previous message still held");
+        while (kt_view(ch_, &view) < 0)
+        {
+            if (errno != EAGAIN)
+                throw detail::error("kt_view");
+            co_await r_.readable(w_);
+        }
+        viewing_ = true;
+        co_return message(this, view);
+    }
+
+    /*
+     * Send one message. With KT_MORE it is only queued and goes out with the
+     * next send without it, or flush().
+     */
+    task<void> send(std::span<const std::byte> data, int flags = 0)
+    {
+        while (kt_send(ch_, data.data(), data.size(), flags) < 0)
+        {
+            if (errno != EAGAIN)
+                throw detail::error("kt_send");
+            co_await r_.writable(w_);
+        }
+        if (!(flags & KT_MORE))
+            co_await flush();
+    }
+
+    task<void> send(std::string_view s, int flags = 0)
+    {
+        return send(std::as_bytes(std::span(s.data(), s.size())), flags);
+    }
+
+    task<void> flush()
+    {
+        while (kt_queued(ch_) && kt_flush(ch_) < 0)
+        {
+            if (errno != EAGAIN)
+                throw detail::error("kt_flush");
+            co_await r_.writable(w_);
+        }
+    }
+
+    kt_channel *native() const { return ch_; }
+
+private:
+    friend class message;
+
+    void consume() noexcept
+    {
+        kt_consume(ch_);
+        viewing_ = false;
+    }
+
+    reactor &r_;
+    kt_channel *ch_;
+    watch w_;
+    bool viewing_ = false;
+};
+
+inline void message::release() noexcept
+{
+    if (ch_)
+        std::exchange(ch_, nullptr)->consume();
+}
+
+} // namespace kerneltalk
+
+#endif /* KERNELTALK_HPP */
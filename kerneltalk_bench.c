@@ -0,0 +1,1935 @@
+/*
+ * KernelTalk: kernel based chat
+ *
+ * Benchmarks for the KernelTalk kernel module.
+ *
+ *   kerneltalk_bench fanout [-n ITERATIONS] [-s SIZE] [-t THREADS] FILENAME COUNT...
+ *
+ * fanout measures how long a write() takes depending on how many subscribers
+ * sleep on the channel. For every COUNT it opens that many subscriber files and
+ * parks them in epoll, so each one of them sits on the channel's wait queue,
+ * then times writes of SIZE bytes. After each write it waits with fsync() until
+ * every subscriber has consumed it. The output has one line per COUNT, in
+ * columns that gnuplot can plot directly.
+ *
+ *   kerneltalk_bench scale [-d SECONDS] [-s SIZE] [-t THREADS] FILENAME COUNT...
+ *
+ * scale measures a channel with COUNT subscribers that actually read. A writer
+ * streams timestamped messages of SIZE bytes for SECONDS while THREADS reader
+ * threads receive them with the batch ioctl. One subscriber per thread is a
+ * probe whose messages are timed end to end. Reported are write throughput and
+ * the probes' read latency.
+ *
+ *   kerneltalk_bench stream [-d SECONDS] [-s SIZE] FILENAME
+ *
+ * stream measures a reader that consumes the channel straight out of the
+ * shared mapping. A writer thread writes SIZE byte chunks for SECONDS, the
+ * reader touches every cache line of them in the mapped ring and then skips
+ * past them. Reported are the read throughput, the reader's dTLB load misses
+ * per MiB and how much of the ring was mapped with huge pages; load the module
+ * with a big ring_size and huge_pages=0 or 1 to compare.
+ *
+ *   kerneltalk_bench rtlat [-d SECONDS] [-i INTERVAL_US] [-p PRIO] [-c CPU]
+ *                          [-w CPU] [-n WRITERS] [-s SIZE] [-H] FILENAME
+ *
+ * rtlat is cyclictest for a channel. A SCHED_FIFO reader at PRIO on CPU -c
+ * sleeps on the channel, and a probe thread just below it writes a timestamp
+ * every INTERVAL_US. Meanwhile WRITERS normal threads on CPU -w keep writing
+ * SIZE byte messages, contending for the channel's lock. With -H a SCHED_FIFO
+ * hog between the two priorities burns CPU -w half of the time, which is what
+ * turns lock contention into priority inversion unless the module runs with
+ * rt_locking=1. Reported is how long the probe messages took to reach the
+ * reader. Needs the privilege to use SCHED_FIFO.
+ *
+ *   kerneltalk_bench ipc [-T TRANSPORT,...] [-w WRITERS] [-r READERS]
+ *                        [-d SECONDS] [-s SIZE|MIN-MAX|exp:MEAN] [-C CPUS]
+ *                        [FILENAME]
+ *
+ * ipc forks WRITERS writer and READERS reader processes, pinned round-robin to
+ * CPUS (a list like 0-3,8) if given, and has every reader receive every
+ * message for SECONDS. Sizes are fixed, uniform or exponential. The same run
+ * is repeated over the channel and over pipes, AF_UNIX datagram sockets and
+ * POSIX message queues as baselines, which fan out by sending each message to
+ * every reader. The shm transport runs the same traffic over libkerneltalk's
+ * shared-memory channels, to compare them with the module. Reported per
+ * transport are delivered messages and bytes per second, end-to-end latency
+ * percentiles and CPU time per delivered message. Before the kerneltalk run
+ * the channel's record descriptors are used up with one-byte messages, and
+ * ipc fails if poll() still reports POLLOUT, which would make every epoll
+ * sender spin.
+ *
+ *   kerneltalk_bench ring [-d SECONDS] [-r READERS] [-z RING_SIZE]
+ *                         [-s MAX_SIZE] [-S SEED]
+ *
+ * ring runs the module's ring and cursor code (kerneltalk_ring.h) in user
+ * space, without a device. A model channel with READERS cursors gets random
+ * writes of up to MAX_SIZE bytes, half of them like write(), which extends the
+ * newest record once every descriptor is in use, and reads, record skips and
+ * readers reopening, for SECONDS. Every byte read is checked, and every few
+ * thousand operations the heap, the cursors' record numbers and the room to
+ * write are recomputed from scratch; any mismatch stops the run with an error.
+ * Reported is the operation rate. The seed is printed, -S repeats a run.
+ */
+
+#define _GNU_SOURCE // sched_setaffinity and friends
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <poll.h>
+#include <math.h>
+#include <limits.h>
+#include <mqueue.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "kerneltalk.h"
+#include "kerneltalk_ring.h"
+#include "libkerneltalk.h"
+
+#define WARMUP 16
+#define BATCH 64
+#define MAX_SAMPLES (1 << 20)
+
+struct drainer
+{
+    pthread_t thread;
+    int epfd;
+    int stopfd;
+};
+
+struct reader
+{
+    pthread_t thread;
+    int epfd;
+    int stopfd;
+    int probe;
+    int size;
+    long long *samples;
+    int nsamples;
+};
+
+void die(const char *what)
+{
+    perror(what);
+    exit(EXIT_FAILURE);
+}
+
+long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Value at percentile p of a sorted array.
+ */
+long long percentile(long long *sorted, int n, double p)
+{
+    int i = (int)(p / 100.0 * (n - 1) + 0.5);
+    return sorted[i];
+}
+
+/*
+ * Allow as many open files as the hard limit permits; big fan-outs need them.
+ */
+void raise_nofile(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/*
+ * Throw away everything that is pending on fd.
+ */
+void drain(int fd)
+{
+    struct kerneltalk_skip skip = {.count = ~0ULL};
+
+    if (ioctl(fd, KERNELTALK_IOC_SKIP, &skip) < 0)
+        die("KERNELTALK_IOC_SKIP");
+}
+
+void *drainer_main(void *arg)
+{
+    struct drainer *d = arg;
+    struct epoll_event events[64];
+    int i, n;
+
+    for (;;)
+    {
+        n = epoll_wait(d->epfd, events, 64, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            die("epoll_wait");
+        }
+        for (i = 0; i < n; i++)
+        {
+            if (events[i].data.fd == d->stopfd)
+                return NULL;
+            drain(events[i].data.fd);
+        }
+    }
+}
+
+/*
+ * One fanout measurement: open count subscribers spread over nthreads
+ * drainers, time iterations writes, print a line and clean up.
+ */
+void fanout_run(const char *path, int count, int iterations, int size,
+                int nthreads)
+{
+    struct drainer *drainers;
+    struct epoll_event ev;
+    long long *lat, t0;
+    char *msg;
+    int *fds;
+    int wfd, i;
+
+    drainers = calloc(nthreads, sizeof(*drainers));
+    fds = calloc(count, sizeof(*fds));
+    lat = calloc(iterations, sizeof(*lat));
+    msg = malloc(size);
+    if (!drainers || !fds || !lat || !msg)
+        die("kerneltalk_bench");
+    memset(msg, 'x', size);
+
+    wfd = open(path, O_RDWR);
+    if (wfd < 0)
+        die(path);
+
+    for (i = 0; i < nthreads; i++)
+    {
+        drainers[i].epfd = epoll_create1(0);
+        drainers[i].stopfd = eventfd(0, 0);
+        if (drainers[i].epfd < 0 || drainers[i].stopfd < 0)
+            die("kerneltalk_bench");
+        ev.events = EPOLLIN;
+        ev.data.fd = drainers[i].stopfd;
+        epoll_ctl(drainers[i].epfd, EPOLL_CTL_ADD, drainers[i].stopfd, &ev);
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        fds[i] = open(path, O_RDWR | O_NONBLOCK);
+        if (fds[i] < 0)
+            die(path);
+        ev.events = EPOLLIN;
+        ev.data.fd = fds[i];
+        if (epoll_ctl(drainers[i % nthreads].epfd, EPOLL_CTL_ADD, fds[i], &ev) < 0)
+            die("epoll_ctl");
+    }
+
+    for (i = 0; i < nthreads; i++)
+        pthread_create(&drainers[i].thread, NULL, drainer_main, &drainers[i]);
+
+    for (i = -WARMUP; i < iterations; i++)
+    {
+        t0 = now_ns();
+        if (write(wfd, msg, size) != size)
+            die("write");
+        if (i >= 0)
+            lat[i] = now_ns() - t0;
+        if (fsync(wfd) < 0)
+            die("fsync");
+        drain(wfd);
+    }
+
+    for (i = 0; i < nthreads; i++)
+    {
+        eventfd_write(drainers[i].stopfd, 1);
+        pthread_join(drainers[i].thread, NULL);
+        close(drainers[i].epfd);
+        close(drainers[i].stopfd);
+    }
+    for (i = 0; i < count; i++)
+        close(fds[i]);
+    close(wfd);
+
+    qsort(lat, iterations, sizeof(*lat), cmp_ll);
+    printf("%d\t%lld\t%lld\t%lld\t%lld\n", count, percentile(lat, iterations, 50),
+           percentile(lat, iterations, 90), percentile(lat, iterations, 99),
+           lat[iterations - 1]);
+    fflush(stdout);
+
+    free(drainers);
+    free(fds);
+    free(lat);
+    free(msg);
+}
+
+void *reader_main(void *arg)
+{
+    struct reader *rd = arg;
+    struct kerneltalk_msg msgs[BATCH];
+    struct kerneltalk_mmsg mm = {.msgs = (unsigned long)msgs, .count = BATCH};
+    struct epoll_event events[64];
+    char *bufs;
+    long long now, sent;
+    int i, j, n, got;
+
+    bufs = malloc((size_t)BATCH * rd->size);
+    if (!bufs)
+        die("kerneltalk_bench");
+
+    for (;;)
+    {
+        n = epoll_wait(rd->epfd, events, 64, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            die("epoll_wait");
+        }
+        for (i = 0; i < n; i++)
+        {
+            if (events[i].data.fd == rd->stopfd)
+            {
+                free(bufs);
+                return NULL;
+            }
+            for (;;)
+            {
+                for (j = 0; j < BATCH; j++)
+                {
+                    msgs[j].buf = (unsigned long)(bufs + (size_t)j * rd->size);
+                    msgs[j].len = rd->size;
+                }
+                got = ioctl(events[i].data.fd, KERNELTALK_IOC_RECVMMSG, &mm);
+                if (got < 0)
+                {
+                    if (errno == EAGAIN)
+                        break;
+                    die("KERNELTALK_IOC_RECVMMSG");
+                }
+                if (events[i].data.fd != rd->probe)
+                    continue;
+                now = now_ns();
+                for (j = 0; j < got && rd->nsamples < MAX_SAMPLES; j++)
+                {
+                    if (msgs[j].len < sizeof(sent) || (msgs[j].flags & KERNELTALK_MSG_PARTIAL))
+                        continue;
+                    memcpy(&sent, bufs + (size_t)j * rd->size, sizeof(sent));
+                    rd->samples[rd->nsamples++] = now - sent;
+                }
+            }
+        }
+    }
+}
+
+/*
+ * One scale measurement: count reading subscribers spread over nthreads
+ * readers, a writer streaming for the given number of seconds.
+ */
+void scale_run(const char *path, int count, int seconds, int size, int nthreads)
+{
+    struct reader *readers;
+    struct epoll_event ev;
+    long long start, end, now, msgs = 0, *lat;
+    char *msg;
+    int *fds;
+    int wfd, i, nlat = 0;
+
+    readers = calloc(nthreads, sizeof(*readers));
+    fds = calloc(count, sizeof(*fds));
+    msg = malloc(size);
+    if (!readers || !fds || !msg)
+        die("kerneltalk_bench");
+    memset(msg, 'x', size);
+
+    wfd = open(path, O_RDWR);
+    if (wfd < 0)
+        die(path);
+
+    for (i = 0; i < nthreads; i++)
+    {
+        readers[i].epfd = epoll_create1(0);
+        readers[i].stopfd = eventfd(0, 0);
+        readers[i].probe = -1;
+        readers[i].size = size;
+        readers[i].samples = malloc(MAX_SAMPLES * sizeof(long long));
+        if (readers[i].epfd < 0 || readers[i].stopfd < 0 || !readers[i].samples)
+            die("kerneltalk_bench");
+        ev.events = EPOLLIN;
+        ev.data.fd = readers[i].stopfd;
+        epoll_ctl(readers[i].epfd, EPOLL_CTL_ADD, readers[i].stopfd, &ev);
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        fds[i] = open(path, O_RDWR | O_NONBLOCK);
+        if (fds[i] < 0)
+            die(path);
+        if (readers[i % nthreads].probe < 0)
+            readers[i % nthreads].probe = fds[i];
+        ev.events = EPOLLIN;
+        ev.data.fd = fds[i];
+        if (epoll_ctl(readers[i % nthreads].epfd, EPOLL_CTL_ADD, fds[i], &ev) < 0)
+            die("epoll_ctl");
+    }
+
+    for (i = 0; i < nthreads; i++)
+        pthread_create(&readers[i].thread, NULL, reader_main, &readers[i]);
+
+    start = now_ns();
+    end = start + seconds * 1000000000LL;
+    do
+    {
+        now = now_ns();
+        memcpy(msg, &now, size < (int)sizeof(now) ? size : (int)sizeof(now));
+        if (write(wfd, msg, size) != size)
+            die("write");
+        drain(wfd); // the writer is a subscriber too
+        msgs++;
+    } while (now < end);
+    end = now_ns();
+
+    for (i = 0; i < nthreads; i++)
+    {
+        eventfd_write(readers[i].stopfd, 1);
+        pthread_join(readers[i].thread, NULL);
+        close(readers[i].epfd);
+        close(readers[i].stopfd);
+        nlat += readers[i].nsamples;
+    }
+    for (i = 0; i < count; i++)
+        close(fds[i]);
+    close(wfd);
+
+    lat = malloc((nlat ? nlat : 1) * sizeof(*lat));
+    if (!lat)
+        die("kerneltalk_bench");
+    for (nlat = 0, i = 0; i < nthreads; i++)
+    {
+        memcpy(lat + nlat, readers[i].samples, readers[i].nsamples * sizeof(*lat));
+        nlat += readers[i].nsamples;
+        free(readers[i].samples);
+    }
+    qsort(lat, nlat, sizeof(*lat), cmp_ll);
+
+    printf("%d\t%.0f\t%.2f\t%.1f\t%.1f\n", count, msgs * 1e9 / (end - start),
+           msgs * (double)size * 1e9 / (end - start) / (1 << 20),
+           nlat ? percentile(lat, nlat, 50) / 1e3 : 0.0,
+           nlat ? percentile(lat, nlat, 99) / 1e3 : 0.0);
+    fflush(stdout);
+
+    free(readers);
+    free(fds);
+    free(lat);
+    free(msg);
+}
+
+struct streamer
+{
+    pthread_t thread;
+    const char *path;
+    int size;
+    volatile int stop;
+};
+
+void *streamer_main(void *arg)
+{
+    struct streamer *st = arg;
+    char *msg;
+    int fd;
+
+    fd = open(st->path, O_RDWR);
+    msg = malloc(st->size);
+    if (fd < 0 || !msg)
+        die(st->path);
+    memset(msg, 'x', st->size);
+
+    while (!st->stop)
+    {
+        if (write(fd, msg, st->size) < 0)
+            die("write");
+        drain(fd); // the writer is a subscriber too
+    }
+
+    close(fd);
+    free(msg);
+    return NULL;
+}
+
+/*
+ * Count dTLB load misses of the calling thread in user space, or return -1 if
+ * perf events are not available.
+ */
+int dtlb_counter(void)
+{
+    struct perf_event_attr pe;
+
+    memset(&pe, 0, sizeof(pe));
+    pe.type = PERF_TYPE_HW_CACHE;
+    pe.size = sizeof(pe);
+    pe.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    pe.disabled = 1;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+}
+
+/*
+ * Kilobytes of the mapping at addr that are mapped with huge pages, from
+ * /proc/self/smaps.
+ */
+long pmd_mapped_kb(void *addr)
+{
+    char line[256];
+    unsigned long start, stop;
+    long kb = 0;
+    int found = 0;
+    FILE *f;
+
+    f = fopen("/proc/self/smaps", "r");
+    if (!f)
+        return 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        if (sscanf(line, "%lx-%lx ", &start, &stop) == 2)
+            found = start == (unsigned long)addr;
+        else if (found && sscanf(line, "FilePmdMapped: %ld kB", &kb) == 1)
+            break;
+    }
+    fclose(f);
+    return kb;
+}
+
+volatile unsigned long long sink; // keeps the reader's loads alive
+
+#define PROBE_MAGIC 0x45424f5250544bULL // "KTPROBE"
+
+struct probe
+{
+    unsigned long long magic;
+    long long sent;
+};
+
+struct rtlat
+{
+    const char *path;
+    int interval_us;
+    int prio;
+    int reader_cpu;
+    int writer_cpu;
+    int size;
+    volatile int stop;         // for the writers and the hog
+    volatile int reader_stop;  // once the writers are gone
+    long long *samples;
+    int nsamples;
+};
+
+/*
+ * Run the calling thread with SCHED_FIFO at prio (0 keeps SCHED_OTHER) on cpu
+ * (-1 for any).
+ */
+void rt_setup(int prio, int cpu)
+{
+    struct sched_param sp = {.sched_priority = prio};
+    cpu_set_t set;
+    int err;
+
+    if (cpu >= 0)
+    {
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if ((err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)))
+        {
+            errno = err;
+            die("pthread_setaffinity_np");
+        }
+    }
+    if (prio > 0 && (err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp)))
+    {
+        errno = err;
+        die("pthread_setschedparam");
+    }
+}
+
+/*
+ * Commit msg as one record, never split like a short write() would. Every
+ * writer drains its own file, and drains while waiting for room: blocking
+ * instead could leave two writers each waiting for the other to read.
+ */
+void write_draining(int fd, const void *msg, int size)
+{
+    struct kerneltalk_msg m = {.buf = (unsigned long)msg, .len = size};
+    struct kerneltalk_mmsg mm = {.msgs = (unsigned long)&m, .count = 1,
+                                 .flags = KERNELTALK_MMSG_DONTWAIT};
+
+    for (;;)
+    {
+        drain(fd);
+        if (ioctl(fd, KERNELTALK_IOC_SENDMMSG, &mm) == 1)
+            return;
+        if (errno != EAGAIN)
+            die("KERNELTALK_IOC_SENDMMSG");
+        sched_yield();
+    }
+}
+
+void *rtlat_reader(void *arg)
+{
+    struct rtlat *rl = arg;
+    struct kerneltalk_msg msgs[BATCH];
+    struct kerneltalk_mmsg mm = {.msgs = (unsigned long)msgs, .count = BATCH,
+                                 .flags = KERNELTALK_MMSG_DONTWAIT};
+    struct pollfd pfd = {.events = POLLIN};
+    struct probe probe;
+    char *bufs;
+    long long now;
+    int i, got;
+
+    rt_setup(rl->prio, rl->reader_cpu);
+    pfd.fd = open(rl->path, O_RDONLY);
+    bufs = malloc((size_t)BATCH * rl->size);
+    if (pfd.fd < 0 || !bufs)
+        die(rl->path);
+
+    while (!rl->reader_stop)
+    {
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
+        for (;;)
+        {
+            for (i = 0; i < BATCH; i++)
+            {
+                msgs[i].buf = (unsigned long)(bufs + (size_t)i * rl->size);
+                msgs[i].len = rl->size;
+            }
+            got = ioctl(pfd.fd, KERNELTALK_IOC_RECVMMSG, &mm);
+            if (got < 0)
+            {
+                if (errno == EAGAIN)
+                    break;
+                die("KERNELTALK_IOC_RECVMMSG");
+            }
+            now = now_ns();
+            for (i = 0; i < got && rl->nsamples < MAX_SAMPLES; i++)
+            {
+                if (msgs[i].len != sizeof(probe))
+                    continue;
+                memcpy(&probe, bufs + (size_t)i * rl->size, sizeof(probe));
+                if (probe.magic == PROBE_MAGIC)
+                    rl->samples[rl->nsamples++] = now - probe.sent;
+            }
+        }
+    }
+
+    close(pfd.fd);
+    free(bufs);
+    return NULL;
+}
+
+void *rtlat_probe(void *arg)
+{
+    struct rtlat *rl = arg;
+    struct probe probe = {.magic = PROBE_MAGIC};
+    struct timespec next;
+    int fd;
+
+    rt_setup(rl->prio - 1, -1);
+    fd = open(rl->path, O_RDWR);
+    if (fd < 0)
+        die(rl->path);
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (!rl->stop)
+    {
+        next.tv_nsec += rl->interval_us * 1000L;
+        while (next.tv_nsec >= 1000000000L)
+        {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        probe.sent = now_ns();
+        write_draining(fd, &probe, sizeof(probe));
+    }
+
+    close(fd);
+    return NULL;
+}
+
+void *rtlat_writer(void *arg)
+{
+    struct rtlat *rl = arg;
+    char *msg;
+    int fd;
+
+    rt_setup(0, rl->writer_cpu);
+    fd = open(rl->path, O_RDWR);
+    msg = malloc(rl->size);
+    if (fd < 0 || !msg)
+        die(rl->path);
+    memset(msg, 'x', rl->size);
+
+    while (!rl->stop)
+        write_draining(fd, msg, rl->size);
+
+    close(fd);
+    free(msg);
+    return NULL;
+}
+
+/*
+ * Burn the writers' CPU for a millisecond, sleep for one, and so on.
+ */
+void *rtlat_hog(void *arg)
+{
+    struct rtlat *rl = arg;
+    struct timespec ms = {.tv_nsec = 1000000};
+    long long until;
+
+    rt_setup(rl->prio / 2, rl->writer_cpu);
+    while (!rl->stop)
+    {
+        until = now_ns() + 1000000;
+        while (now_ns() < until)
+            ;
+        nanosleep(&ms, NULL);
+    }
+    return NULL;
+}
+
+int rtlat_main(int argc, char **argv)
+{
+    struct rtlat rl = {.interval_us = 1000, .prio = 80, .reader_cpu = -1,
+                       .writer_cpu = -1, .size = 64};
+    pthread_t reader, probe, hog, *writers;
+    long long sum = 0;
+    int seconds = 5, nwriters = 2, use_hog = 0;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "d:i:p:c:w:n:s:H")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 'i':
+            rl.interval_us = atoi(optarg);
+            break;
+        case 'p':
+            rl.prio = atoi(optarg);
+            break;
+        case 'c':
+            rl.reader_cpu = atoi(optarg);
+            break;
+        case 'w':
+            rl.writer_cpu = atoi(optarg);
+            break;
+        case 'n':
+            nwriters = atoi(optarg);
+            break;
+        case 's':
+            rl.size = atoi(optarg);
+            break;
+        case 'H':
+            use_hog = 1;
+            break;
+        default:
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind + 1 != argc || seconds < 1 || rl.interval_us < 1 || rl.prio < 3 ||
+        rl.prio > 99 || nwriters < 0 || rl.size < (int)sizeof(struct probe))
+    {
+        fprintf(stderr, "usage: kerneltalk_bench rtlat [-d SECONDS] [-i INTERVAL_US] "
+                        "[-p PRIO] [-c CPU] [-w CPU] [-n WRITERS] [-s SIZE] [-H] FILENAME\n");
+        return EXIT_FAILURE;
+    }
+    rl.path = argv[optind];
+    rl.samples = malloc(MAX_SAMPLES * sizeof(long long));
+    writers = calloc(nwriters ? nwriters : 1, sizeof(*writers));
+    if (!rl.samples || !writers)
+        die("kerneltalk_bench");
+
+    pthread_create(&reader, NULL, rtlat_reader, &rl);
+    usleep(100000); // the reader must be subscribed before anything is written
+    for (i = 0; i < nwriters; i++)
+        pthread_create(&writers[i], NULL, rtlat_writer, &rl);
+    if (use_hog)
+        pthread_create(&hog, NULL, rtlat_hog, &rl);
+    pthread_create(&probe, NULL, rtlat_probe, &rl);
+
+    sleep(seconds);
+    rl.stop = 1;
+    pthread_join(probe, NULL);
+    if (use_hog)
+        pthread_join(hog, NULL);
+    for (i = 0; i < nwriters; i++)
+        pthread_join(writers[i], NULL);
+    rl.reader_stop = 1;
+    pthread_join(reader, NULL);
+
+    for (i = 0; i < rl.nsamples; i++)
+        sum += rl.samples[i];
+    qsort(rl.samples, rl.nsamples, sizeof(long long), cmp_ll);
+
+    printf("# samples\tmin_us\tavg_us\tp99_us\tp999_us\tmax_us\n");
+    if (rl.nsamples)
+        printf("%d\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\n", rl.nsamples,
+               rl.samples[0] / 1e3, sum / 1e3 / rl.nsamples,
+               percentile(rl.samples, rl.nsamples, 99) / 1e3,
+               percentile(rl.samples, rl.nsamples, 99.9) / 1e3,
+               rl.samples[rl.nsamples - 1] / 1e3);
+
+    free(rl.samples);
+    free(writers);
+    return EXIT_SUCCESS;
+}
+
+int stream_main(int argc, char **argv)
+{
+    struct streamer st = {.size = 65536};
+    struct kerneltalk_pending pending;
+    struct kerneltalk_wait wait = {.timeout_ms = 100};
+    struct kerneltalk_skip skip = {0};
+    struct kerneltalk_ctrl *ctrl;
+    const unsigned char *ring;
+    unsigned long long pos, head, idx, len, i, bytes = 0, sum = 0;
+    long long start, end, misses = -1;
+    int seconds = 5, opt, fd, perf;
+
+    while ((opt = getopt(argc, argv, "d:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 's':
+            st.size = atoi(optarg);
+            break;
+        default:
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind + 1 != argc || seconds < 1 || st.size < 1)
+    {
+        fprintf(stderr, "usage: kerneltalk_bench stream [-d SECONDS] [-s SIZE] FILENAME\n");
+        return EXIT_FAILURE;
+    }
+    st.path = argv[optind];
+
+    fd = open(st.path, O_RDONLY);
+    if (fd < 0)
+        die(st.path);
+    ctrl = mmap(NULL, sizeof(*ctrl), PROT_READ, MAP_SHARED, fd, 0);
+    if (ctrl == MAP_FAILED)
+        die("mmap");
+    ring = mmap(NULL, ctrl->ring_size, PROT_READ, MAP_SHARED, fd, ctrl->ring_offset);
+    if (ring == MAP_FAILED)
+        die("mmap");
+    if (ioctl(fd, KERNELTALK_IOC_PENDING, &pending) < 0)
+        die("KERNELTALK_IOC_PENDING");
+    pos = pending.pos;
+
+    pthread_create(&st.thread, NULL, streamer_main, &st);
+    perf = dtlb_counter();
+    if (perf >= 0)
+        ioctl(perf, PERF_EVENT_IOC_ENABLE, 0);
+
+    start = now_ns();
+    end = start + seconds * 1000000000LL;
+    while (now_ns() < end)
+    {
+        // the doorbell before the head, so a commit in between isn't missed
+        wait.seq = __atomic_load_n(&ctrl->seq, __ATOMIC_ACQUIRE);
+        head = __atomic_load_n(&ctrl->head, __ATOMIC_ACQUIRE);
+        if (head == pos)
+        {
+            if (ioctl(fd, KERNELTALK_IOC_WAIT, &wait) < 0 && errno != ETIMEDOUT)
+                die("KERNELTALK_IOC_WAIT");
+            continue;
+        }
+
+        // one load per cache line, wrapping around the end of the ring
+        for (skip.count = head - pos; pos < head; pos += len)
+        {
+            idx = pos & (ctrl->ring_size - 1);
+            len = head - pos < ctrl->ring_size - idx ? head - pos : ctrl->ring_size - idx;
+            for (i = 0; i < len; i += 64)
+                sum += ring[idx + i];
+        }
+        if (ioctl(fd, KERNELTALK_IOC_SKIP, &skip) < 0)
+            die("KERNELTALK_IOC_SKIP");
+        bytes += skip.count;
+    }
+    end = now_ns();
+
+    if (perf >= 0)
+    {
+        ioctl(perf, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(perf, &misses, sizeof(misses)) != sizeof(misses))
+            misses = -1;
+        close(perf);
+    }
+
+    printf("# ring_bytes\tpmd_mapped_kb\tread_mib_per_s\tdtlb_misses_per_mib\n");
+    printf("%u\t%ld\t%.1f\t%.1f\n", ctrl->ring_size, pmd_mapped_kb((void *)ring),
+           bytes * 1e9 / (end - start) / (1 << 20),
+           misses >= 0 && bytes ? misses * (double)(1 << 20) / bytes : -1.0);
+
+    // let the writer finish a blocked write before it sees the stop flag
+    st.stop = 1;
+    munmap((void *)ring, ctrl->ring_size);
+    munmap(ctrl, sizeof(*ctrl));
+    close(fd);
+    pthread_join(st.thread, NULL);
+
+    sink = sum;
+    return EXIT_SUCCESS;
+}
+
+int scale_main(int argc, char **argv)
+{
+    int seconds = 5, size = 64, nthreads = 4;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "d:s:t:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 's':
+            size = atoi(optarg);
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        default:
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind + 2 > argc || seconds < 1 || size < 1 || nthreads < 1)
+    {
+        fprintf(stderr, "usage: kerneltalk_bench scale [-d SECONDS] [-s SIZE] "
+                        "[-t THREADS] FILENAME COUNT...\n");
+        return EXIT_FAILURE;
+    }
+
+    raise_nofile();
+    printf("# subscribers\twrite_msgs_per_s\twrite_mib_per_s\tread_p50_us\tread_p99_us\n");
+    for (i = optind + 1; i < argc; i++)
+        scale_run(argv[optind], atoi(argv[i]), seconds, size, nthreads);
+
+    return EXIT_SUCCESS;
+}
+
+int fanout_main(int argc, char **argv)
+{
+    int iterations = 1000, size = 64, nthreads = 4;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "n:s:t:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 's':
+            size = atoi(optarg);
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        default:
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind + 2 > argc || iterations < 1 || size < 1 || nthreads < 1)
+    {
+        fprintf(stderr, "usage: kerneltalk_bench fanout [-n ITERATIONS] [-s SIZE] "
+                        "[-t THREADS] FILENAME COUNT...\n");
+        return EXIT_FAILURE;
+    }
+
+    raise_nofile();
+    printf("# subscribers\twrite_p50_ns\twrite_p90_ns\twrite_p99_ns\twrite_max_ns\n");
+    for (i = optind + 1; i < argc; i++)
+        fanout_run(argv[optind], atoi(argv[i]), iterations, size, nthreads);
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * The ipc suite. Every transport delivers every message to every reader: the
+ * channel does that by itself, the baselines by sending each message once per
+ * reader, which is how a fan-out over them has to be built.
+ */
+enum transport
+{
+    T_KERNELTALK,
+    T_PIPE,
+    T_UNIX,
+    T_MQ,
+    T_SHM,
+    NR_TRANSPORTS
+};
+
+const char *transport_names[NR_TRANSPORTS] = {"kerneltalk", "pipe", "unix", "mq", "shm"};
+
+#define IPC_SAMPLES (1 << 16) // latency samples kept per reader
+#define IPC_MAX_SIZE 65536
+#define IPC_MAX_PROCS 1024
+#define IPC_SHM_RING (1 << 20) // ring of the shm transport's channel
+#define IPC_FILL_MAX (16LL * KT_RECS_MAX) // see ipc_check_pollout()
+
+/*
+ * Every message starts with this, whatever the transport.
+ */
+struct ipc_hdr
+{
+    unsigned int len; // of the whole message
+    unsigned int pad;
+    long long sent;
+};
+
+/*
+ * Message sizes: fixed, uniform between min and max, or exponential with the
+ * given mean (plus the header), capped at max.
+ */
+struct sizes
+{
+    enum { SIZE_FIXED, SIZE_UNIFORM, SIZE_EXP } kind;
+    int min, max, mean;
+};
+
+int parse_sizes(const char *arg, struct sizes *sz)
+{
+    sz->min = sizeof(struct ipc_hdr);
+    if (sscanf(arg, "exp:%d", &sz->mean) == 1)
+    {
+        sz->kind = SIZE_EXP;
+        sz->max = IPC_MAX_SIZE;
+    }
+    else if (sscanf(arg, "%d-%d", &sz->min, &sz->max) == 2)
+        sz->kind = SIZE_UNIFORM;
+    else
+    {
+        sz->kind = SIZE_FIXED;
+        sz->min = sz->max = atoi(arg);
+    }
+    return sz->min >= (int)sizeof(struct ipc_hdr) && sz->max >= sz->min &&
+           sz->max <= IPC_MAX_SIZE && (sz->kind != SIZE_EXP || sz->mean > 0);
+}
+
+int next_size(const struct sizes *sz, unsigned int *seed)
+{
+    double u;
+
+    switch (sz->kind)
+    {
+    case SIZE_UNIFORM:
+        return sz->min + rand_r(seed) % (sz->max - sz->min + 1);
+    case SIZE_EXP:
+        u = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0);
+        u = sz->min - sz->mean * log(u);
+        return u < sz->max ? (int)u : sz->max;
+    default:
+        return sz->min;
+    }
+}
+
+/*
+ * CPU lists like "0-3,8".
+ */
+int parse_cpus(const char *arg, int *cpus, int max)
+{
+    int n = 0, a, b, len;
+
+    while (*arg && n < max)
+    {
+        if (sscanf(arg, "%d-%d%n", &a, &b, &len) == 2 ||
+            (sscanf(arg, "%d%n", &a, &len) == 1 && (b = a, 1)))
+        {
+            while (a <= b && n < max)
+                cpus[n++] = a++;
+            arg += len;
+        }
+        else
+            return 0;
+        if (*arg == ',')
+            arg++;
+    }
+    return n;
+}
+
+/*
+ * Shared between the parent and its writer and reader processes.
+ */
+struct ipc_shared
+{
+    volatile int ready; // children set up and waiting
+    volatile int start;
+    volatile int stop; // the writers are done, readers quit when idle
+    long long end_ns;
+    struct
+    {
+        long long msgs;
+        long long bytes;
+    } readers[IPC_MAX_PROCS];
+    long long samples[]; // IPC_SAMPLES per reader
+};
+
+struct ipc_run
+{
+    enum transport t;
+    const char *path;
+    int writers, readers, seconds;
+    struct sizes sz;
+    int *cpus, ncpus;
+    int (*fds)[2]; // per reader: [0] written by writers, [1] read by the reader
+    mqd_t (*mqs)[2];
+    char shm[64];          // the shm transport's channel
+    struct kt_channel *ch; // a writer's or reader's own channel on it
+    struct ipc_shared *sh;
+};
+
+void ipc_wait_start(struct ipc_shared *sh)
+{
+    __atomic_add_fetch(&sh->ready, 1, __ATOMIC_SEQ_CST);
+    while (!sh->start)
+        usleep(1000);
+}
+
+/*
+ * write_draining() for a shm channel, whose writers receive what they send
+ * just the same.
+ */
+void send_draining(struct kt_channel *ch, const void *msg, int size)
+{
+    struct kt_view view;
+
+    if (kt_send(ch, msg, size, 0) < 0)
+        die("kt_send");
+    for (;;)
+    {
+        while (kt_view(ch, &view) == 0)
+            kt_consume(ch);
+        if (!kt_queued(ch))
+            return;
+        if (kt_flush(ch) < 0 && errno != EAGAIN)
+            die("kt_flush");
+        sched_yield();
+    }
+}
+
+void ipc_writer(struct ipc_run *run, int id)
+{
+    struct ipc_hdr *hdr;
+    unsigned int seed = id + 1;
+    char *msg;
+    int fd = -1, i;
+
+    msg = calloc(1, run->sz.max);
+    if (!msg)
+        die("kerneltalk_bench");
+    hdr = (struct ipc_hdr *)msg;
+    if (run->t == T_KERNELTALK && (fd = open(run->path, O_RDWR)) < 0)
+        die(run->path);
+    if (run->t == T_SHM && !(run->ch = kt_open(run->shm, KT_NONBLOCK)))
+        die(run->shm);
+
+    ipc_wait_start(run->sh);
+    while (now_ns() < run->sh->end_ns)
+    {
+        hdr->len = next_size(&run->sz, &seed);
+        hdr->sent = now_ns();
+        if (run->t == T_KERNELTALK)
+        {
+            write_draining(fd, msg, hdr->len);
+            continue;
+        }
+        if (run->t == T_SHM)
+        {
+            send_draining(run->ch, msg, hdr->len);
+            continue;
+        }
+        for (i = 0; i < run->readers; i++)
+        {
+            if (run->t == T_PIPE && write(run->fds[i][0], msg, hdr->len) != hdr->len)
+                die("write");
+            if (run->t == T_UNIX && send(run->fds[i][0], msg, hdr->len, 0) != hdr->len)
+                die("send");
+            if (run->t == T_MQ && mq_send(run->mqs[i][0], msg, hdr->len, 0) < 0)
+                die("mq_send");
+        }
+    }
+    exit(EXIT_SUCCESS);
+}
+
+/*
+ * Count a received message. Latency samples are a reservoir, so a long run
+ * is sampled evenly rather than only at the start.
+ */
+void ipc_account(struct ipc_run *run, int id, unsigned int *seed,
+                 const struct ipc_hdr *hdr, long long now)
+{
+    long long *samples = run->sh->samples + (size_t)id * IPC_SAMPLES;
+    long long n = run->sh->readers[id].msgs++;
+    long long j;
+
+    run->sh->readers[id].bytes += hdr->len;
+    if (n < IPC_SAMPLES)
+        j = n;
+    else
+        j = rand_r(seed) % (n + 1);
+    if (j < IPC_SAMPLES)
+        samples[j] = now - hdr->sent;
+}
+
+/*
+ * Receive whatever is there without blocking, return 0 once nothing is left.
+ */
+int ipc_receive(struct ipc_run *run, int id, int fd, char *buf, int *have,
+                unsigned int *seed)
+{
+    struct kerneltalk_msg kmsgs[BATCH];
+    struct kerneltalk_mmsg mm = {.msgs = (unsigned long)kmsgs, .count = BATCH,
+                                 .flags = KERNELTALK_MMSG_DONTWAIT};
+    struct mmsghdr umsgs[BATCH];
+    struct iovec iovs[BATCH];
+    struct kt_msg lmsgs[BATCH];
+    struct ipc_hdr hdr;
+    long long now;
+    int i, n, off;
+
+    switch (run->t)
+    {
+    case T_KERNELTALK:
+        for (i = 0; i < BATCH; i++)
+        {
+            kmsgs[i].buf = (unsigned long)(buf + (size_t)i * run->sz.max);
+            kmsgs[i].len = run->sz.max;
+        }
+        n = ioctl(fd, KERNELTALK_IOC_RECVMMSG, &mm);
+        break;
+    case T_UNIX:
+        for (i = 0; i < BATCH; i++)
+        {
+            iovs[i].iov_base = buf + (size_t)i * run->sz.max;
+            iovs[i].iov_len = run->sz.max;
+            memset(&umsgs[i].msg_hdr, 0, sizeof(umsgs[i].msg_hdr));
+            umsgs[i].msg_hdr.msg_iov = &iovs[i];
+            umsgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        n = recvmmsg(fd, umsgs, BATCH, MSG_DONTWAIT, NULL);
+        break;
+    case T_MQ:
+        n = mq_receive(run->mqs[id][1], buf, run->sz.max, NULL) < 0 ? -1 : 1;
+        break;
+    case T_SHM:
+        for (i = 0; i < BATCH; i++)
+        {
+            lmsgs[i].buf = buf + (size_t)i * run->sz.max;
+            lmsgs[i].len = run->sz.max;
+        }
+        n = kt_recv_many(run->ch, lmsgs, BATCH);
+        break;
+    default:
+        // a byte stream: parse whole messages, keep the rest for next time
+        n = read(fd, buf + *have, (size_t)BATCH * run->sz.max - *have);
+        if (n <= 0)
+            break;
+        *have += n;
+        now = now_ns();
+        for (off = 0; *have - off >= (int)sizeof(hdr); off += hdr.len)
+        {
+            memcpy(&hdr, buf + off, sizeof(hdr));
+            if (*have - off < (int)hdr.len)
+                break;
+            ipc_account(run, id, seed, &hdr, now);
+        }
+        memmove(buf, buf + off, *have - off);
+        *have -= off;
+        return 1;
+    }
+    if (n < 0)
+    {
+        if (errno == EAGAIN)
+            return 0;
+        die("receive");
+    }
+
+    now = now_ns();
+    for (i = 0; i < n; i++)
+    {
+        memcpy(&hdr, buf + (size_t)i * run->sz.max, sizeof(hdr));
+        ipc_account(run, id, seed, &hdr, now);
+    }
+    return n > 0;
+}
+
+void ipc_reader(struct ipc_run *run, int id)
+{
+    struct pollfd pfd = {.events = POLLIN};
+    unsigned int seed = id + 1;
+    int have = 0;
+    char *buf;
+
+    buf = malloc((size_t)BATCH * run->sz.max);
+    if (!buf)
+        die("kerneltalk_bench");
+    if (run->t == T_KERNELTALK)
+        pfd.fd = open(run->path, O_RDONLY);
+    else if (run->t == T_SHM)
+        pfd.fd = (run->ch = kt_open(run->shm, KT_NONBLOCK)) ? kt_fd(run->ch) : -1;
+    else if (run->t == T_MQ)
+        pfd.fd = run->mqs[id][1];
+    else
+        pfd.fd = run->fds[id][1];
+    if (pfd.fd < 0)
+        die(run->path);
+    if (run->t == T_PIPE)
+        fcntl(pfd.fd, F_SETFL, O_NONBLOCK);
+
+    ipc_wait_start(run->sh);
+    // receive first: a shm channel's fd is only armed by a receive that failed
+    for (;;)
+    {
+        while (ipc_receive(run, id, pfd.fd, buf, &have, &seed))
+            ;
+        if (poll(&pfd, 1, 100) <= 0 && run->sh->stop)
+            break;
+    }
+    exit(EXIT_SUCCESS);
+}
+
+/*
+ * Create the per-reader pipes, sockets or queues.
+ */
+void ipc_setup(struct ipc_run *run)
+{
+    struct mq_attr attr = {.mq_maxmsg = 10, .mq_msgsize = run->sz.max};
+    char name[64];
+    int i, fds[2];
+
+    // one channel for everybody, the first process to open it creates it
+    snprintf(run->shm, sizeof(run->shm), "shm:kerneltalk_bench.%d:%d", getpid(), IPC_SHM_RING);
+    for (i = 0; i < run->readers; i++)
+    {
+        if (run->t == T_PIPE)
+        {
+            if (pipe(fds) < 0)
+                die("pipe");
+            run->fds[i][0] = fds[1];
+            run->fds[i][1] = fds[0];
+        }
+        if (run->t == T_UNIX && socketpair(AF_UNIX, SOCK_DGRAM, 0, run->fds[i]) < 0)
+            die("socketpair");
+        if (run->t == T_MQ)
+        {
+            snprintf(name, sizeof(name), "/kerneltalk_bench.%d.%d", getpid(), i);
+            run->mqs[i][0] = mq_open(name, O_WRONLY | O_CREAT | O_EXCL, 0600, &attr);
+            run->mqs[i][1] = mq_open(name, O_RDONLY | O_NONBLOCK);
+            if (run->mqs[i][0] < 0 || run->mqs[i][1] < 0)
+                die("mq_open");
+            mq_unlink(name);
+        }
+    }
+}
+
+void ipc_teardown(struct ipc_run *run)
+{
+    char path[PATH_MAX];
+    int i;
+
+    for (i = 0; i < run->readers; i++)
+    {
+        if (run->t == T_MQ)
+        {
+            mq_close(run->mqs[i][0]);
+            mq_close(run->mqs[i][1]);
+        }
+        else if (run->t == T_PIPE || run->t == T_UNIX)
+        {
+            close(run->fds[i][0]);
+            close(run->fds[i][1]);
+        }
+    }
+    if (run->t != T_SHM)
+        return;
+    // the channel's file and the fifos of its clients
+    snprintf(path, sizeof(path), "/dev/shm/kerneltalk.kerneltalk_bench.%d", getpid());
+    unlink(path);
+    for (i = 0; i < run->writers + run->readers; i++)
+    {
+        snprintf(path, sizeof(path), "/dev/shm/kerneltalk.kerneltalk_bench.%d.%d", getpid(), i);
+        unlink(path);
+    }
+}
+
+/*
+ * Send one-byte messages until the channel has no record descriptor left,
+ * nobody reading them, and check that poll() then holds back POLLOUT. A channel
+ * that spills its readers never fills; give up after IPC_FILL_MAX messages.
+ */
+int ipc_check_pollout(const char *path)
+{
+    struct kerneltalk_msg msgs[BATCH];
+    struct kerneltalk_mmsg mm = {.msgs = (unsigned long)msgs, .count = BATCH,
+                                 .flags = KERNELTALK_MMSG_DONTWAIT};
+    struct pollfd pfd = {.events = POLLOUT};
+    long long sent = 0;
+    char byte = 0;
+    int i, n;
+
+    pfd.fd = open(path, O_RDWR);
+    if (pfd.fd < 0)
+        die(path);
+    for (i = 0; i < BATCH; i++)
+    {
+        msgs[i].buf = (unsigned long)&byte;
+        msgs[i].len = 1;
+        msgs[i].flags = 0;
+    }
+    while ((n = ioctl(pfd.fd, KERNELTALK_IOC_SENDMMSG, &mm)) > 0 && sent < IPC_FILL_MAX)
+        sent += n;
+    if (n < 0 && errno != EAGAIN)
+        die("KERNELTALK_IOC_SENDMMSG");
+    if (n > 0)
+    {
+        fprintf(stderr, "kerneltalk_bench: %s never filled up, not checking poll()\n", path);
+        close(pfd.fd);
+        return 0;
+    }
+    if (poll(&pfd, 1, 0) < 0)
+        die("poll");
+    close(pfd.fd);
+    if (pfd.revents & POLLOUT)
+    {
+        fprintf(stderr, "kerneltalk_bench: %s reports POLLOUT with all %lld records in use\n",
+                path, sent);
+        return -1;
+    }
+    return 0;
+}
+
+double cpu_seconds(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_CHILDREN, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/*
+ * One run: fork the writers and readers, let them go for the given time and
+ * print a line.
+ */
+void ipc_run(struct ipc_run *run)
+{
+    struct ipc_shared *sh = run->sh;
+    long long msgs = 0, bytes = 0, start, end, *lat;
+    double cpu;
+    pid_t pid, *pids;
+    int i, nlat = 0, nprocs = run->writers + run->readers;
+
+    pids = calloc(nprocs, sizeof(*pids));
+    if (!pids)
+        die("kerneltalk_bench");
+    memset(sh, 0, sizeof(*sh));
+    ipc_setup(run);
+    cpu = cpu_seconds();
+    fflush(stdout); // or the children print it again when they exit
+
+    // readers first, so they are subscribed before anything is written
+    for (i = 0; i < nprocs; i++)
+    {
+        pid = fork();
+        if (pid < 0)
+            die("fork");
+        if (pid > 0)
+        {
+            pids[i] = pid;
+            continue;
+        }
+        if (run->ncpus)
+            rt_setup(0, run->cpus[i % run->ncpus]);
+        if (i < run->readers)
+            ipc_reader(run, i);
+        ipc_writer(run, i - run->readers);
+    }
+
+    // a child that fails to set up exits before it gets ready
+    while (sh->ready < nprocs)
+    {
+        if (waitpid(-1, NULL, WNOHANG) > 0)
+        {
+            for (i = 0; i < nprocs; i++)
+                kill(pids[i], SIGKILL);
+            fprintf(stderr, "kerneltalk_bench: a %s process failed\n", transport_names[run->t]);
+            exit(EXIT_FAILURE);
+        }
+        usleep(1000);
+    }
+    start = now_ns();
+    sh->end_ns = start + run->seconds * 1000000000LL;
+    __atomic_store_n(&sh->start, 1, __ATOMIC_SEQ_CST);
+
+    for (i = run->readers; i < nprocs; i++)
+        waitpid(pids[i], NULL, 0);
+    end = now_ns();
+    sh->stop = 1;
+    while (wait(NULL) > 0)
+        ;
+    cpu = cpu_seconds() - cpu;
+    ipc_teardown(run);
+
+    lat = malloc((size_t)run->readers * IPC_SAMPLES * sizeof(*lat));
+    if (!lat)
+        die("kerneltalk_bench");
+    for (i = 0; i < run->readers; i++)
+    {
+        msgs += sh->readers[i].msgs;
+        bytes += sh->readers[i].bytes;
+        memcpy(lat + nlat, sh->samples + (size_t)i * IPC_SAMPLES,
+               (sh->readers[i].msgs < IPC_SAMPLES ? sh->readers[i].msgs : IPC_SAMPLES) * sizeof(*lat));
+        nlat += sh->readers[i].msgs < IPC_SAMPLES ? sh->readers[i].msgs : IPC_SAMPLES;
+    }
+    qsort(lat, nlat, sizeof(*lat), cmp_ll);
+
+    printf("%s\t%d\t%d\t%.0f\t%.2f\t%.1f\t%.1f\t%.1f\t%.2f\n", transport_names[run->t],
+           run->writers, run->readers, msgs * 1e9 / (end - start),
+           bytes * 1e9 / (end - start) / (1 << 20),
+           nlat ? percentile(lat, nlat, 50) / 1e3 : 0.0,
+           nlat ? percentile(lat, nlat, 99) / 1e3 : 0.0,
+           nlat ? percentile(lat, nlat, 99.9) / 1e3 : 0.0,
+           msgs ? cpu * 1e6 / msgs : 0.0);
+    fflush(stdout);
+    free(lat);
+    free(pids);
+}
+
+int ipc_main(int argc, char **argv)
+{
+    struct ipc_run run = {.writers = 1, .readers = 1, .seconds = 5};
+    const char *transports = "kerneltalk,pipe,unix,mq";
+    const char *sizes = "64";
+    int cpus[IPC_MAX_PROCS];
+    int opt, t;
+
+    while ((opt = getopt(argc, argv, "T:w:r:d:s:C:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'T':
+            transports = optarg;
+            break;
+        case 'w':
+            run.writers = atoi(optarg);
+            break;
+        case 'r':
+            run.readers = atoi(optarg);
+            break;
+        case 'd':
+            run.seconds = atoi(optarg);
+            break;
+        case 's':
+            sizes = optarg;
+            break;
+        case 'C':
+            run.ncpus = parse_cpus(optarg, cpus, IPC_MAX_PROCS);
+            if (!run.ncpus)
+                return EXIT_FAILURE;
+            run.cpus = cpus;
+            break;
+        default:
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind + 1 < argc || run.writers < 1 || run.readers < 1 || run.seconds < 1 ||
+        run.writers + run.readers > IPC_MAX_PROCS || !parse_sizes(sizes, &run.sz))
+    {
+        fprintf(stderr, "usage: kerneltalk_bench ipc [-T TRANSPORT,...] [-w WRITERS] "
+                        "[-r READERS] [-d SECONDS] [-s SIZE|MIN-MAX|exp:MEAN] "
+                        "[-C CPUS] [FILENAME]\n");
+        return EXIT_FAILURE;
+    }
+    run.path = optind < argc ? argv[optind] : NULL;
+
+    run.fds = calloc(run.readers, sizeof(*run.fds));
+    run.mqs = calloc(run.readers, sizeof(*run.mqs));
+    run.sh = mmap(NULL, sizeof(*run.sh) + (size_t)run.readers * IPC_SAMPLES * sizeof(long long),
+                  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (!run.fds || !run.mqs || run.sh == MAP_FAILED)
+        die("kerneltalk_bench");
+    raise_nofile();
+
+    printf("# transport\twriters\treaders\tmsgs_per_s\tmib_per_s\tp50_us\tp99_us\tp999_us\tcpu_us_per_msg\n");
+    for (t = 0; t < NR_TRANSPORTS; t++)
+    {
+        if (!strstr(transports, transport_names[t]))
+            continue;
+        if (t == T_KERNELTALK && !run.path)
+        {
+            fprintf(stderr, "kerneltalk_bench: no FILENAME, skipping kerneltalk\n");
+            continue;
+        }
+        if (t == T_KERNELTALK && ipc_check_pollout(run.path) < 0)
+            return EXIT_FAILURE;
+        // bigger writes to a pipe are not atomic and would interleave
+        if (t == T_PIPE && run.sz.max > PIPE_BUF)
+        {
+            fprintf(stderr, "kerneltalk_bench: messages over %d bytes, skipping pipe\n", PIPE_BUF);
+            continue;
+        }
+        if (t == T_SHM && run.writers + run.readers > KT_SHM_CLIENTS)
+        {
+            fprintf(stderr, "kerneltalk_bench: more than %d processes, skipping shm\n",
+                    KT_SHM_CLIENTS);
+            continue;
+        }
+        run.t = t;
+        ipc_run(&run);
+    }
+
+    free(run.fds);
+    free(run.mqs);
+    return EXIT_SUCCESS;
+}
+
+#define RING_MAX_READERS 256
+#define RING_CHECK_EVERY 4096 // ops between full consistency checks
+
+/*
+ * A channel as the module keeps it, minus locks and pages: the ring, the
+ * record descriptors and the readers' cursors in their heap.
+ */
+struct ring_model
+{
+    unsigned int size;
+    unsigned long long head;
+    unsigned long long rec_head;
+    unsigned int nr; // record descriptors, kt_nr_recs() of the size
+    struct kt_rec *recs;
+    struct kt_cursor *heap[RING_MAX_READERS];
+    unsigned int heap_len;
+    struct kt_cursor readers[RING_MAX_READERS];
+    int nreaders;
+    char *data;
+    char *buf;
+    unsigned long long seed;
+    unsigned long long op;
+    unsigned long long bytes;
+};
+
+/*
+ * What the byte at pos should be. No period, so data left over from an
+ * earlier lap of the ring never passes for current data.
+ */
+char ring_byte(unsigned long long pos)
+{
+    return (pos * 0x9e3779b97f4a7c15ULL) >> 56;
+}
+
+unsigned long long ring_rand(struct ring_model *m)
+{
+    m->seed ^= m->seed << 13;
+    m->seed ^= m->seed >> 7;
+    m->seed ^= m->seed << 17;
+    return m->seed;
+}
+
+void ring_fail(struct ring_model *m, const char *what)
+{
+    fprintf(stderr, "kerneltalk_bench: ring: %s at op %llu\n", what, m->op);
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Write up to len bytes as one record, as much as there is room for. A stream
+ * write is a write() to the module: it only needs bytes, and extends the
+ * newest record when every descriptor is in use.
+ */
+void ring_write(struct ring_model *m, unsigned int len, int stream)
+{
+    const struct kt_cursor *tail = m->heap_len ? m->heap[0] : NULL;
+    int grow = stream && kt_recs_full(m->nr, m->rec_head, tail);
+    unsigned int room = stream ? kt_room_bytes(m->size, m->head, tail)
+                               : kt_room(m->size, m->nr, m->head, m->rec_head, tail);
+    unsigned int first, i;
+    struct kt_rec *rec;
+
+    if (room > m->size || m->head - m->heap[0]->pos + room > m->size)
+        ring_fail(m, "room beyond the slowest reader");
+    if (len > room)
+        len = room;
+    if (len == 0)
+        return;
+
+    first = kt_first(m->size, m->head, len);
+    for (i = 0; i < first; i++)
+        m->data[kt_idx(m->size, m->head) + i] = ring_byte(m->head + i);
+    for (; i < len; i++)
+        m->data[i - first] = ring_byte(m->head + i);
+
+    if (grow)
+    {
+        kt_rec(m->recs, m->nr, m->rec_head - 1)->len += len;
+        kt_cursors_rewind(m->heap, m->heap_len, m->rec_head);
+    }
+    else
+    {
+        rec = kt_rec(m->recs, m->nr, m->rec_head);
+        rec->pos = m->head;
+        rec->len = len;
+        m->rec_head++;
+    }
+    m->head += len;
+}
+
+void ring_advance(struct ring_model *m, struct kt_cursor *cur,
+                  unsigned long long pos)
+{
+    unsigned long long rec = kt_rec_find(m->recs, m->nr, cur->rec, m->rec_head, pos);
+
+    kt_cursor_move(m->heap, m->heap_len, cur, pos, rec);
+    if (rec == m->rec_head ? pos != m->head
+                           : kt_rec(m->recs, m->nr, rec)->pos > pos ||
+                                 kt_rec_end(m->recs, m->nr, rec) <= pos)
+        ring_fail(m, "cursor in the wrong record");
+}
+
+/*
+ * Read up to len bytes, copying them out like the module does, and check them.
+ */
+void ring_read(struct ring_model *m, struct kt_cursor *cur, unsigned int len)
+{
+    unsigned int first, i;
+
+    if (len > m->head - cur->pos)
+        len = m->head - cur->pos;
+    first = kt_first(m->size, cur->pos, len);
+    memcpy(m->buf, m->data + kt_idx(m->size, cur->pos), first);
+    memcpy(m->buf + first, m->data, len - first);
+    for (i = 0; i < len; i++)
+        if (m->buf[i] != ring_byte(cur->pos + i))
+            ring_fail(m, "read back wrong data");
+    m->bytes += len;
+    ring_advance(m, cur, cur->pos + len);
+}
+
+/*
+ * Drop up to count records like KERNELTALK_IOC_SKIP.
+ */
+void ring_skip(struct ring_model *m, struct kt_cursor *cur, unsigned int count)
+{
+    unsigned long long skipped = m->rec_head - cur->rec;
+    unsigned long long want;
+
+    if (skipped > count)
+        skipped = count;
+    want = cur->rec + skipped;
+    ring_advance(m, cur, kt_skip_target(m->recs, m->nr, m->head, m->rec_head, cur, count));
+    if (cur->rec != want)
+        ring_fail(m, "skipped the wrong number of records");
+}
+
+/*
+ * A reader closes its file and opens a new one, starting at the head.
+ */
+void ring_reopen(struct ring_model *m, struct kt_cursor *cur)
+{
+    kt_heap_remove(m->heap, &m->heap_len, cur);
+    cur->pos = m->head;
+    cur->rec = m->rec_head;
+    kt_heap_add(m->heap, &m->heap_len, cur);
+}
+
+/*
+ * Recompute everything the incremental code keeps track of the slow way.
+ */
+void ring_check(struct ring_model *m)
+{
+    unsigned long long tail = m->head, tail_rec = m->rec_head, r;
+    unsigned int i, room;
+    struct kt_cursor *cur;
+
+    if (m->heap_len != (unsigned int)m->nreaders)
+        ring_fail(m, "reader missing from the heap");
+    for (i = 0; i < m->heap_len; i++)
+    {
+        if (m->heap[i]->heap_idx != i)
+            ring_fail(m, "heap index out of date");
+        if (i && m->heap[(i - 1) / 2]->pos > m->heap[i]->pos)
+            ring_fail(m, "heap out of order");
+    }
+    for (i = 0; i < (unsigned int)m->nreaders; i++)
+    {
+        cur = &m->readers[i];
+        if (cur->pos < tail)
+        {
+            tail = cur->pos;
+            tail_rec = cur->rec;
+        }
+    }
+    if (m->heap[0]->pos != tail)
+        ring_fail(m, "heap top is not the slowest reader");
+
+    for (i = 0; i < (unsigned int)m->nreaders; i++)
+    {
+        cur = &m->readers[i];
+        for (r = tail_rec; r < m->rec_head && kt_rec_end(m->recs, m->nr, r) <= cur->pos; r++)
+            ;
+        if (r != cur->rec)
+            ring_fail(m, "record number out of step with the position");
+    }
+
+    room = m->size - (m->head - tail);
+    if (kt_room_bytes(m->size, m->head, m->heap[0]) != room)
+        ring_fail(m, "wrong room to write");
+    if (m->rec_head - tail_rec >= m->nr)
+        room = 0;
+    if (kt_room(m->size, m->nr, m->head, m->rec_head, m->heap[0]) != room)
+        ring_fail(m, "wrong room for a record");
+}
+
+int ring_main(int argc, char **argv)
+{
+    struct ring_model m = {.size = 4096};
+    unsigned long long ops[4] = {0};
+    unsigned int seed = time(NULL);
+    long long start, elapsed;
+    int seconds = 5, max_size = 256;
+    int opt, i, r;
+
+    m.nreaders = 4;
+    while ((opt = getopt(argc, argv, "d:r:z:s:S:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 'r':
+            m.nreaders = atoi(optarg);
+            break;
+        case 'z':
+            m.size = atoi(optarg);
+            break;
+        case 's':
+            max_size = atoi(optarg);
+            break;
+        case 'S':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc || seconds < 1 || m.nreaders < 1 || m.nreaders > RING_MAX_READERS ||
+        m.size < 256 || (m.size & (m.size - 1)) || max_size < 1 || max_size > (int)m.size)
+    {
+        fprintf(stderr, "usage: kerneltalk_bench ring [-d SECONDS] [-r READERS] "
+                        "[-z RING_SIZE] [-s MAX_SIZE] [-S SEED]\n");
+        return EXIT_FAILURE;
+    }
+
+    m.nr = kt_nr_recs(m.size);
+    m.recs = calloc(m.nr, sizeof(*m.recs));
+    m.data = malloc(m.size);
+    m.buf = malloc(max_size);
+    if (!m.recs || !m.data || !m.buf)
+        die("kerneltalk_bench");
+    m.seed = seed * 0x2545f4914f6cdd1dULL + 1;
+    for (i = 0; i < m.nreaders; i++)
+        kt_heap_add(m.heap, &m.heap_len, &m.readers[i]);
+
+    printf("# seed %u\n", seed);
+    printf("# readers\tring_size\tmops_per_s\tmib_per_s\twrites\treads\tskips\treopens\n");
+    start = now_ns();
+    do
+    {
+        for (i = 0; i < RING_CHECK_EVERY; i++, m.op++)
+        {
+            r = ring_rand(&m) % 100;
+            if (r < 45)
+            {
+                ring_write(&m, 1 + ring_rand(&m) % max_size, ring_rand(&m) & 1);
+                ops[0]++;
+            }
+            else if (r < 90)
+            {
+                ring_read(&m, &m.readers[ring_rand(&m) % m.nreaders], 1 + ring_rand(&m) % max_size);
+                ops[1]++;
+            }
+            else if (r < 99)
+            {
+                ring_skip(&m, &m.readers[ring_rand(&m) % m.nreaders], ring_rand(&m) % 4);
+                ops[2]++;
+            }
+            else
+            {
+                ring_reopen(&m, &m.readers[ring_rand(&m) % m.nreaders]);
+                ops[3]++;
+            }
+        }
+        ring_check(&m);
+        elapsed = now_ns() - start;
+    } while (elapsed < seconds * 1000000000LL);
+
+    printf("%d\t%u\t%.2f\t%.1f\t%llu\t%llu\t%llu\t%llu\n", m.nreaders, m.size,
+           m.op * 1e3 / elapsed, m.bytes * 1e9 / elapsed / (1 << 20),
+           ops[0], ops[1], ops[2], ops[3]);
+
+    free(m.recs);
+    free(m.data);
+    free(m.buf);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc >= 2 && strcmp(argv[1], "fanout") == 0)
+        return fanout_main(argc - 1, argv + 1);
+    if (argc >= 2 && strcmp(argv[1], "scale") == 0)
+        return scale_main(argc - 1, argv + 1);
+    if (argc >= 2 && strcmp(argv[1], "stream") == 0)
+        return stream_main(argc - 1, argv + 1);
+    if (argc >= 2 && strcmp(argv[1], "rtlat") == 0)
+        return rtlat_main(argc - 1, argv + 1);
+    if (argc >= 2 && strcmp(argv[1], "ipc") == 0)
+        return ipc_main(argc - 1, argv + 1);
+    if (argc >= 2 && strcmp(argv[1], "ring") == 0)
+        return ring_main(argc - 1, argv + 1);
+
+    fprintf(stderr, "usage: %s fanout|scale|stream|rtlat|ipc|ring [OPTIONS] FILENAME...\n", argv[0]);
+    return EXIT_FAILURE;
+}
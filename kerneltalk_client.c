@@ -2,79 +2,1121 @@
  * KernelTalk: kernel based chat
  *
  * This is a user-space client for the KernelTalk kernel chat server.
+ *
+ *   kerneltalk_client FILENAME...
+ *
+ * Lines typed on stdin go to the first channel, and whatever arrives on any of
+ * the channels is printed. With more than one channel, every line printed is
+ * prefixed with the channel it came from.
+ *
+ * Everything is non-blocking and driven by one epoll loop. Typed input and
+ * received data wait in queues until the channel or stdout takes them, each in
+ * as few writes as possible. A full channel never holds up the display of
+ * incoming messages, and a slow terminal only stops the client from reading
+ * the channels once its queue is full.
+ *
+ *   kerneltalk_client -u FILENAME...
+ *
+ * The same loop on io_uring, where the kernel has it, rather than epoll. The
+ * kernel reads the channels into a ring of registered buffers, with multishot
+ * reads where it supports them so that one request serves a channel for as
+ * long as there are buffers, and with one channel the buffers go to stdout as
+ * they are, several in one write. A round of the loop is one io_uring_enter()
+ * for all the reads and writes, rather than epoll_wait() and a call for each.
+ * Without io_uring the client says so and uses epoll.
+ *
+ *   kerneltalk_client -p [-s|-r] FILENAME
+ *
+ * Pipe mode is for shell pipelines. It streams stdin to the channel and the
+ * channel to stdout in big chunks, a thread for each direction, with splice()
+ * when the device supports it and large reads and writes when it doesn't.
+ * End of file on stdin only ends sending; the client runs until stdout is
+ * closed or it is interrupted. With -s it only sends and exits at the end of
+ * stdin, with -r it only receives. A summary of the byte rates goes to stderr
+ * on exit.
  */
 
+#define _GNU_SOURCE // splice, F_SETPIPE_SZ
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <sys/select.h>
+#include <fcntl.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define KERNELTALK_BUF 2048 // longest line kept together with several channels
+#define IO_BUF 65536        // most read at once
+#define QUEUE_MAX (1 << 20) // stop reading what feeds a queue this full
+#define MAX_CHANNELS 64
+#define PIPE_CHUNK (1 << 20) // most moved at once in pipe mode
+#define URING_DEPTH 256      // far more than the loop ever has in flight
+#define RECV_BUFS 64         // receive buffers of IO_BUF, a power of two
+
+// Linux 6.7, newer than some headers; older kernels fail it with EINVAL
+#define OP_READ_MULTISHOT 49
+
+/*
+ * Bytes waiting to be written, data[off, off + len).
+ */
+struct queue
+{
+    char *data;
+    size_t off, len, cap;
+};
+
+/*
+ * A file descriptor in the loop. Regular files can't be polled; they are
+ * always ready.
+ */
+struct endpoint
+{
+    int fd;
+    int polled;
+    unsigned int events; // registered with epoll
+    unsigned int want;   // what we wait for this time round
+    unsigned int ready;
+};
+
+struct channel
+{
+    const char *path;
+    struct endpoint ep;
+    struct queue out;          // typed input waiting for the channel
+    char line[KERNELTALK_BUF]; // a line still coming in, with several channels
+    size_t line_len;
+    int eof; // read() returned 0, it is a FIFO or file rather than a channel
+};
+
+struct client
+{
+    int epfd;
+    struct endpoint in, out;
+    struct queue display; // received data waiting for stdout
+    struct channel chans[MAX_CHANNELS];
+    int nchans;
+    int eof; // nothing more to read on stdin
+};
+
+int saved_flags[2] = {-1, -1}; // of stdin and stdout, put back on exit
+
+void die(const char *what)
+{
+    perror(what);
+    exit(EXIT_FAILURE);
+}
 
-#define KERNELTALK_BUF 2048
+void restore_flags(void)
+{
+    int fd;
+
+    for (fd = 0; fd < 2; fd++)
+        if (saved_flags[fd] >= 0)
+            fcntl(fd, F_SETFL, saved_flags[fd]);
+}
 
-void writeall(int fildes, char *buf, int amt)
+/*
+ * Make room for n more bytes at the end of q and return where they go.
+ */
+char *queue_tail(struct queue *q, size_t n)
 {
-    ssize_t rv;
-    while (amt > 0)
+    if (q->off + q->len + n > q->cap && q->off)
     {
-        rv = write(fildes, buf, amt);
-        if (rv < 0)
+        memmove(q->data, q->data + q->off, q->len);
+        q->off = 0;
+    }
+    if (q->len + n > q->cap)
+    {
+        q->cap = q->cap ? q->cap : IO_BUF;
+        while (q->len + n > q->cap)
+            q->cap *= 2;
+        q->data = realloc(q->data, q->cap);
+        if (!q->data)
+            die("kerneltalk");
+    }
+    return q->data + q->off + q->len;
+}
+
+void queue_put(struct queue *q, const void *data, size_t n)
+{
+    memcpy(queue_tail(q, n), data, n);
+    q->len += n;
+}
+
+/*
+ * Drop n bytes written from the front of q.
+ */
+void queue_skip(struct queue *q, size_t n)
+{
+    q->off += n;
+    q->len -= n;
+    if (q->len == 0)
+        q->off = 0;
+}
+
+/*
+ * Write as much of q as fd takes now.
+ */
+void queue_write(int fd, struct queue *q, const char *what)
+{
+    ssize_t n;
+
+    n = write(fd, q->data + q->off, q->len);
+    if (n < 0)
+    {
+        if (errno == EAGAIN || errno == EINTR)
+            return;
+        die(what);
+    }
+    queue_skip(q, n);
+}
+
+void watch(struct client *cl, struct endpoint *ep, int fd)
+{
+    struct epoll_event ev = {.events = 0, .data.ptr = ep};
+
+    ep->fd = fd;
+    ep->polled = 1;
+    if (epoll_ctl(cl->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        if (errno != EPERM)
+            die("epoll_ctl");
+        ep->polled = 0;
+    }
+}
+
+/*
+ * Register what ep waits for now. Returns 1 if it is an unpolled file with
+ * something to do, so the loop must not sleep.
+ */
+int update(struct client *cl, struct endpoint *ep)
+{
+    struct epoll_event ev = {.events = ep->want, .data.ptr = ep};
+
+    ep->ready = 0;
+    if (!ep->polled)
+        return ep->want != 0;
+    if (ep->want != ep->events && epoll_ctl(cl->epfd, EPOLL_CTL_MOD, ep->fd, &ev) < 0)
+        die("epoll_ctl");
+    ep->events = ep->want;
+    return 0;
+}
+
+/*
+ * Queue received data for stdout. With several channels only whole lines go
+ * out, each with its channel in front, so that lines arriving on different
+ * channels at once don't mix.
+ */
+void show(struct client *cl, struct channel *ch, const char *data, size_t len)
+{
+    const char *nl;
+    size_t n;
+
+    if (cl->nchans == 1)
+    {
+        queue_put(&cl->display, data, len);
+        return;
+    }
+    while (len > 0)
+    {
+        nl = memchr(data, '\n', len);
+        n = nl ? (size_t)(nl - data) + 1 : len;
+        if (!nl && ch->line_len + n <= sizeof(ch->line))
         {
-            perror("kerneltalk");
-            exit(EXIT_FAILURE);
+            memcpy(ch->line + ch->line_len, data, n);
+            ch->line_len += n;
+            return;
         }
-        buf += rv;
-        amt -= rv;
+        // a whole line, or one too long to keep together
+        queue_put(&cl->display, "[", 1);
+        queue_put(&cl->display, ch->path, strlen(ch->path));
+        queue_put(&cl->display, "] ", 2);
+        queue_put(&cl->display, ch->line, ch->line_len);
+        queue_put(&cl->display, data, n);
+        if (!nl)
+            queue_put(&cl->display, "\n", 1);
+        ch->line_len = 0;
+        data += n;
+        len -= n;
     }
 }
 
-int main(int argc, char **argv)
+void read_input(struct client *cl)
 {
-    char *buf;
-    char inbuf[KERNELTALK_BUF];
-    size_t n = 0;
-    ssize_t len;
-    FILE *f;
-    fd_set rfds;
+    struct queue *q = &cl->chans[0].out;
+    ssize_t n;
 
-    if (argc != 2)
+    n = read(cl->in.fd, queue_tail(q, IO_BUF), IO_BUF);
+    if (n < 0)
     {
-        fprintf(stderr, "usage: %s FILENAME\n", argv[0]);
-        return EXIT_FAILURE;
+        if (errno == EAGAIN || errno == EINTR)
+            return;
+        die("stdin");
     }
+    if (n == 0)
+        cl->eof = 1;
+    q->len += n;
+}
 
-    f = fopen(argv[1], "r+");
-    if (!f)
+void read_channel(struct client *cl, struct channel *ch)
+{
+    char buf[IO_BUF];
+    ssize_t n;
+
+    n = read(ch->ep.fd, buf, sizeof(buf));
+    if (n < 0)
     {
-        perror("kerneltalk");
-        return EXIT_FAILURE;
+        if (errno == EAGAIN || errno == EINTR)
+            return;
+        die(ch->path);
+    }
+    if (n == 0)
+    {
+        // it would keep reporting the hangup
+        epoll_ctl(cl->epfd, EPOLL_CTL_DEL, ch->ep.fd, NULL);
+        ch->ep.polled = 0;
+        ch->eof = 1;
+    }
+    show(cl, ch, buf, n);
+}
+
+/*
+ * The event loop. It runs until stdin is done and everything typed went out
+ * to the channel, and everything received went out to stdout.
+ */
+void run(struct client *cl)
+{
+    struct epoll_event events[MAX_CHANNELS + 2];
+    struct channel *ch;
+    struct endpoint *ep;
+    int i, n, busy;
+
+    for (;;)
+    {
+        // decide what to wait for: a full queue stops what feeds it
+        cl->in.want = !cl->eof && cl->chans[0].out.len < QUEUE_MAX ? EPOLLIN : 0;
+        cl->out.want = cl->display.len ? EPOLLOUT : 0;
+        for (i = 0; i < cl->nchans; i++)
+        {
+            ch = &cl->chans[i];
+            ch->ep.want = ch->eof ? 0 : (cl->display.len < QUEUE_MAX ? EPOLLIN : 0) |
+                                        (ch->out.len ? EPOLLOUT : 0);
+        }
+        if (cl->eof && (!cl->chans[0].out.len || cl->chans[0].eof) && !cl->display.len)
+            break;
+
+        busy = update(cl, &cl->in) | update(cl, &cl->out);
+        for (i = 0; i < cl->nchans; i++)
+            busy |= update(cl, &cl->chans[i].ep);
+        if (!cl->in.polled)
+            cl->in.ready = cl->in.want;
+        if (!cl->out.polled)
+            cl->out.ready = cl->out.want;
+
+        n = epoll_wait(cl->epfd, events, MAX_CHANNELS + 2, busy ? 0 : -1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            die("epoll_wait");
+        for (i = 0; i < n; i++)
+        {
+            ep = events[i].data.ptr;
+            ep->ready = events[i].events;
+        }
+
+        if (cl->in.ready)
+            read_input(cl);
+        for (i = 0; i < cl->nchans; i++)
+        {
+            ch = &cl->chans[i];
+            if (ch->ep.ready & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                read_channel(cl, ch);
+            if (ch->out.len && (ch->ep.ready & (EPOLLOUT | EPOLLERR)))
+                queue_write(ch->ep.fd, &ch->out, ch->path);
+        }
+        if (cl->out.ready && cl->display.len)
+            queue_write(cl->out.fd, &cl->display, "stdout");
+    }
+}
+
+/*
+ * The io_uring loop. What the channels send lands in receive buffers the
+ * kernel takes from a ring, and they go back into it once written out. Stdin,
+ * writes to the channel and the display with several channels go through
+ * buffers of their own. All of them are registered, so the kernel doesn't map
+ * them again for every read and write.
+ */
+struct uring
+{
+    int fd;
+    unsigned int *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned int tail, queued; // filled in, and how many not submitted yet
+    char *bufs;                // NR_BUFS of IO_BUF
+    struct io_uring_buf_ring *br;
+    unsigned short br_tail;
+    int free;                  // receive buffers in the ring
+    // with one channel, receive buffers waiting for stdout, oldest first
+    unsigned short seg[RECV_BUFS];
+    unsigned int seg_len[RECV_BUFS];
+    unsigned int seg_first, segs;
+    size_t seg_off;            // of the oldest, written already
+    struct iovec iov[RECV_BUFS];
+    // with several, receive buffers held back while the display is full
+    unsigned short parked[RECV_BUFS];
+    int nparked;
+    int reading, sending, showing; // in flight
+    int send_wait;                 // the channel was full
+    char armed[MAX_CHANNELS];      // a read is in flight
+    char oneshot[MAX_CHANNELS];    // no multishot reads: not pollable, or an old kernel
+};
+
+enum
+{
+    BUF_IN = RECV_BUFS, // stdin
+    BUF_SEND,           // on its way to the first channel
+    BUF_SHOW,           // on its way to stdout, with several channels
+    NR_BUFS
+};
+
+// what a completion is for, in the top half of user_data
+enum
+{
+    OP_POLL,
+    OP_RECV,
+    OP_SEND,
+    OP_INPUT,
+    OP_SHOW
+};
+
+#define TAG(op, i) ((__u64)(op) << 32 | (i))
+
+char *uring_buf(struct uring *u, int i)
+{
+    return u->bufs + (size_t)i * IO_BUF;
+}
+
+/*
+ * Give a receive buffer back to the kernel.
+ */
+void recycle(struct uring *u, int bid)
+{
+    struct io_uring_buf *b = &u->br->bufs[u->br_tail & (RECV_BUFS - 1)];
+
+    b->addr = (unsigned long)uring_buf(u, bid);
+    b->len = IO_BUF;
+    b->bid = bid;
+    __atomic_store_n(&u->br->tail, ++u->br_tail, __ATOMIC_RELEASE);
+    u->free++;
+}
+
+/*
+ * Set up the rings and register the buffers. Returns -1 with errno set if the
+ * kernel lacks any of it: io_uring itself, or buffer rings (Linux 5.19).
+ */
+int uring_setup(struct uring *u)
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    struct iovec iov[NR_BUFS];
+    size_t sq_size, cq_size;
+    char *sq, *cq;
+    unsigned int i;
+    int err;
+
+    // completions are only ever reaped by this thread, in io_uring_enter()
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    u->fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+    if (u->fd < 0 && errno == EINVAL)
+    {
+        // before Linux 6.1
+        memset(&p, 0, sizeof(p));
+        u->fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+    }
+    if (u->fd < 0)
+        return -1;
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+              IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        goto fail;
+    cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                  IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+            goto fail;
+    }
+    u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+        goto fail;
+    u->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned int *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    u->tail = *u->sq_tail;
+    for (i = 0; i < p.sq_entries; i++)
+        u->sq_array[i] = i;
+
+    u->bufs = mmap(NULL, (size_t)NR_BUFS * IO_BUF, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->bufs == MAP_FAILED)
+        goto fail;
+    for (i = 0; i < NR_BUFS; i++)
+    {
+        iov[i].iov_base = uring_buf(u, i);
+        iov[i].iov_len = IO_BUF;
+    }
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS, iov, NR_BUFS) < 0)
+        goto fail;
+
+    u->br = mmap(NULL, RECV_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->br == MAP_FAILED)
+        goto fail;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)u->br;
+    reg.ring_entries = RECV_BUFS;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        goto fail;
+    for (i = 0; i < RECV_BUFS; i++)
+        recycle(u, i);
+    return 0;
+
+fail:
+    err = errno;
+    close(u->fd);
+    errno = err;
+    return -1;
+}
+
+/*
+ * Fill in the next submission. The loop submits everything each round and has
+ * a few requests in flight per channel at most, so there is always room.
+ */
+struct io_uring_sqe *uring_sqe(struct uring *u, int op, int fd, __u64 tag)
+{
+    struct io_uring_sqe *sqe = &u->sqes[u->tail++ & *u->sq_mask];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->user_data = tag;
+    u->queued++;
+    return sqe;
+}
+
+/*
+ * Wait for fd to be ready before the request after this one.
+ */
+void uring_poll(struct uring *u, int fd, unsigned int events, __u64 tag)
+{
+    struct io_uring_sqe *sqe = uring_sqe(u, IORING_OP_POLL_ADD, fd, tag);
+
+    sqe->poll32_events = events;
+    sqe->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+}
+
+/*
+ * A read or write of registered buffer i, at the file position if it has one.
+ */
+struct io_uring_sqe *uring_rw(struct uring *u, int op, int fd, int i, const char *data,
+                              size_t len, __u64 tag)
+{
+    struct io_uring_sqe *sqe = uring_sqe(u, op, fd, tag);
+
+    sqe->addr = (unsigned long)data;
+    sqe->len = len;
+    sqe->buf_index = i;
+    sqe->off = -1;
+    return sqe;
+}
+
+/*
+ * Read channel i into whichever receive buffer the kernel picks.
+ */
+void uring_recv(struct client *cl, struct uring *u, int i)
+{
+    struct channel *ch = &cl->chans[i];
+    struct io_uring_sqe *sqe;
+
+    if (u->oneshot[i])
+    {
+        uring_poll(u, ch->ep.fd, POLLIN, TAG(OP_POLL, i));
+        sqe = uring_sqe(u, IORING_OP_READ, ch->ep.fd, TAG(OP_RECV, i));
+        sqe->len = IO_BUF;
+    }
+    else
+        sqe = uring_sqe(u, OP_READ_MULTISHOT, ch->ep.fd, TAG(OP_RECV, i));
+    sqe->off = -1;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    u->armed[i] = 1;
+}
+
+/*
+ * Write typed input to the first channel, as much as one buffer holds. After
+ * the channel was found full, wait for room first.
+ */
+void uring_send(struct client *cl, struct uring *u)
+{
+    struct channel *ch = &cl->chans[0];
+    size_t n = ch->out.len < IO_BUF ? ch->out.len : IO_BUF;
+
+    memcpy(uring_buf(u, BUF_SEND), ch->out.data + ch->out.off, n);
+    if (u->send_wait)
+        uring_poll(u, ch->ep.fd, POLLOUT, TAG(OP_POLL, 0));
+    uring_rw(u, IORING_OP_WRITE_FIXED, ch->ep.fd, BUF_SEND, uring_buf(u, BUF_SEND), n,
+             TAG(OP_SEND, 0));
+    u->send_wait = 0;
+    u->sending = 1;
+}
+
+/*
+ * Write to stdout: with one channel the receive buffers as they are, one
+ * write for all of them, and with several whatever the display queue holds.
+ */
+void uring_show(struct client *cl, struct uring *u)
+{
+    unsigned int i, s;
+    size_t n;
+
+    if (cl->nchans > 1)
+    {
+        n = cl->display.len < IO_BUF ? cl->display.len : IO_BUF;
+        memcpy(uring_buf(u, BUF_SHOW), cl->display.data + cl->display.off, n);
+        uring_rw(u, IORING_OP_WRITE_FIXED, STDOUT_FILENO, BUF_SHOW, uring_buf(u, BUF_SHOW), n,
+                 TAG(OP_SHOW, 0));
+    }
+    else if (u->segs == 1)
+    {
+        s = u->seg[u->seg_first];
+        uring_rw(u, IORING_OP_WRITE_FIXED, STDOUT_FILENO, s, uring_buf(u, s) + u->seg_off,
+                 u->seg_len[u->seg_first] - u->seg_off, TAG(OP_SHOW, 0));
+    }
+    else
+    {
+        for (i = 0; i < u->segs; i++)
+        {
+            s = (u->seg_first + i) % RECV_BUFS;
+            u->iov[i].iov_base = uring_buf(u, u->seg[s]);
+            u->iov[i].iov_len = u->seg_len[s];
+        }
+        u->iov[0].iov_base = (char *)u->iov[0].iov_base + u->seg_off;
+        u->iov[0].iov_len -= u->seg_off;
+        uring_rw(u, IORING_OP_WRITEV, STDOUT_FILENO, 0, (char *)u->iov, u->segs,
+                 TAG(OP_SHOW, 0));
+    }
+    u->showing = 1;
+}
+
+/*
+ * Data from a channel, in receive buffer bid if there was any.
+ */
+void received(struct client *cl, struct uring *u, struct channel *ch, int bid, int len)
+{
+    if (bid < 0)
+        return;
+    if (cl->nchans == 1 && len > 0)
+    {
+        u->seg[(u->seg_first + u->segs) % RECV_BUFS] = bid;
+        u->seg_len[(u->seg_first + u->segs) % RECV_BUFS] = len;
+        u->segs++;
+        return;
+    }
+    show(cl, ch, uring_buf(u, bid), len);
+    if (cl->display.len < QUEUE_MAX)
+        recycle(u, bid);
+    else
+        u->parked[u->nparked++] = bid;
+}
+
+/*
+ * n bytes went to stdout.
+ */
+void shown(struct client *cl, struct uring *u, size_t n)
+{
+    size_t left;
+
+    if (cl->nchans > 1)
+    {
+        queue_skip(&cl->display, n);
+        return;
+    }
+    while (n > 0)
+    {
+        left = u->seg_len[u->seg_first] - u->seg_off;
+        if (n < left)
+        {
+            u->seg_off += n;
+            return;
+        }
+        recycle(u, u->seg[u->seg_first]);
+        u->seg_first = (u->seg_first + 1) % RECV_BUFS;
+        u->segs--;
+        u->seg_off = 0;
+        n -= left;
+    }
+}
+
+/*
+ * A failed request that only needs to be made again.
+ */
+int retry(int res)
+{
+    return res == -EAGAIN || res == -EINTR || res == -ECANCELED;
+}
+
+/*
+ * die() for a request that failed with -res.
+ */
+void die_res(int res, const char *what)
+{
+    errno = -res;
+    die(what);
+}
+
+void complete(struct client *cl, struct uring *u, struct io_uring_cqe *cqe)
+{
+    int op = cqe->user_data >> 32, i = cqe->user_data & 0xffffffff, res = cqe->res;
+    int bid = cqe->flags & IORING_CQE_F_BUFFER ? (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+    struct channel *ch = &cl->chans[i];
+
+    if (bid >= 0)
+        u->free--;
+    switch (op)
+    {
+    case OP_POLL:
+        // only failures get here, and the request linked to it is cancelled
+        if (!retry(res))
+            die_res(res, ch->path);
+        break;
+    case OP_RECV:
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            u->armed[i] = 0;
+        if ((res == -EINVAL || res == -EBADFD) && !u->oneshot[i])
+            u->oneshot[i] = 1;
+        else if (res == -ENOBUFS || retry(res))
+            ; // the loop reads again once it has buffers
+        else if (res < 0)
+            die_res(res, ch->path);
+        else
+        {
+            if (res == 0)
+                ch->eof = 1;
+            received(cl, u, ch, bid, res);
+        }
+        break;
+    case OP_SEND:
+        u->sending = 0;
+        if (res == -EAGAIN)
+            u->send_wait = 1;
+        else if (res < 0 && !retry(res))
+            die_res(res, ch->path);
+        else if (res > 0)
+            queue_skip(&ch->out, res);
+        break;
+    case OP_INPUT:
+        u->reading = 0;
+        if (res < 0 && !retry(res))
+            die_res(res, "stdin");
+        if (res == 0)
+            cl->eof = 1;
+        if (res > 0)
+            queue_put(&cl->chans[0].out, uring_buf(u, BUF_IN), res);
+        break;
+    case OP_SHOW:
+        u->showing = 0;
+        if (res < 0 && !retry(res))
+            die_res(res, "stdout");
+        if (res > 0)
+            shown(cl, u, res);
+        break;
+    }
+}
+
+/*
+ * The event loop on io_uring, with the same rules as run(): a full queue stops
+ * what feeds it, and it ends once stdin is done and everything went out.
+ */
+void run_uring(struct client *cl, struct uring *u)
+{
+    unsigned int head;
+    int i, n;
+
+    for (;;)
+    {
+        if (!cl->eof && !u->reading && cl->chans[0].out.len < QUEUE_MAX)
+        {
+            uring_rw(u, IORING_OP_READ_FIXED, STDIN_FILENO, BUF_IN, uring_buf(u, BUF_IN), IO_BUF,
+                     TAG(OP_INPUT, 0));
+            u->reading = 1;
+        }
+        while (u->nparked && cl->display.len < QUEUE_MAX)
+            recycle(u, u->parked[--u->nparked]);
+        for (i = 0; i < cl->nchans; i++)
+            if (!cl->chans[i].eof && !u->armed[i] && u->free && cl->display.len < QUEUE_MAX)
+                uring_recv(cl, u, i);
+        if (!u->sending && cl->chans[0].out.len && !cl->chans[0].eof)
+            uring_send(cl, u);
+        if (!u->showing && (cl->display.len || u->segs))
+            uring_show(cl, u);
+        if (cl->eof && !u->sending && (!cl->chans[0].out.len || cl->chans[0].eof) &&
+            !u->showing && !cl->display.len && !u->segs)
+            break;
+
+        __atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+        n = syscall(__NR_io_uring_enter, u->fd, u->queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n < 0 && errno != EINTR)
+            die("io_uring_enter");
+        if (n > 0)
+            u->queued -= n;
+
+        head = *u->cq_head;
+        while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+            complete(cl, u, &u->cqes[head++ & *u->cq_mask]);
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * One direction of pipe mode.
+ */
+struct pump
+{
+    const char *what; // for errors
+    int from, to;
+    int spliced;     // moved with splice() rather than copied
+    int done;
+    long long bytes; // read by the summary while we run
+    pthread_t main;  // told when we are done
+};
+
+int is_pipe(int fd)
+{
+    struct stat st;
+
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+/*
+ * Write all of buf. Blocking, pipe mode has a thread per direction.
+ */
+int write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        buf += n;
+        len -= n;
     }
+    return 0;
+}
+
+/*
+ * A reader on the far end went away: this direction is done.
+ */
+int gone(struct pump *p)
+{
+    if (errno != EPIPE)
+        die(p->what);
+    return 0;
+}
 
-    FD_ZERO(&rfds);
-    FD_SET(fileno(stdin), &rfds);
-    FD_SET(fileno(f), &rfds);
+/*
+ * Move data with splice(), through a pipe of our own when neither end is one.
+ * Returns 0 when done, or -1 with EINVAL right away if an end can't splice.
+ */
+int pump_splice(struct pump *p)
+{
+    int fds[2] = {-1, -1}, out = p->to, rv = 0;
+    char buf[65536];
+    ssize_t n, m;
 
-    while (select(fileno(f) + 1, &rfds, NULL, NULL, NULL) != -1)
+    if (!is_pipe(p->from) && !is_pipe(p->to))
+    {
+        if (pipe2(fds, O_CLOEXEC) < 0)
+            die("pipe");
+        fcntl(fds[1], F_SETPIPE_SZ, PIPE_CHUNK); // best effort
+        out = fds[1];
+    }
+    for (;;)
     {
-        if (FD_ISSET(fileno(stdin), &rfds))
+        n = splice(p->from, NULL, out, NULL, PIPE_CHUNK, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EINVAL && !p->bytes)
+        {
+            rv = -1;
+            goto out;
+        }
+        if (n < 0)
         {
-            len = getline(&buf, &n, stdin);
-            writeall(fileno(f), buf, len);
+            rv = gone(p);
+            goto out;
         }
-        if (FD_ISSET(fileno(f), &rfds))
+        if (n == 0)
+            goto out;
+        while (fds[0] >= 0 && n > 0)
         {
-            len = read(fileno(f), inbuf, KERNELTALK_BUF);
-            if (len < 0)
+            m = splice(fds[0], NULL, p->to, NULL, n, SPLICE_F_MOVE);
+            if (m < 0 && errno == EINTR)
+                continue;
+            if (m < 0 && errno == EINVAL && !p->bytes)
             {
-                perror("kerneltalk");
-                exit(EXIT_FAILURE);
+                // the far end can't splice: copy out what is in the pipe
+                while (n > 0 && (m = read(fds[0], buf, sizeof(buf))) > 0)
+                {
+                    if (write_all(p->to, buf, m) < 0)
+                    {
+                        rv = gone(p);
+                        goto out;
+                    }
+                    __atomic_add_fetch(&p->bytes, m, __ATOMIC_RELAXED);
+                    n -= m;
+                }
+                rv = -1;
+                goto out;
             }
-            writeall(fileno(stdout), inbuf, len);
+            if (m < 0)
+            {
+                rv = gone(p);
+                goto out;
+            }
+            // the far end takes nothing more
+            if (m == 0)
+                goto out;
+            n -= m;
+            __atomic_add_fetch(&p->bytes, m, __ATOMIC_RELAXED);
         }
-        FD_SET(fileno(stdin), &rfds);
-        FD_SET(fileno(f), &rfds);
+        if (fds[0] < 0)
+            __atomic_add_fetch(&p->bytes, n, __ATOMIC_RELAXED);
     }
+out:
+    if (fds[0] >= 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+    }
+    // the caller falls back to copying on EINVAL
+    if (rv < 0)
+        errno = EINVAL;
+    return rv;
+}
 
-    return 0;
+void pump_copy(struct pump *p)
+{
+    char *buf = malloc(PIPE_CHUNK);
+    ssize_t n;
+
+    if (!buf)
+        die("kerneltalk");
+    for (;;)
+    {
+        n = read(p->from, buf, PIPE_CHUNK);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            die(p->what);
+        if (n == 0)
+            break;
+        if (write_all(p->to, buf, n) < 0)
+        {
+            gone(p);
+            break;
+        }
+        __atomic_add_fetch(&p->bytes, n, __ATOMIC_RELAXED);
+    }
+    free(buf);
+}
+
+void *pump(void *arg)
+{
+    struct pump *p = arg;
+
+    p->spliced = 1;
+    if (pump_splice(p) < 0)
+    {
+        p->spliced = 0;
+        pump_copy(p);
+    }
+    __atomic_store_n(&p->done, 1, __ATOMIC_RELEASE);
+    pthread_kill(p->main, SIGUSR1);
+    return NULL;
+}
+
+double now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Pipe mode. The pumps block, so the main thread only waits for one of them
+ * to finish or for an interrupt, and then prints the summary.
+ */
+int run_pipe(const char *path, int sending, int receiving)
+{
+    struct pump in = {.what = path, .from = STDIN_FILENO};
+    struct pump out = {.what = "stdout", .to = STDOUT_FILENO};
+    pthread_t tid;
+    double start, secs;
+    sigset_t set;
+    int fd, sig;
+
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        die(path);
+    in.to = fd;
+    out.from = fd;
+    in.main = out.main = pthread_self();
+
+    // we receive our own writes, which have to go somewhere
+    if (!receiving && (out.to = open("/dev/null", O_WRONLY | O_CLOEXEC)) < 0)
+        die("/dev/null");
+
+    // a closed stdout is an error from write(), which ends the receiving pump
+    signal(SIGPIPE, SIG_IGN);
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    start = now_s();
+    if ((sending && pthread_create(&tid, NULL, pump, &in)) ||
+        pthread_create(&tid, NULL, pump, &out))
+        die("pthread_create");
+
+    // the end of stdin only ends sending, unless that is all we do
+    while (sigwait(&set, &sig) == 0 && sig == SIGUSR1 &&
+           !__atomic_load_n(&out.done, __ATOMIC_ACQUIRE) &&
+           !(!receiving && __atomic_load_n(&in.done, __ATOMIC_ACQUIRE)))
+        ;
+    secs = now_s() - start;
+
+    fprintf(stderr, "kerneltalk_client: %.2f s", secs);
+    if (sending)
+        fprintf(stderr, ", sent %lld bytes at %.2f MiB/s (%s)", in.bytes,
+                in.bytes / secs / (1 << 20), in.spliced ? "splice" : "copy");
+    if (receiving)
+        fprintf(stderr, ", received %lld bytes at %.2f MiB/s (%s)", out.bytes,
+                out.bytes / secs / (1 << 20), out.spliced ? "splice" : "copy");
+    fprintf(stderr, "\n");
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+    static struct client cl;
+    static struct uring u;
+    const char *prog = argv[0];
+    int i, fd, opt, pipe_mode = 0, sending = 1, receiving = 1, uring = 0;
+
+    while ((opt = getopt(argc, argv, "psru")) != -1)
+    {
+        switch (opt)
+        {
+        case 'u':
+            uring = 1;
+            break;
+        case 'p':
+            pipe_mode = 1;
+            break;
+        case 's':
+            pipe_mode = 1;
+            receiving = 0;
+            break;
+        case 'r':
+            pipe_mode = 1;
+            sending = 0;
+            break;
+        default:
+            return EXIT_FAILURE;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+    if (argc < 2 || argc - 1 > MAX_CHANNELS || (pipe_mode && (argc != 2 || (!sending && !receiving))) ||
+        (pipe_mode && uring))
+    {
+        fprintf(stderr, "usage: %s [-u] FILENAME...\n"
+                        "       %s -p [-s|-r] FILENAME\n",
+                prog, prog);
+        return EXIT_FAILURE;
+    }
+    if (pipe_mode)
+        return run_pipe(argv[1], sending, receiving);
+
+    if (uring && uring_setup(&u) < 0)
+    {
+        fprintf(stderr, "%s: no io_uring (%s), using epoll\n", prog, strerror(errno));
+        uring = 0;
+    }
+
+    // only the first channel is written to
+    cl.nchans = argc - 1;
+    for (i = 0; i < cl.nchans; i++)
+    {
+        cl.chans[i].path = argv[i + 1];
+        cl.chans[i].ep.fd = open(argv[i + 1], (i ? O_RDONLY : O_RDWR) | O_NONBLOCK | O_CLOEXEC);
+        if (cl.chans[i].ep.fd < 0)
+            die(argv[i + 1]);
+    }
+
+    // io_uring waits for stdin and stdout itself, they stay as they are
+    if (uring)
+    {
+        run_uring(&cl, &u);
+        return EXIT_SUCCESS;
+    }
+
+    cl.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (cl.epfd < 0)
+        die("epoll_create1");
+    for (i = 0; i < cl.nchans; i++)
+        watch(&cl, &cl.chans[i].ep, cl.chans[i].ep.fd);
+
+    atexit(restore_flags);
+    for (fd = 0; fd < 2; fd++)
+    {
+        saved_flags[fd] = fcntl(fd, F_GETFL);
+        if (saved_flags[fd] < 0 || fcntl(fd, F_SETFL, saved_flags[fd] | O_NONBLOCK) < 0)
+            die("fcntl");
+    }
+    watch(&cl, &cl.in, STDIN_FILENO);
+    watch(&cl, &cl.out, STDOUT_FILENO);
+
+    run(&cl);
+    return EXIT_SUCCESS;
 }
@@ -0,0 +1,101 @@
+/*
+ * KernelTalk: kernel based chat
+ *
+ * Echo over kerneltalk.hpp, to check the header builds and works.
+ *
+ *   kerneltalk_echo [-n COUNT] [NAME]
+ *
+ * Two shm channels, NAME.ping and NAME.pong, with small rings so that senders
+ * wait for room. One coroutine sends COUNT pings, most of them with KT_MORE,
+ * another echoes each ping on pong, and a third checks that the pongs come
+ * back in order. Shm writers receive what they send as well, so both writing
+ * channels are drained, one message at a time. Exits non-zero on a mismatch.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+#include "kerneltalk.hpp"
+
+using kerneltalk::channel;
+using kerneltalk::message;
+using kerneltalk::task;
+
+task<> pinger(channel &ch, int count)
+{
+    for (int i = 0; i < count; i++)
+        co_await ch.send("ping " + std::to_string(i), i % 4 != 3 ? KT_MORE : 0);
+    co_await ch.flush();
+}
+
+task<> echo(channel &in, channel &out, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        message msg = co_await in.receive();
+        std::string s(msg.str());
+        msg.release();
+        co_await out.send(s);
+    }
+}
+
+task<> checker(channel &ch, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        message msg = co_await ch.receive();
+        if (msg.str() != "ping " + std::to_string(i))
+            throw std::runtime_error("kerneltalk_echo: got \"" + std::string(msg.str()) +
+                                     "\" for ping " + std::to_string(i));
+    }
+}
+
+task<> drain(channel &ch, int count)
+{
+    for (int i = 0; i < count; i++)
+        co_await ch.receive();
+}
+
+int main(int argc, char **argv)
+{
+    std::string name = "kerneltalk_echo." + std::to_string(getpid());
+    int count = 10000, opt, rv = EXIT_SUCCESS;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1)
+    {
+        if (opt != 'n')
+            return EXIT_FAILURE;
+        count = atoi(optarg);
+    }
+    if (optind < argc)
+        name = argv[optind];
+
+    try
+    {
+        kerneltalk::reactor r;
+        channel ping_w(r, ("shm:" + name + ".ping:4096").c_str());
+        channel ping_r(r, ("shm:" + name + ".ping").c_str());
+        channel pong_w(r, ("shm:" + name + ".pong:4096").c_str());
+        channel pong_r(r, ("shm:" + name + ".pong").c_str());
+
+        r.spawn(checker(pong_r, count));
+        r.spawn(echo(ping_r, pong_w, count));
+        r.spawn(drain(pong_w, count));
+        r.spawn(drain(ping_w, count));
+        r.spawn(pinger(ping_w, count));
+        r.run();
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << "\n";
+        rv = EXIT_FAILURE;
+    }
+    unlink(("/dev/shm/kerneltalk." + name + ".ping").c_str());
+    unlink(("/dev/shm/kerneltalk." + name + ".pong").c_str());
+    if (rv == EXIT_SUCCESS)
+        std::cout << count << " messages echoed\n";
+    return rv;
+}
@@ -0,0 +1,907 @@
+/*
+ * KernelTalk: kernel based chat
+ *
+ * A gateway that spans a channel across hosts.
+ *
+ *   kerneltalk_gateway [-l [ADDR:]PORT] [-c HOST:PORT]... [-m GROUP:PORT[:IFADDR]]
+ *                      [-H HOPS] FILENAME
+ *
+ * Every message written to the channel goes out to the gateway's links: TCP
+ * connections it accepts on PORT (-l) or makes itself (-c, redialled when they
+ * drop), and an IPv4 multicast group (-m, joined on IFADDR). Every message
+ * coming in from a link is written to the channel, and relayed to the other
+ * links, so gateways can be chained. Messages stay whole: on TCP each travels
+ * as a frame, on multicast as one datagram.
+ *
+ * Loops are cut three ways. The gateway doesn't send on what it wrote to the
+ * channel itself; a message that comes back to the gateway it started from is
+ * dropped; and one that has been relayed HOPS times (8) isn't relayed again.
+ * Links should still form a tree, with one multicast group counting as one
+ * node: in a cycle a message arrives twice before either rule stops it.
+ *
+ * Everything runs in one epoll loop and goes in batches: a batch of messages
+ * received from the channel is one write per TCP link and one sendmmsg() to
+ * the group, and a batch received from a link is one send to the channel.
+ *
+ * Backpressure only goes one way. A full channel stops the gateway from
+ * reading its links, which TCP pushes back to the remote writers. The gateway
+ * never stops receiving the channel, though: a TCP link whose queue grows past
+ * QUEUE_MAX (4 MiB) is too slow and is disconnected, and counted, and a dialled
+ * one is dialled again. Waiting for it instead would deadlock two gateways
+ * bridging both ways, each with a full channel waiting for the other to read
+ * its link. Multicast can't push back; datagrams that arrive while the gateway
+ * waits are dropped by the socket like any other.
+ *
+ * On SIGINT or SIGTERM the gateway prints what it moved and exits.
+ */
+
+#define _GNU_SOURCE // recvmmsg, sendmmsg, accept4
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+
+#include "kerneltalk.h"
+#include "libkerneltalk.h"
+
+#define BATCH 64             // messages moved at once
+#define MSG_MAX 65536        // longest message carried, longer ones are cut short
+#define UDP_MAX 65507        // largest IPv4 datagram
+#define IO_BUF 65536         // most read from a TCP link at once
+#define QUEUE_MAX (1 << 22)  // a link queue this full is too slow, and dropped
+#define MAX_LINKS 64
+#define MAX_HOPS 8
+#define REDIAL_NS 1000000000LL // wait between attempts to dial a link
+#define RETRY_MS 100           // try a full channel again this often
+#define FRAME_VERSION 1
+
+/*
+ * What goes before every message on the wire, in network byte order.
+ */
+struct frame
+{
+    uint32_t len;
+    uint32_t origin; // the gateway the message entered through
+    uint32_t sender; // the gateway that sent it this hop
+    uint8_t version;
+    uint8_t hops; // times it was relayed from one link to another
+    uint16_t pad;
+};
+
+/*
+ * Bytes waiting to be written or parsed, data[off, off + len).
+ */
+struct queue
+{
+    char *data;
+    size_t off, len, cap;
+};
+
+struct endpoint
+{
+    int fd;
+    unsigned int events; // registered with epoll
+    unsigned int want;   // what we wait for this time round
+    unsigned int ready;
+};
+
+struct link
+{
+    struct endpoint ep; // first, events carry a pointer to it
+    char name[64];
+    struct queue out; // frames waiting for the socket
+    struct queue in;  // received, not yet written to the channel
+    int dial;         // we connect it, and again when it drops
+    int connecting;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    long long redial_ns; // when to dial again, while down
+};
+
+struct gateway
+{
+    int epfd;
+    struct kt_channel *ch;
+    const char *path;
+    struct endpoint chan, listener, group;
+    struct link links[MAX_LINKS];
+    int nlinks;
+    uint32_t origin;
+    pid_t pid;
+    int max_hops;
+
+    // the multicast group
+    struct sockaddr_in group_addr;
+    struct frame group_frames[BATCH];
+    struct iovec group_iov[BATCH][2];
+    struct mmsghdr group_out[BATCH];
+    int group_queued;
+    char *udp_bufs[BATCH];
+    struct mmsghdr udp_in[BATCH];
+    struct iovec udp_iov[BATCH];
+    int udp_count, udp_next; // received datagrams, and the first not delivered
+
+    struct kt_msg msgs[BATCH];
+    int drained; // receiving the channel failed with EAGAIN since it last fired
+    int stalled; // the channel had no room for a message from a link
+
+    // what was moved, printed on exit
+    long long sent, sent_bytes, received, received_bytes, relayed;
+    long long looped, too_far, too_big, too_slow;
+};
+
+volatile sig_atomic_t stop;
+
+void die(const char *what)
+{
+    perror(what);
+    exit(EXIT_FAILURE);
+}
+
+long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+/*
+ * Make room for n more bytes at the end of q and return where they go.
+ */
+char *queue_tail(struct queue *q, size_t n)
+{
+    if (q->off + q->len + n > q->cap && q->off)
+    {
+        memmove(q->data, q->data + q->off, q->len);
+        q->off = 0;
+    }
+    if (q->len + n > q->cap)
+    {
+        q->cap = q->cap ? q->cap : IO_BUF;
+        while (q->len + n > q->cap)
+            q->cap *= 2;
+        q->data = realloc(q->data, q->cap);
+        if (!q->data)
+            die("kerneltalk_gateway");
+    }
+    return q->data + q->off + q->len;
+}
+
+void queue_put(struct queue *q, const void *data, size_t n)
+{
+    memcpy(queue_tail(q, n), data, n);
+    q->len += n;
+}
+
+void queue_drop(struct queue *q, size_t n)
+{
+    q->off += n;
+    q->len -= n;
+    if (q->len == 0)
+        q->off = 0;
+}
+
+void watch(struct gateway *gw, struct endpoint *ep, int fd)
+{
+    struct epoll_event ev = {.events = 0, .data.ptr = ep};
+
+    ep->fd = fd;
+    ep->events = 0;
+    ep->want = 0;
+    ep->ready = 0;
+    if (epoll_ctl(gw->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        die("epoll_ctl");
+}
+
+void update(struct gateway *gw, struct endpoint *ep)
+{
+    struct epoll_event ev = {.events = ep->want, .data.ptr = ep};
+
+    ep->ready = 0;
+    if (ep->want != ep->events && epoll_ctl(gw->epfd, EPOLL_CTL_MOD, ep->fd, &ev) < 0)
+        die("epoll_ctl");
+    ep->events = ep->want;
+}
+
+/*
+ * Split "[HOST:]PORT" at the last colon. host is NULL if there is none.
+ */
+int split_addr(char *spec, char **host, char **port)
+{
+    char *colon = strrchr(spec, ':');
+
+    *host = colon ? spec : NULL;
+    *port = colon ? colon + 1 : spec;
+    if (colon)
+        *colon = '\0';
+    return **port ? 0 : -1;
+}
+
+int resolve(const char *host, const char *port, int passive, struct sockaddr_storage *addr,
+            socklen_t *len)
+{
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM}, *res;
+    int err;
+
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    err = getaddrinfo(host, port, &hints, &res);
+    if (err)
+    {
+        fprintf(stderr, "kerneltalk_gateway: %s:%s: %s\n", host ? host : "*", port,
+                gai_strerror(err));
+        return -1;
+    }
+    memcpy(addr, res->ai_addr, res->ai_addrlen);
+    *len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+void link_name(struct link *l)
+{
+    char host[NI_MAXHOST], port[NI_MAXSERV];
+
+    if (getnameinfo((struct sockaddr *)&l->addr, l->addr_len, host, sizeof(host), port,
+                    sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+        strcpy(host, "?"), strcpy(port, "?");
+    snprintf(l->name, sizeof(l->name), "%s:%s", host, port);
+}
+
+void link_up(struct gateway *gw, struct link *l, int fd)
+{
+    int one = 1;
+
+    // we batch ourselves, Nagle would only add latency
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    watch(gw, &l->ep, fd);
+}
+
+void link_down(struct gateway *gw, struct link *l, const char *why)
+{
+    if (!l->connecting)
+        fprintf(stderr, "kerneltalk_gateway: %s: link down: %s\n", l->name, why);
+    epoll_ctl(gw->epfd, EPOLL_CTL_DEL, l->ep.fd, NULL);
+    close(l->ep.fd);
+    l->ep.fd = -1;
+    l->connecting = 0;
+    l->out.off = l->out.len = 0;
+    l->in.off = l->in.len = 0;
+    l->redial_ns = now_ns() + REDIAL_NS;
+    if (!l->dial)
+        gw->nlinks--;
+}
+
+void dial(struct gateway *gw, struct link *l)
+{
+    int fd;
+
+    fd = socket(l->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        die("socket");
+    l->connecting = 1;
+    link_up(gw, l, fd);
+    if (connect(fd, (struct sockaddr *)&l->addr, l->addr_len) < 0 && errno != EINPROGRESS)
+    {
+        link_down(gw, l, strerror(errno));
+        return;
+    }
+}
+
+void connected(struct gateway *gw, struct link *l)
+{
+    socklen_t len = sizeof(int);
+    int err = 0;
+
+    getsockopt(l->ep.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err)
+    {
+        link_down(gw, l, strerror(err));
+        return;
+    }
+    l->connecting = 0;
+    fprintf(stderr, "kerneltalk_gateway: %s: link up\n", l->name);
+}
+
+void accept_link(struct gateway *gw)
+{
+    struct link *l;
+    int fd, i;
+
+    for (i = 0; i < MAX_LINKS && (gw->links[i].ep.fd >= 0 || gw->links[i].dial); i++)
+        ;
+    l = &gw->links[i];
+    l->addr_len = sizeof(l->addr);
+    fd = accept4(gw->listener.fd, (struct sockaddr *)&l->addr, &l->addr_len,
+                 SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+    {
+        if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+            perror("accept");
+        return;
+    }
+    l->dial = 0;
+    l->connecting = 0;
+    link_name(l);
+    link_up(gw, l, fd);
+    gw->nlinks++;
+    fprintf(stderr, "kerneltalk_gateway: %s: link up\n", l->name);
+}
+
+int link_live(const struct link *l)
+{
+    return l->ep.fd >= 0 && !l->connecting;
+}
+
+/*
+ * Write as much of a link's queue as the socket takes now.
+ */
+void link_write(struct gateway *gw, struct link *l)
+{
+    ssize_t n;
+
+    if (!link_live(l) || l->out.len == 0)
+        return;
+    n = send(l->ep.fd, l->out.data + l->out.off, l->out.len, MSG_NOSIGNAL);
+    if (n < 0)
+    {
+        if (errno != EAGAIN && errno != EINTR)
+            link_down(gw, l, strerror(errno));
+        return;
+    }
+    queue_drop(&l->out, n);
+}
+
+/*
+ * Write what the links' sockets take now, and drop the links that still have
+ * more than QUEUE_MAX queued: the channel doesn't wait for them.
+ */
+void links_write(struct gateway *gw)
+{
+    struct link *l;
+    int i;
+
+    for (i = 0; i < MAX_LINKS; i++)
+    {
+        l = &gw->links[i];
+        link_write(gw, l);
+        if (link_live(l) && l->out.len >= QUEUE_MAX)
+        {
+            link_down(gw, l, "too slow");
+            gw->too_slow++;
+        }
+    }
+}
+
+/*
+ * Send the datagrams queued for the group, in one system call.
+ */
+void group_flush(struct gateway *gw)
+{
+    int n, done = 0;
+
+    while (done < gw->group_queued)
+    {
+        n = sendmmsg(gw->group.fd, gw->group_out + done, gw->group_queued - done, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            perror("sendmmsg");
+            break;
+        }
+        done += n;
+    }
+    gw->group_queued = 0;
+}
+
+/*
+ * Queue a message for every link but the one it came from, and return how
+ * many that was. data must stay valid up to the next group_flush().
+ */
+int forward(struct gateway *gw, const struct link *from, int from_group, const struct frame *wire,
+            const void *data, size_t len)
+{
+    struct frame f = *wire;
+    struct mmsghdr *m;
+    int i, n = 0;
+
+    f.sender = htonl(gw->origin);
+
+    for (i = 0; i < MAX_LINKS; i++)
+    {
+        if (&gw->links[i] == from || !link_live(&gw->links[i]))
+            continue;
+        queue_put(&gw->links[i].out, &f, sizeof(f));
+        queue_put(&gw->links[i].out, data, len);
+        n++;
+    }
+    if (gw->group.fd < 0 || from_group)
+        return n;
+    if (len > UDP_MAX - sizeof(f))
+    {
+        gw->too_big++;
+        return n;
+    }
+    if (gw->group_queued == BATCH)
+        group_flush(gw);
+    m = &gw->group_out[gw->group_queued];
+    gw->group_frames[gw->group_queued] = f;
+    gw->group_iov[gw->group_queued][0] =
+        (struct iovec){&gw->group_frames[gw->group_queued], sizeof(f)};
+    gw->group_iov[gw->group_queued][1] = (struct iovec){(void *)data, len};
+    m->msg_hdr = (struct msghdr){.msg_name = &gw->group_addr,
+                                 .msg_namelen = sizeof(gw->group_addr),
+                                 .msg_iov = gw->group_iov[gw->group_queued],
+                                 .msg_iovlen = 2};
+    gw->group_queued++;
+    return n + 1;
+}
+
+/*
+ * Receive a batch from the channel and send it out. Returns the number of
+ * messages received, 0 when there are none.
+ */
+int from_channel(struct gateway *gw)
+{
+    struct frame f = {.origin = htonl(gw->origin), .version = FRAME_VERSION};
+    int i, n;
+
+    for (i = 0; i < BATCH; i++)
+        gw->msgs[i].len = MSG_MAX;
+    n = kt_recv_many(gw->ch, gw->msgs, BATCH);
+    if (n < 0)
+    {
+        if (errno == EAGAIN)
+            gw->drained = 1;
+        else if (errno != EINTR)
+            die(gw->path);
+        return 0;
+    }
+    for (i = 0; i < n; i++)
+    {
+        // what we wrote ourselves came from a link
+        if (gw->msgs[i].info.pid == gw->pid)
+            continue;
+        f.len = htonl(gw->msgs[i].len);
+        forward(gw, NULL, 0, &f, gw->msgs[i].buf, gw->msgs[i].len);
+        gw->sent++;
+        gw->sent_bytes += gw->msgs[i].len;
+    }
+    group_flush(gw);
+    links_write(gw);
+    return n;
+}
+
+/*
+ * Write a message from a link to the channel and relay it. Returns -1 when
+ * the channel has no room for it yet.
+ */
+int deliver(struct gateway *gw, const struct link *from, int from_group, const struct frame *wire,
+            const void *data, size_t len)
+{
+    struct frame f = *wire;
+
+    if (ntohl(f.origin) == gw->origin)
+    {
+        gw->looped++;
+        return 0;
+    }
+    if (kt_send(gw->ch, data, len, KT_MORE) < 0)
+    {
+        if (errno != EAGAIN)
+            die(gw->path);
+        gw->stalled = 1;
+        return -1;
+    }
+    gw->received++;
+    gw->received_bytes += len;
+    if (f.hops >= gw->max_hops)
+    {
+        gw->too_far++;
+        return 0;
+    }
+    f.hops++;
+    if (forward(gw, from, from_group, &f, data, len))
+        gw->relayed++;
+    return 0;
+}
+
+/*
+ * Deliver the whole frames received on a link. Returns -1 if the link was
+ * dropped.
+ */
+int link_deliver(struct gateway *gw, struct link *l)
+{
+    const struct frame *f;
+    size_t len;
+
+    while (!gw->stalled && l->in.len >= sizeof(*f))
+    {
+        f = (const struct frame *)(l->in.data + l->in.off);
+        len = ntohl(f->len);
+        if (f->version != FRAME_VERSION || len > MSG_MAX)
+        {
+            link_down(gw, l, "bad frame");
+            group_flush(gw);
+            return -1;
+        }
+        if (l->in.len < sizeof(*f) + len)
+            break;
+        if (deliver(gw, l, 0, f, f + 1, len) < 0)
+            break;
+        queue_drop(&l->in, sizeof(*f) + len);
+    }
+    group_flush(gw);
+    return 0;
+}
+
+void read_link(struct gateway *gw, struct link *l)
+{
+    ssize_t n;
+
+    n = recv(l->ep.fd, queue_tail(&l->in, IO_BUF), IO_BUF, 0);
+    if (n < 0)
+    {
+        if (errno != EAGAIN && errno != EINTR)
+            link_down(gw, l, strerror(errno));
+        return;
+    }
+    if (n == 0)
+    {
+        link_down(gw, l, "closed");
+        return;
+    }
+    l->in.len += n;
+    link_deliver(gw, l);
+}
+
+/*
+ * Deliver the datagrams received from the group.
+ */
+void group_deliver(struct gateway *gw)
+{
+    const struct frame *f;
+    size_t len;
+
+    for (; !gw->stalled && gw->udp_next < gw->udp_count; gw->udp_next++)
+    {
+        f = (const struct frame *)gw->udp_bufs[gw->udp_next];
+        len = gw->udp_in[gw->udp_next].msg_len;
+        // not ours, or mangled
+        if (len < sizeof(*f) || f->version != FRAME_VERSION || ntohl(f->len) != len - sizeof(*f))
+            continue;
+        // our own, looped back to us
+        if (ntohl(f->sender) == gw->origin)
+            continue;
+        if (deliver(gw, NULL, 1, f, f + 1, len - sizeof(*f)) < 0)
+            break;
+    }
+}
+
+void read_group(struct gateway *gw)
+{
+    int i, n;
+
+    for (i = 0; i < BATCH; i++)
+    {
+        gw->udp_iov[i] = (struct iovec){gw->udp_bufs[i], UDP_MAX};
+        gw->udp_in[i].msg_hdr = (struct msghdr){.msg_iov = &gw->udp_iov[i], .msg_iovlen = 1};
+    }
+    n = recvmmsg(gw->group.fd, gw->udp_in, BATCH, MSG_DONTWAIT, NULL);
+    if (n < 0)
+    {
+        if (errno != EAGAIN && errno != EINTR)
+            die("recvmmsg");
+        return;
+    }
+    gw->udp_count = n;
+    gw->udp_next = 0;
+    group_deliver(gw);
+    links_write(gw);
+}
+
+/*
+ * Push what is waiting for the channel. Returns -1 while it has no room.
+ */
+int flush_channel(struct gateway *gw)
+{
+    int i;
+
+    if (kt_flush(gw->ch) < 0 && errno != EAGAIN)
+        die(gw->path);
+    if (kt_queued(gw->ch))
+        return -1;
+    if (!gw->stalled)
+        return 0;
+
+    // carry on where the channel was full, then let the links read again
+    gw->stalled = 0;
+    group_deliver(gw);
+    for (i = 0; i < MAX_LINKS && !gw->stalled; i++)
+        if (link_live(&gw->links[i]))
+            link_deliver(gw, &gw->links[i]);
+    links_write(gw);
+    if (kt_flush(gw->ch) < 0 && errno != EAGAIN)
+        die(gw->path);
+    return gw->stalled || kt_queued(gw->ch) ? -1 : 0;
+}
+
+int open_listener(struct gateway *gw, char *spec)
+{
+    struct sockaddr_storage addr;
+    socklen_t len;
+    char *host, *port;
+    int fd, one = 1;
+
+    if (split_addr(spec, &host, &port) < 0 || resolve(host, port, 1, &addr, &len) < 0)
+        return -1;
+    fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        die("socket");
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&addr, len) < 0 || listen(fd, 16) < 0)
+        die(spec);
+    watch(gw, &gw->listener, fd);
+    return 0;
+}
+
+int add_dialled(struct gateway *gw, char *spec)
+{
+    struct link *l = &gw->links[gw->nlinks];
+    char *host, *port;
+
+    if (gw->nlinks == MAX_LINKS || split_addr(spec, &host, &port) < 0 || !host ||
+        resolve(host, port, 0, &l->addr, &l->addr_len) < 0)
+        return -1;
+    l->dial = 1;
+    link_name(l);
+    gw->nlinks++;
+    dial(gw, l);
+    return 0;
+}
+
+/*
+ * GROUP:PORT[:IFADDR]. The group's traffic loops back, so gateways on one
+ * host hear each other; each ignores the datagrams it sent itself.
+ */
+int open_group(struct gateway *gw, char *spec)
+{
+    struct ip_mreq mreq = {0};
+    char *port, *ifaddr;
+    int fd, one = 1, i;
+
+    port = strchr(spec, ':');
+    if (!port)
+        return -1;
+    *port++ = '\0';
+    ifaddr = strchr(port, ':');
+    if (ifaddr)
+        *ifaddr++ = '\0';
+    gw->group_addr.sin_family = AF_INET;
+    gw->group_addr.sin_port = htons(atoi(port));
+    if (inet_pton(AF_INET, spec, &gw->group_addr.sin_addr) != 1 ||
+        !IN_MULTICAST(ntohl(gw->group_addr.sin_addr.s_addr)) ||
+        (ifaddr && inet_pton(AF_INET, ifaddr, &mreq.imr_interface) != 1))
+        return -1;
+    mreq.imr_multiaddr = gw->group_addr.sin_addr;
+
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        die("socket");
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&gw->group_addr, sizeof(gw->group_addr)) < 0)
+        die(spec);
+    if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0 ||
+        setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &one, sizeof(one)) < 0 ||
+        (ifaddr && setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &mreq.imr_interface,
+                              sizeof(mreq.imr_interface)) < 0))
+        die(spec);
+    for (i = 0; i < BATCH; i++)
+    {
+        gw->udp_bufs[i] = malloc(UDP_MAX);
+        if (!gw->udp_bufs[i])
+            die("kerneltalk_gateway");
+    }
+    // sends block for socket buffer space, receives never
+    watch(gw, &gw->group, fd);
+    return 0;
+}
+
+void run(struct gateway *gw)
+{
+    struct epoll_event events[64];
+    struct endpoint *ep;
+    struct link *l;
+    long long now, next;
+    int i, n, timeout;
+    // a shm channel's fd only becomes readable, for room too
+    unsigned int room = kt_mode(gw->ch) == KT_MODE_SHM ? EPOLLIN : EPOLLOUT;
+
+    while (!stop)
+    {
+        now = now_ns();
+        next = -1;
+
+        // the channel's fd only reports data once receiving ran dry
+        if (!gw->drained)
+            from_channel(gw);
+
+        gw->chan.want = (!gw->drained ? 0 : EPOLLIN) |
+                        (gw->stalled || kt_queued(gw->ch) ? room : 0);
+        update(gw, &gw->chan);
+        if (gw->listener.fd >= 0)
+        {
+            gw->listener.want = gw->nlinks < MAX_LINKS ? EPOLLIN : 0;
+            update(gw, &gw->listener);
+        }
+        if (gw->group.fd >= 0)
+        {
+            gw->group.want = gw->stalled ? 0 : EPOLLIN;
+            update(gw, &gw->group);
+        }
+        for (i = 0; i < MAX_LINKS; i++)
+        {
+            l = &gw->links[i];
+            if (l->dial && l->ep.fd < 0)
+            {
+                if (now >= l->redial_ns)
+                    dial(gw, l);
+                else if (next < 0 || l->redial_ns < next)
+                    next = l->redial_ns;
+            }
+            if (l->ep.fd < 0)
+                continue;
+            l->ep.want = l->connecting ? EPOLLOUT
+                                       : (gw->stalled ? 0 : EPOLLIN) |
+                                             (l->out.len ? EPOLLOUT : 0);
+            update(gw, &l->ep);
+        }
+
+        timeout = !gw->drained ? 0 : next < 0 ? -1 : (int)((next - now) / 1000000 + 1);
+        // a shm channel only drops a dead reader when someone tries to send
+        if ((gw->stalled || kt_queued(gw->ch)) && (timeout < 0 || timeout > RETRY_MS))
+            timeout = RETRY_MS;
+        n = epoll_wait(gw->epfd, events, 64, timeout);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            die("epoll_wait");
+        for (i = 0; i < n; i++)
+            ((struct endpoint *)events[i].data.ptr)->ready = events[i].events;
+
+        if (gw->chan.ready & EPOLLIN)
+            gw->drained = 0;
+        if (gw->listener.ready)
+            accept_link(gw);
+        if (gw->group.ready)
+            read_group(gw);
+        for (i = 0; i < MAX_LINKS; i++)
+        {
+            l = &gw->links[i];
+            ep = &l->ep;
+            if (ep->fd < 0 || !ep->ready)
+                continue;
+            if (l->connecting)
+            {
+                connected(gw, l);
+                continue;
+            }
+            if (ep->ready & EPOLLOUT)
+                link_write(gw, l);
+            if (ep->fd >= 0 && (ep->ready & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                read_link(gw, l);
+        }
+        if (gw->stalled || kt_queued(gw->ch))
+            flush_channel(gw);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct gateway gw = {.listener.fd = -1, .group.fd = -1, .max_hops = MAX_HOPS};
+    struct sigaction sa = {.sa_handler = on_signal};
+    char *listen_spec = NULL, *group_spec = NULL;
+    char *dial_specs[MAX_LINKS];
+    int opt, ndial = 0, i;
+
+    while ((opt = getopt(argc, argv, "l:c:m:H:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'l':
+            listen_spec = optarg;
+            break;
+        case 'c':
+            if (ndial == MAX_LINKS)
+                goto usage;
+            dial_specs[ndial++] = optarg;
+            break;
+        case 'm':
+            group_spec = optarg;
+            break;
+        case 'H':
+            gw.max_hops = atoi(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind + 1 != argc || gw.max_hops < 1 || gw.max_hops > 255 ||
+        (!listen_spec && !ndial && !group_spec))
+        goto usage;
+
+    gw.path = argv[optind];
+    gw.pid = getpid();
+    if (getrandom(&gw.origin, sizeof(gw.origin), 0) != sizeof(gw.origin))
+        die("getrandom");
+    gw.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (gw.epfd < 0)
+        die("epoll_create1");
+    for (i = 0; i < MAX_LINKS; i++)
+        gw.links[i].ep.fd = -1;
+    for (i = 0; i < BATCH; i++)
+    {
+        gw.msgs[i].buf = malloc(MSG_MAX);
+        if (!gw.msgs[i].buf)
+            die("kerneltalk_gateway");
+    }
+
+    // the batch ioctls say who wrote a message, so we can skip our own
+    gw.ch = kt_open(gw.path, KT_NONBLOCK | KT_NOMMAP);
+    if (!gw.ch)
+        die(gw.path);
+    if (kt_mode(gw.ch) == KT_MODE_PLAIN)
+    {
+        fprintf(stderr, "kerneltalk_gateway: %s: needs the batch ioctls\n", gw.path);
+        return EXIT_FAILURE;
+    }
+    watch(&gw, &gw.chan, kt_fd(gw.ch));
+
+    if (listen_spec && open_listener(&gw, listen_spec) < 0)
+        goto usage;
+    if (group_spec && open_group(&gw, group_spec) < 0)
+        goto usage;
+    for (i = 0; i < ndial; i++)
+        if (add_dialled(&gw, dial_specs[i]) < 0)
+            goto usage;
+
+    // no SA_RESTART, so the loop sees the signal
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    run(&gw);
+
+    fprintf(stderr,
+            "kerneltalk_gateway: sent %lld messages (%lld bytes), received %lld (%lld bytes), "
+            "relayed %lld; dropped %lld looped, %lld past %d hops, %lld too big for the group; "
+            "disconnected %lld slow links\n",
+            gw.sent, gw.sent_bytes, gw.received, gw.received_bytes, gw.relayed, gw.looped,
+            gw.too_far, gw.max_hops, gw.too_big, gw.too_slow);
+    kt_close(gw.ch);
+    return EXIT_SUCCESS;
+
+usage:
+    fprintf(stderr, "usage: %s [-l [ADDR:]PORT] [-c HOST:PORT]... [-m GROUP:PORT[:IFADDR]] "
+                    "[-H HOPS] FILENAME\n",
+            argv[0]);
+    return EXIT_FAILURE;
+}
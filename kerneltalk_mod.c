@@ -8,32 +8,239 @@
 #include <linux/kernel.h>  /* it's the kernel yo */
 #include <linux/module.h>  /* it's a module yo */
 #include <linux/init.h>	   /* for module_{init,exit} */
+#include <linux/moduleparam.h> /* module_param */
 #include <linux/slab.h>	   /* kmalloc */
+#include <linux/vmalloc.h> /* vmap */
+#include <linux/mm.h>	   /* vm_area_struct */
+#include <linux/gfp.h>	   /* alloc_pages_node */
+#include <linux/huge_mm.h> /* HPAGE_PMD_ORDER */
+#include <linux/log2.h>	   /* roundup_pow_of_two */
+#include <linux/topology.h> /* numa_node_id */
+#include <linux/nodemask.h> /* for_each_online_node */
 #include <linux/fs.h>	   /* file_operations, file, etc... */
 #include <linux/list.h>	   /* all the list stuff */
 #include <linux/mutex.h>   /* struct mutex */
 #include <linux/rwsem.h>   /* struct rw_semaphore */
+#include <linux/rtmutex.h> /* struct rt_mutex */
+#include <linux/spinlock.h> /* spinlock_t */
 #include <linux/poll.h>	   /* for the polling/select stuff! */
 #include <linux/sched.h>   /* poll.h doesn't always include this */
 #include <linux/wait.h>	   /* for wait queues */
-#include <linux/uaccess.h> /* for put_user */
+#include <linux/workqueue.h> /* deferred wakeups */
+#include <linux/uaccess.h> /* for put_user, copy_to_user */
+#include <linux/uio.h>	   /* struct iov_iter */
+#include <linux/debugfs.h> /* the benchmark's control file */
+#include <linux/seq_file.h> /* the channel statistics */
+#include <linux/percpu.h>  /* alloc_percpu */
+#include <linux/kthread.h> /* benchmark threads */
+#include <linux/cpumask.h> /* cpulist_parse */
+#include <linux/timex.h>   /* get_cycles */
+#include <linux/delay.h>   /* msleep */
+#include <linux/ktime.h>   /* ktime_get_ns */
+#include <linux/eventfd.h> /* eventfd_signal */
+#include <linux/shmem_fs.h> /* shmem_file_setup */
+#include <linux/falloc.h>  /* FALLOC_FL_PUNCH_HOLE */
+#include <linux/memcontrol.h> /* get_mem_cgroup_from_mm */
+#include <linux/sched/mm.h> /* set_active_memcg */
+#include <linux/version.h> /* LINUX_VERSION_CODE */
+#include <asm/ioctls.h>	   /* FIONREAD */
+
+#include "kerneltalk.h"
+#include "kerneltalk_ring.h"
 
 #define KERNELTALK_VMAJOR 0
 #define KERNELTALK_VMINOR 1
 #define SUCCESS 0
 #define DEVICE_NAME "kerneltalk"
 #define KERNELTALK_BUF 2048
+#define KERNELTALK_MAX_BUF (1U << 30)
+#define KERNELTALK_SHARDS 8
+#define KERNELTALK_LAT_BUCKETS 40 // log2 of nanoseconds, up to 9 minutes
+#define AUTOSIZE_HOT 3			  // full periods in a row before growing
+#define AUTOSIZE_COLD 30		  // empty periods in a row before shrinking
+#define STAGE_MAX (1 << 20)		  // most a client may stage, see stage_size()
+#define STAGE_RETRY_MS 10		  // how soon a due stage that found no room retries
+#define NONBLOCK_NOWAIT 2		  // nonblock for IOCB_NOWAIT, see nonblocking()
 
-#define DIST(a, b) ((a) <= (b) ? (b) - (a) : KERNELTALK_BUF + (b) - (a))
+/*
+ * Shorthands for the ring arithmetic in kerneltalk_ring.h.
+ */
+#define IDX(srv, pos) kt_idx((srv)->size, pos)
+#define REC(srv, n) kt_rec((srv)->recs, (srv)->nr_recs, n)
+#define REC_END(srv, n) kt_rec_end((srv)->recs, (srv)->nr_recs, n)
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+#define kt_eventfd_signal(ctx) eventfd_signal(ctx)
+#else
+#define kt_eventfd_signal(ctx) eventfd_signal(ctx, 1)
+#endif
+
+/*
+ * Iterators name their direction ITER_DEST and ITER_SOURCE since 6.1, READ
+ * and WRITE before.
+ */
+#ifndef ITER_DEST
+#define ITER_DEST READ
+#define ITER_SOURCE WRITE
+#endif
+
+/*
+ * splice() goes through read_iter and write_iter. The generic splice_read
+ * that copies into the pipe's pages was renamed in 6.5.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+#define kt_splice_read copy_splice_read
+#else
+#define kt_splice_read generic_file_splice_read
+#endif
+
+/*
+ * A client's spill is charged to the client's memory cgroup, not to the
+ * writer that fills it. Before 5.10 there is no way to say so, and the writer
+ * pays.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+#define kt_set_active_memcg set_active_memcg
+#else
+static inline struct mem_cgroup *kt_set_active_memcg(struct mem_cgroup *memcg)
+{
+	return NULL;
+}
+#endif
+
+/*
+ * Rings can be built from PMD-sized folios. Mapping those with a single PMD
+ * needs vmf_insert_folio_pmd(); on older kernels they are mapped page by page,
+ * which still saves the kernel side of the TLB.
+ */
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+#define KT_HUGE_ORDER HPAGE_PMD_ORDER
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
+#define KT_HUGE_MAP
+#endif
+#else
+#define KT_HUGE_ORDER 0
+#endif
 
 static int kerneltalk_open(struct inode *, struct file *);
-static int kerneltalk_flush(struct file *, fl_owner_t);
-static ssize_t kerneltalk_read(struct file *, char *, size_t, loff_t *);
-static ssize_t kerneltalk_write(struct file *, const char *, size_t, loff_t *);
+static int kerneltalk_release(struct inode *, struct file *);
+static ssize_t kerneltalk_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t kerneltalk_write_iter(struct kiocb *, struct iov_iter *);
 static unsigned int kerneltalk_poll(struct file *, poll_table *);
+static int kerneltalk_fsync(struct file *, loff_t, loff_t, int);
+static long kerneltalk_ioctl(struct file *, unsigned int, unsigned long);
+static int kerneltalk_mmap(struct file *, struct vm_area_struct *);
+static int kerneltalk_fasync(int, struct file *, int);
+
+/*
+ * The bytes of a ring live in pages from one NUMA node, mapped contiguously
+ * with vmap() so the copy helpers only see a flat buffer.
+ */
+struct kerneltalk_ring
+{
+	struct page **pages;
+	unsigned int nr_pages;
+	unsigned int order; // pages come in folios of this order
+	char *data;			// vmap() of pages
+	int node;
+};
+
+/*
+ * Readers are spread round-robin over a few shards, each with its own wait
+ * queue and list of clients to notify. A big fan-out then runs on several CPUs
+ * at once instead of walking every subscriber in one go.
+ */
+struct kerneltalk_shard
+{
+	struct kerneltalk_server *server;
+	wait_queue_head_t rwq;			// whom to wake when data is available
+	struct mutex notify_lock;		// protects notify_list
+	struct list_head notify_list;	// clients with an eventfd or SIGIO
+	struct work_struct notify_work; // runs notify_shard() for big channels
+};
+
+/*
+ * A channel's counters, one set per CPU so that writers and readers on
+ * different CPUs don't fight over them. They are summed when read, see
+ * stats_show().
+ */
+struct kerneltalk_stats
+{
+	u64 msgs;		 // records committed
+	u64 bytes;		 // bytes committed
+	u64 reads;		 // records read to their end
+	u64 read_bytes;	 // bytes read
+	u64 stalls;		 // times a writer found no room
+	u64 stall_ns;	 // time writers slept waiting for room
+	u64 wakeups;	 // reader fan-outs, see kick_readers()
+	u64 spilled;	 // bytes moved out of the ring into clients' spills
+	u64 lat[KERNELTALK_LAT_BUCKETS]; // commit to read, by log2 of ns
+};
+
+/*
+ * A record in a client's spill, followed by its data padded to 8 bytes.
+ */
+struct kt_spill_rec
+{
+	u64 seq;
+	u64 stamp;
+	s32 pid;
+	u32 len;   // data bytes that follow
+	u32 flags; // KERNELTALK_MSG_PARTIAL if the client had begun reading it
+	u32 pad;
+};
+
+/*
+ * A client's overflow store, see spill_client(). Positions only grow and are
+ * taken modulo size in the file, like in the ring.
+ */
+struct kerneltalk_spill
+{
+	struct file *file; // unlinked tmpfs file, NULL if the client can't spill
+	u32 size;		   // bytes the file may hold, a power of two
+	u64 rd;			   // where the record being read starts
+	u64 wr;			   // where the next record goes
+	u64 bytes;		   // data bytes not read yet
+	u64 recs;		   // records not read to their end yet
+	struct kt_spill_rec cur; // the record at rd, if loaded
+	int loaded;
+	u32 off; // bytes of cur already read
+};
+
+/*
+ * A message in a client's stage, followed by its data padded to 8 bytes.
+ */
+struct kt_stage_rec
+{
+	u32 len;
+	s32 pid; // sender's tgid
+};
+
+/*
+ * What a client sends while corked, or in the middle of a KERNELTALK_MSG_MORE
+ * sequence, waits in its stage until flush_stage() commits all of it at once.
+ * Other writers never wait for it.
+ */
+struct kerneltalk_stage
+{
+	struct mutex lock;		  // taken before buffer_lock
+	int corked;				  // KERNELTALK_IOC_CORK
+	int more;				  // the last message staged had KERNELTALK_MSG_MORE
+	u32 cork_ms;			  // how long staged data may wait
+	char *buf;				  // NULL until first needed, see stage_alloc()
+	u32 size;
+	u32 used;				  // bytes of buf in use, headers included
+	u32 bytes;				  // data bytes staged
+	u32 recs;				  // messages staged
+	struct delayed_work work; // flushes on time, see stage_work_fn()
+};
 
 /*
  * Chat server exists per-inode.
+ *
+ * The clients' read positions are kept in a min-heap, so the slowest reader
+ * (which decides how much room writers have) is always at heap[0] and moving
+ * a reader costs O(log n) rather than a walk over the client list.
  */
 struct kerneltalk_server
 {
@@ -41,11 +248,45 @@ struct kerneltalk_server
 	struct list_head server_list;  // CONTAINED IN this list
 	struct list_head client_list;  // CONTAINS this list
 	struct mutex client_list_lock; // protects client_list
-	wait_queue_head_t rwq;		   // whom to wake when data is available
-	wait_queue_head_t wwq;		   // whom to wake when room is available
-	char buffer[KERNELTALK_BUF];
-	struct rw_semaphore buffer_lock;
-	int end;
+	unsigned int nr_clients;	   // length of client_list
+	unsigned int next_shard;	   // where the next client goes
+	struct kerneltalk_shard shards[KERNELTALK_SHARDS];
+	wait_queue_head_t wwq; // whom to wake when room is available
+	wait_queue_head_t swq; // whom to wake when readers move (fsync)
+	spinlock_t heap_lock;  // protects heap, heap_len and clients' pos and rec
+	struct kt_cursor **heap;
+	unsigned int heap_len;	// clients in the heap
+	unsigned int heap_size; // allocated slots, changed under client_list_lock
+	struct kerneltalk_ctrl *ctrl;	   // control pages, first in a mapping
+	unsigned int ctrl_pages;
+	u32 size;						   // ring size in bytes, a power of two
+	unsigned int order;				   // folio order asked for the rings
+	pgoff_t ring_pgoff;				   // where the ring starts in a mapping
+	struct kerneltalk_ring *ring;	   // where writers put the data
+	struct kerneltalk_ring **replicas; // per-node copies, NULL if not replicating
+	int homed;						   // ring placement is final
+	atomic_t nr_maps;				   // mappings of the ring, they pin it
+	struct mutex map_lock;			   // see kerneltalk_mmap()
+	struct kt_rec *recs;			 // one per write, for the batch ioctls
+	u32 nr_recs;					 // see kt_nr_recs()
+	struct rw_semaphore buffer_lock; // protects the rings, recs, head, rec_head
+	struct rt_mutex rt_lock;		 // replaces buffer_lock if rt is set
+	int rt;							 // real-time channel, see rt_locking
+	u64 head;	  // end of what readers can see
+	u64 rec_head; // number of the next record readers will see
+	struct kerneltalk_stats __percpu *stats;
+	struct delayed_work autosize_work; // see autosize_work_fn()
+	int autosize;					   // the ring follows the load
+	u32 size_min, size_max;			   // bounds for the autosizer
+	u32 peak_used;		 // fullest the ring got since the autosizer looked
+	u64 last_stalls;	 // stalls when the autosizer last looked
+	unsigned int hot;	 // periods in a row the ring got nearly full
+	unsigned int cold;	 // periods in a row it stayed mostly empty
+	unsigned int resizes;
+	u32 spill_max;			 // size of clients' spills, 0 if they don't spill
+	atomic64_t spill_unread; // bytes in all clients' spills
+	struct list_head spill_list; // clients with a backlog in their spill; heap_lock
+	atomic_t spill_gen;		 // bumped when a spill frees room, see wait_for_room()
 };
 
 /*
@@ -57,9 +298,116 @@ struct kerneltalk_client
 	struct file *filp;
 	struct kerneltalk_server *server;
 	struct list_head client_list; /* CONTAINED IN this list */
-	int offset;
+	struct kerneltalk_shard *shard;
+	struct list_head notify_list; /* CONTAINED IN shard's list, if notifying */
+	struct kt_cursor cur; /* read position, in the server's heap */
+	u64 last_write; /* position just past our last write */
+	struct eventfd_ctx *evfd; /* protected by shard's notify_lock */
+	struct fasync_struct *fasync;
+	u32 lowat; /* unread bytes that trigger a notification */
+	int armed; /* unread went below lowat since the last notification */
+	struct kerneltalk_stage stage; /* held back messages, see flush_stage() */
+	struct kerneltalk_spill spill; /* backlog moved out of the ring */
+	struct list_head spill_list; /* CONTAINED IN server's list, while spilled */
+	struct mem_cgroup *memcg; /* pays for the spill's pages */
+	struct mutex read_mutex; /* held by reads on channels that spill */
+	int mapped; /* mapped the ring, so it reads there and never spills; map_lock */
 };
 
+/*
+ * Writers notify readers themselves only on small channels. On bigger ones the
+ * fan-out is handed to this workqueue, so the cost of a write doesn't grow with
+ * the number of subscribers.
+ */
+static unsigned int inline_wakeups = 4;
+module_param(inline_wakeups, uint, 0644);
+MODULE_PARM_DESC(inline_wakeups, "Channels with more clients than this wake readers from a workqueue (default 4)");
+
+static struct workqueue_struct *kerneltalk_wq;
+
+/*
+ * Ring placement. By default a channel's ring moves to the node of the first
+ * writer, since the writer touches every byte once and then each reader
+ * touches it again; with replicate set, every other online node also gets a
+ * copy that the writer keeps up to date, so readers copy from local memory.
+ * Both only apply to channels created afterwards.
+ */
+static int ring_node = NUMA_NO_NODE;
+module_param(ring_node, int, 0644);
+MODULE_PARM_DESC(ring_node, "NUMA node for channel rings, -1 for the first writer's node (default -1)");
+
+static bool replicate;
+module_param(replicate, bool, 0644);
+MODULE_PARM_DESC(replicate, "Keep a read-only replica of each ring on every NUMA node (default N)");
+
+/*
+ * Ring size for new channels. Big rings that many readers map spend a lot of
+ * time in TLB misses, so they can be built from huge pages when available.
+ */
+static unsigned int ring_size = KERNELTALK_BUF;
+module_param(ring_size, uint, 0644);
+MODULE_PARM_DESC(ring_size, "Ring size in bytes for new channels, rounded up to a power of two (default 2048)");
+
+static bool huge_pages;
+module_param(huge_pages, bool, 0644);
+MODULE_PARM_DESC(huge_pages, "Back rings of at least one huge page with huge pages (default N)");
+
+/*
+ * Ring autosizing. With autosize set, new channels look at their writers every
+ * autosize_ms and double the ring when they keep stalling or filling it, or
+ * halve it when it stays mostly empty, between autosize_min (0 is the size the
+ * channel started with) and autosize_max. Rings that somebody maps keep their
+ * size, since the mapping can't follow.
+ */
+static bool autosize;
+module_param(autosize, bool, 0644);
+MODULE_PARM_DESC(autosize, "New channels grow and shrink their ring with the load (default N)");
+
+static unsigned int autosize_min;
+module_param(autosize_min, uint, 0644);
+MODULE_PARM_DESC(autosize_min, "Smallest ring the autosizer shrinks to, 0 for the initial size (default 0)");
+
+static unsigned int autosize_max = 16 << 20;
+module_param(autosize_max, uint, 0644);
+MODULE_PARM_DESC(autosize_max, "Largest ring the autosizer grows to (default 16 MiB)");
+
+static unsigned int autosize_ms = 1000;
+module_param(autosize_ms, uint, 0644);
+MODULE_PARM_DESC(autosize_ms, "How often the autosizer looks at a channel, in ms (default 1000)");
+
+/*
+ * How long KERNELTALK_MSG_MORE holds a message back when the writer isn't
+ * corked, like the 200 ms of TCP_CORK.
+ */
+static unsigned int cork_ms = 200;
+module_param(cork_ms, uint, 0644);
+MODULE_PARM_DESC(cork_ms, "Longest a message sent with MSG_MORE is held back, in ms (default 200, at most 1000)");
+
+/*
+ * Spilling. With spill set, a client of a new channel that lags so far behind
+ * that writers would wait for it gets its backlog moved to a tmpfs file of up
+ * to spill_max bytes instead, and catches up from there. Writers only wait
+ * once a laggard's spill is full too.
+ */
+static bool spill;
+module_param(spill, bool, 0644);
+MODULE_PARM_DESC(spill, "New channels move lagging readers' backlogs out of the ring (default N)");
+
+static unsigned int spill_max = 64 << 20;
+module_param(spill_max, uint, 0644);
+MODULE_PARM_DESC(spill_max, "Most bytes a lagging reader's spill holds, rounded up to a power of two (default 64 MiB)");
+
+/*
+ * Real-time channels for SCHED_FIFO readers. A read-write semaphore doesn't
+ * boost its owner, so a high priority reader can wait behind a writer that was
+ * itself preempted by something of middling priority. These channels use a
+ * priority-inheriting rt_mutex instead, giving up concurrent readers, and
+ * always wake readers from the writer rather than from a kworker.
+ */
+static bool rt_locking;
+module_param(rt_locking, bool, 0644);
+MODULE_PARM_DESC(rt_locking, "New channels use priority-inheriting locks and inline wakeups (default N)");
+
 /*
  * This is the global server list. One per inode.
  */
@@ -76,11 +424,20 @@ static int major;
  * open, close, read, write calls to our special device files.
  */
 static struct file_operations kerneltalk_fops = {
-	.read = kerneltalk_read,
-	.write = kerneltalk_write,
+	.read_iter = kerneltalk_read_iter,
+	.write_iter = kerneltalk_write_iter,
+	.splice_read = kt_splice_read,
+	.splice_write = iter_file_splice_write,
 	.open = kerneltalk_open,
-	.flush = kerneltalk_flush,
+	.release = kerneltalk_release,
 	.poll = kerneltalk_poll,
+	.fsync = kerneltalk_fsync,
+	.unlocked_ioctl = kerneltalk_ioctl,
+	.mmap = kerneltalk_mmap,
+	.fasync = kerneltalk_fasync,
+#ifdef KT_HUGE_MAP
+	.get_unmapped_area = thp_get_unmapped_area, // huge page aligned
+#endif
 	.owner = THIS_MODULE};
 
 /*
@@ -88,9 +445,29 @@ static struct file_operations kerneltalk_fops = {
  * server_list_lock MUST already be held at this point
  * MUST check for null return (ENOMEM)
  */
+static void notify_work_fn(struct work_struct *work);
+static void autosize_work_fn(struct work_struct *work);
+static unsigned long autosize_delay(void);
+static void shard_init(struct kerneltalk_shard *, struct kerneltalk_server *);
+static long kerneltalk_set_eventfd(struct kerneltalk_client *, int);
+static struct kerneltalk_ring *ring_alloc(size_t, int, unsigned int);
+static void alloc_replicas(struct kerneltalk_server *);
+static void free_rings(struct kerneltalk_server *);
+
+/*
+ * True if the ring_node parameter names a node we can allocate on.
+ */
+static int node_online_param(void)
+{
+	int node = READ_ONCE(ring_node);
+
+	return node >= 0 && node < nr_node_ids && node_online(node);
+}
+
 static struct kerneltalk_server *create_server(struct inode *inode)
 {
 	struct kerneltalk_server *srv;
+	int i;
 
 	srv = kmalloc(sizeof(struct kerneltalk_server), GFP_KERNEL);
 	// Early return for NULL! Must be checked.
@@ -99,17 +476,100 @@ static struct kerneltalk_server *create_server(struct inode *inode)
 		return NULL;
 	}
 
+	srv->size = roundup_pow_of_two(clamp_t(u32, READ_ONCE(ring_size),
+										   KERNELTALK_BUF, KERNELTALK_MAX_BUF));
+	// not for the benchmark, it wants the size it asked for
+	srv->autosize = inode && READ_ONCE(autosize);
+	srv->size_min = roundup_pow_of_two(clamp_t(u32, READ_ONCE(autosize_min) ?: srv->size,
+											   KERNELTALK_BUF, KERNELTALK_MAX_BUF));
+	srv->size_max = roundup_pow_of_two(clamp_t(u32, READ_ONCE(autosize_max),
+											   KERNELTALK_BUF, KERNELTALK_MAX_BUF));
+	srv->size_min = min_t(u32, srv->size_min, srv->size);
+	srv->size_max = max_t(u32, srv->size_max, srv->size);
+
+	// enough records for the biggest ring the autosizer may pick
+	srv->nr_recs = kt_nr_recs(srv->autosize ? srv->size_max : srv->size);
+	srv->recs = kvcalloc(srv->nr_recs, sizeof(*srv->recs), GFP_KERNEL);
+	if (srv->recs == NULL)
+		goto recs_failed;
+	srv->ctrl_pages = PAGE_ALIGN(struct_size(srv->ctrl, rec_end, srv->nr_recs)) >>
+					  PAGE_SHIFT;
+	srv->ctrl = vmalloc_user(srv->ctrl_pages << PAGE_SHIFT);
+	if (srv->ctrl == NULL)
+		goto ctrl_failed;
+	srv->ctrl->nr_recs = srv->nr_recs;
+	srv->stats = alloc_percpu(struct kerneltalk_stats);
+	if (srv->stats == NULL)
+		goto stats_failed;
+	srv->order = 0;
+	if (READ_ONCE(huge_pages) && srv->size >= PAGE_SIZE << KT_HUGE_ORDER)
+		srv->order = KT_HUGE_ORDER;
+	// the ring starts on a folio boundary in the file, so it can be mapped huge
+	srv->ring_pgoff = ALIGN(srv->ctrl_pages, 1UL << srv->order);
+	srv->ctrl->ring_size = srv->size;
+	srv->ctrl->ring_offset = srv->ring_pgoff << PAGE_SHIFT;
+
+	// until somebody writes, the opener's node is as good a guess as any
+	srv->homed = node_online_param();
+	srv->ring = ring_alloc(srv->size, srv->homed ? ring_node : numa_node_id(),
+						   srv->order);
+	if (srv->ring == NULL)
+		goto ring_failed;
+	srv->replicas = NULL;
+	if (replicate)
+		alloc_replicas(srv);
+	atomic_set(&srv->nr_maps, 0);
+	mutex_init(&srv->map_lock);
+
 	srv->inode = inode;
-	srv->end = 0;
+	srv->head = 0;
+	srv->rec_head = 0;
+	srv->nr_clients = 0;
+	srv->next_shard = 0;
+	srv->heap = NULL;
+	srv->heap_len = 0;
+	srv->heap_size = 0;
 	INIT_LIST_HEAD(&srv->server_list);
 	INIT_LIST_HEAD(&srv->client_list);
 	mutex_init(&srv->client_list_lock);
 	init_rwsem(&srv->buffer_lock);
-	init_waitqueue_head(&srv->rwq);
+	rt_mutex_init(&srv->rt_lock);
+	srv->rt = READ_ONCE(rt_locking);
+	spin_lock_init(&srv->heap_lock);
 	init_waitqueue_head(&srv->wwq);
+	init_waitqueue_head(&srv->swq);
+	for (i = 0; i < KERNELTALK_SHARDS; i++)
+		shard_init(&srv->shards[i], srv);
+
+	srv->peak_used = 0;
+	srv->last_stalls = 0;
+	srv->hot = 0;
+	srv->cold = 0;
+	srv->resizes = 0;
+	srv->spill_max = 0;
+	if (inode && READ_ONCE(spill))
+		srv->spill_max = roundup_pow_of_two(clamp_t(u32, READ_ONCE(spill_max),
+													PAGE_SIZE, KERNELTALK_MAX_BUF));
+	atomic64_set(&srv->spill_unread, 0);
+	INIT_LIST_HEAD(&srv->spill_list);
+	atomic_set(&srv->spill_gen, 0);
+	INIT_DELAYED_WORK(&srv->autosize_work, autosize_work_fn);
+	if (srv->autosize)
+		queue_delayed_work(kerneltalk_wq, &srv->autosize_work, autosize_delay());
+
 	list_add(&srv->server_list, &server_list);
 
 	return srv;
+
+ring_failed:
+	free_percpu(srv->stats);
+stats_failed:
+	vfree(srv->ctrl);
+ctrl_failed:
+	kvfree(srv->recs);
+recs_failed:
+	kfree(srv);
+	return NULL;
 }
 
 /*
@@ -140,328 +600,2861 @@ static struct kerneltalk_server *get_server(struct inode *inode)
  */
 static void check_free_server(struct kerneltalk_server *srv)
 {
+	int empty;
+	int i;
+
 	// for safety, always lock server, then client when you need both
 	mutex_lock_interruptible(&srv->client_list_lock);
-	if (list_empty(&srv->client_list))
-	{
-		// remove us from the server list
-		list_del(&srv->server_list);
-		printk(KERN_INFO "kerneltalk: check_free_server: freeing srv->inode=%p\n", srv->inode);
-		kfree(srv);
-	}
-	else
+	empty = list_empty(&srv->client_list);
+	mutex_unlock(&srv->client_list_lock);
+
+	if (!empty)
 	{
 		printk(KERN_INFO "kerneltalk: check_free_server: not freeing srv->inode=%p\n", srv->inode);
-		// only release the client list lock if there are still clients
-		mutex_unlock(&srv->client_list_lock);
+		return;
 	}
+
+	// remove us from the server list, so nobody can join anymore
+	list_del(&srv->server_list);
+	printk(KERN_INFO "kerneltalk: check_free_server: freeing srv->inode=%p\n", srv->inode);
+
+	// deferred notifications may still be running
+	for (i = 0; i < KERNELTALK_SHARDS; i++)
+		cancel_work_sync(&srv->shards[i].notify_work);
+	if (srv->autosize)
+		cancel_delayed_work_sync(&srv->autosize_work);
+	kvfree(srv->heap);
+	free_rings(srv);
+	free_percpu(srv->stats);
+	vfree(srv->ctrl);
+	kvfree(srv->recs);
+	kfree(srv);
 }
 
 /*
- * Return the offset of the client with the most unread data.
- * client_list_lock must be held for this server, as well as write lock if you
- * want accurate numbers...
+ * Fill a ring with zeroed folios of the given order, or free what it has when
+ * order is -1. Every page of a folio gets its own slot, so vmap() and the
+ * fault handler don't need to care about the order.
  */
-static int blocking_offset(struct kerneltalk_server *srv)
+static int ring_fill(struct kerneltalk_ring *ring, int node, int order)
 {
-	struct kerneltalk_client *cnt;
-	int maxunread = 0;
-	int offset = srv->end;
+	struct folio *folio;
+	unsigned int i, j;
+
+	for (i = 0; i < ring->nr_pages && ring->pages[i]; i += 1U << ring->order)
+		folio_put(page_folio(ring->pages[i]));
+	memset(ring->pages, 0, ring->nr_pages * sizeof(*ring->pages));
+	if (order < 0)
+		return SUCCESS;
 
-	list_for_each_entry(cnt, &srv->client_list, client_list)
+	ring->order = order;
+	for (i = 0; i < ring->nr_pages; i += 1U << order)
 	{
-		if (DIST(cnt->offset, srv->end) > maxunread)
-		{
-			maxunread = DIST(cnt->offset, srv->end);
-			offset = cnt->offset;
-		}
+		// huge folios are a nice-to-have, don't push reclaim for them
+		folio = __folio_alloc_node(GFP_KERNEL | __GFP_ZERO |
+									   (order ? __GFP_NOWARN | __GFP_NORETRY : 0),
+								   order, node);
+		if (folio == NULL)
+			return -ENOMEM;
+		for (j = 0; j < 1U << order; j++)
+			ring->pages[i + j] = folio_page(folio, j);
 	}
-
-	return offset;
+	return SUCCESS;
 }
 
 /*
- * Convenience function for determining how many bytes we have room to write in
- * our buffer. It grabs the client_list lock, finds the offset with the most
- * unread data, and goes ONE BEFORE it (because if end==offset, we expect that
- * there is no data to read). Then it computes the distance from the end of the
- * data to this offset: which is the amount of room we have for writing.
+ * Allocate a zeroed ring of size bytes on a node, from folios of the given
+ * order if possible and from single pages otherwise. The memory may come from
+ * another node if that one is out of it; ring->node is only a hint.
  */
-static int room_to_write(struct kerneltalk_server *srv)
+static struct kerneltalk_ring *ring_alloc(size_t size, int node,
+										  unsigned int order)
 {
-	int maxidx;
+	struct kerneltalk_ring *ring;
 
-	mutex_lock_interruptible(&srv->client_list_lock);
-	maxidx = (blocking_offset(srv) + KERNELTALK_BUF - 1) % KERNELTALK_BUF;
-	mutex_unlock(&srv->client_list_lock);
+	ring = kzalloc_node(sizeof(*ring), GFP_KERNEL, node);
+	if (ring == NULL)
+		return NULL;
+	ring->node = node;
+	ring->nr_pages = PAGE_ALIGN(size) >> PAGE_SHIFT;
+	ring->pages = kvcalloc(ring->nr_pages, sizeof(*ring->pages), GFP_KERNEL);
+	if (ring->pages == NULL)
+		goto fail;
+
+	if ((order == 0 || ring_fill(ring, node, order)) && ring_fill(ring, node, 0))
+		goto fail;
+
+	ring->data = vmap(ring->pages, ring->nr_pages, VM_MAP, PAGE_KERNEL);
+	if (ring->data == NULL)
+		goto fail;
+	return ring;
+
+fail:
+	if (ring->pages)
+		ring_fill(ring, node, -1);
+	kvfree(ring->pages);
+	kfree(ring);
+	return NULL;
+}
 
-	return DIST(srv->end, maxidx);
+static void ring_free(struct kerneltalk_ring *ring)
+{
+	if (ring == NULL)
+		return;
+	vunmap(ring->data);
+	ring_fill(ring, ring->node, -1);
+	kvfree(ring->pages);
+	kfree(ring);
 }
 
 /*
- * Create a new client for a server. Client objects are stored within struct
- * file's private_data field, so there is no need for any special lookup from
- * the client list when you want this client again.
+ * Give every online node other than the ring's own a replica. A node we can't
+ * allocate for just reads from the ring like before.
  */
-static struct kerneltalk_client *create_client(struct file *filp,
-											   struct kerneltalk_server *srv)
+static void alloc_replicas(struct kerneltalk_server *srv)
 {
-	struct kerneltalk_client *cnt;
+	int node;
 
-	cnt = kmalloc(sizeof(struct kerneltalk_client), GFP_KERNEL);
-	if (cnt == NULL)
-		return NULL;
+	srv->replicas = kcalloc(nr_node_ids, sizeof(*srv->replicas), GFP_KERNEL);
+	if (srv->replicas == NULL)
+		return;
 
-	cnt->filp = filp;
-	cnt->server = srv;
-	INIT_LIST_HEAD(&cnt->client_list);
-	cnt->offset = srv->end; // prevent invalid data
-	filp->private_data = cnt;
+	for_each_online_node(node)
+	{
+		if (node != srv->ring->node)
+			srv->replicas[node] = ring_alloc(srv->size, node, srv->order);
+	}
+}
 
-	mutex_lock_interruptible(&srv->client_list_lock);
-	list_add(&cnt->client_list, &srv->client_list);
-	mutex_unlock(&srv->client_list_lock);
+static void free_rings(struct kerneltalk_server *srv)
+{
+	int node;
 
-	return cnt;
+	if (srv->replicas)
+	{
+		for (node = 0; node < nr_node_ids; node++)
+			ring_free(srv->replicas[node]);
+		kfree(srv->replicas);
+	}
+	ring_free(srv->ring);
 }
 
 /*
- * FILE OPERATIONS
+ * The ring readers on this CPU should copy from.
  */
+static struct kerneltalk_ring *local_ring(struct kerneltalk_server *srv)
+{
+	struct kerneltalk_ring *ring = NULL;
+
+	if (srv->replicas)
+		ring = srv->replicas[numa_node_id()];
+	return ring ? ring : srv->ring;
+}
 
 /*
- * Open - will get/create a server, and create a client as well
+ * Move the ring to the first writer's node. This is only done while the ring
+ * is still empty and unmapped, so nothing has to be copied and no mapping can
+ * be left pointing at the old pages. With replicas, the writer's node already
+ * has one and the two simply trade places. buffer_lock must be held for
+ * writing; map_lock keeps the ring unmapped until it is done.
  */
-static int kerneltalk_open(struct inode *inode, struct file *filp)
+static void home_ring(struct kerneltalk_server *srv)
 {
-	struct kerneltalk_server *srv;
-	struct kerneltalk_client *cnt;
-
-	// Obtain server list lock so that everything happens atomically to the
-	// server list.
-	mutex_lock_interruptible(&server_list_lock);
-
-	srv = get_server(inode);
-	if (!srv)
-		goto server_create_failed;
+	int node = numa_node_id();
+	struct kerneltalk_ring *ring;
 
-	cnt = create_client(filp, srv);
-	if (!cnt)
-		goto client_create_failed;
+	srv->homed = 1;
+	if (srv->head != 0 || node == srv->ring->node)
+		return;
 
-	mutex_unlock(&server_list_lock);
+	mutex_lock(&srv->map_lock);
+	if (atomic_read(&srv->nr_maps))
+		goto out;
 
-	printk(KERN_INFO "kerneltalk: open: inode=%p filp=%p opened file!\n",
-		   inode, filp);
-	return SUCCESS;
+	if (srv->replicas && srv->replicas[node])
+	{
+		ring = srv->replicas[node];
+		srv->replicas[node] = NULL;
+		srv->replicas[srv->ring->node] = srv->ring;
+		srv->ring = ring;
+		goto out;
+	}
 
-client_create_failed:
-	// free the server if we were the only ones who wanted it
-	check_free_server(srv);
-server_create_failed:
-	mutex_unlock(&server_list_lock);
-	printk(KERN_INFO "kerneltalk: open: inode=%p filp=%p fail\n", inode, filp);
-	return -ENOMEM;
+	// best effort, the old ring does fine if this fails
+	ring = ring_alloc(srv->size, node, srv->order);
+	if (ring == NULL)
+		goto out;
+	ring_free(srv->ring);
+	srv->ring = ring;
+out:
+	mutex_unlock(&srv->map_lock);
 }
 
 /*
- * Flush - called when a process closes their file descriptor, and so any
- * buffered data of theirs should be flushed. We use this as a notification when
- * close() is called so that we can free the client and optionally the server
- * when it has no more clients.
- *
- * NOTE Due to fork() or dup(), multiple processes and file descriptors can
- * refer to the same struct file!! If any of them are closed, this will be
- * called. Therefore, we check the f_count value to ensure that no more file
- * descriptors are using this file before we free it.
- *
- * NOTE This is just for safety. If two processes/threads have the same file
- * instance and they both read/write, bad things will happen and I'll yell at
- * them. I just would prefer to not make the kernel segfault when one of them
- * closes their copy.
+ * Put a new client into the heap, growing it if needed. The allocation happens
+ * outside the spinlock; client_list_lock must be held so heap_size and
+ * heap_len can't change under us.
  */
-static int kerneltalk_flush(struct file *filp, fl_owner_t unused)
+static int heap_add(struct kerneltalk_server *srv, struct kerneltalk_client *cnt)
 {
-	struct kerneltalk_client *cnt;
-	long count = atomic_long_read(&filp->f_count);
+	struct kt_cursor **heap = NULL;
+	struct kt_cursor **old = NULL;
+	unsigned int size = srv->heap_size;
 
-	if (count != 1)
+	if (srv->heap_len == size)
 	{
-		printk(KERN_INFO "kerneltalk: flush: filp=%p filp->f_count=%ld bailing!\n", filp,
-			   count);
-		return SUCCESS;
+		size = size ? size * 2 : 16;
+		heap = kvmalloc_array(size, sizeof(*heap), GFP_KERNEL);
+		if (heap == NULL)
+			return -ENOMEM;
 	}
 
-	cnt = filp->private_data;
-
-	mutex_lock_interruptible(&cnt->server->client_list_lock);
-	list_del(&cnt->client_list);
-	mutex_unlock(&cnt->server->client_list_lock);
-
-	mutex_lock_interruptible(&server_list_lock);
-	check_free_server(cnt->server);
-	mutex_unlock(&server_list_lock);
-
-	kfree(cnt);
+	spin_lock(&srv->heap_lock);
+	if (heap)
+	{
+		memcpy(heap, srv->heap, srv->heap_len * sizeof(*heap));
+		old = srv->heap;
+		srv->heap = heap;
+		srv->heap_size = size;
+	}
+	kt_heap_add(srv->heap, &srv->heap_len, &cnt->cur);
+	spin_unlock(&srv->heap_lock);
 
-	printk(KERN_INFO "kerneltalk: flush: filp=%p freed client\n", filp);
+	kvfree(old);
 	return SUCCESS;
 }
 
+static void heap_remove(struct kerneltalk_server *srv,
+						struct kerneltalk_client *cnt)
+{
+	spin_lock(&srv->heap_lock);
+	kt_heap_remove(srv->heap, &srv->heap_len, &cnt->cur);
+	spin_unlock(&srv->heap_lock);
+}
+
 /*
- * Read - read from the server. This has blocking and non-blocking variations.
+ * buffer_lock, or the rt_mutex on real-time channels.
  */
-static ssize_t kerneltalk_read(struct file *filp, char *usrbuf, size_t length,
-							   loff_t *offset)
+static void buffer_down_read(struct kerneltalk_server *srv)
 {
-	struct kerneltalk_server *srv;
-	struct kerneltalk_client *cnt;
-	int bytes_read = 0;
-
-	printk(KERN_INFO "kerneltalk: read: filp=%p WAIT FOR DATA\n", filp);
-
-	cnt = filp->private_data;
-	srv = cnt->server;
-
-	// acquire buffer read lock to ensure amount of data doesn't change
-	down_read(&srv->buffer_lock);
-
-	// wait till we have data
-	while (DIST(cnt->offset, srv->end) == 0)
-	{
-		up_read(&srv->buffer_lock);
-		if (filp->f_flags & O_NONBLOCK)
-			return -EAGAIN;
-		if (wait_event_interruptible(srv->rwq, DIST(cnt->offset, srv->end) != 0))
-			return -ERESTARTSYS;
+	if (srv->rt)
+		rt_mutex_lock(&srv->rt_lock);
+	else
 		down_read(&srv->buffer_lock);
-	}
-
-	printk(KERN_INFO "kerneltalk: read: filp=%p READING length=%zu srv->end=%d cnt->offset=%d\n",
-		   filp, length, srv->end, cnt->offset);
-
-	while (length && DIST(cnt->offset, srv->end) > 0)
-	{
-		put_user(srv->buffer[cnt->offset], usrbuf++);
-		length--;
-		cnt->offset = (cnt->offset + 1) % KERNELTALK_BUF;
-		bytes_read++;
-	}
+}
 
-	up_read(&srv->buffer_lock);
+static void buffer_up_read(struct kerneltalk_server *srv)
+{
+	if (srv->rt)
+		rt_mutex_unlock(&srv->rt_lock);
+	else
+		up_read(&srv->buffer_lock);
+}
 
-	printk(KERN_INFO "kerneltalk: read: filp=%p READ %d, length=%zu srv->end=%d cnt->offset=%d\n",
-		   filp, bytes_read, length, srv->end, cnt->offset);
+static void buffer_down_write(struct kerneltalk_server *srv)
+{
+	if (srv->rt)
+		rt_mutex_lock(&srv->rt_lock);
+	else
+		down_write(&srv->buffer_lock);
+}
 
-	wake_up(&srv->wwq); // there may be more room now that we've read
-	return bytes_read;
+static void buffer_up_write(struct kerneltalk_server *srv)
+{
+	if (srv->rt)
+		rt_mutex_unlock(&srv->rt_lock);
+	else
+		up_write(&srv->buffer_lock);
 }
 
 /*
- * Return information about whether the file is ready to read or write.
- * Additionally register our wait queues with the poll table so that the select
- * and poll system calls can wake when the state changes.
+ * Let readers in again while we keep writers out. The rt_mutex stays
+ * exclusive.
  */
-static unsigned int kerneltalk_poll(struct file *filp, poll_table *tbl)
+static void buffer_downgrade(struct kerneltalk_server *srv)
 {
-	struct kerneltalk_client *cnt;
-	struct kerneltalk_server *srv;
-	int mask = 0;
-
-	cnt = filp->private_data;
-	srv = cnt->server;
+	if (!srv->rt)
+		downgrade_write(&srv->buffer_lock);
+}
 
-	printk(KERN_INFO "kerneltalk: poll filp=%p\n", filp);
+/*
+ * The lock a client reads under. On channels that spill, its read_mutex comes
+ * first, so that a writer spilling the client can copy its backlog with just
+ * buffer_lock for reading: see spill_laggards().
+ */
+static void client_down_read(struct kerneltalk_client *cnt)
+{
+	if (cnt->server->spill_max)
+		mutex_lock(&cnt->read_mutex);
+	buffer_down_read(cnt->server);
+}
 
-	poll_wait(filp, &srv->rwq, tbl);
-	poll_wait(filp, &srv->wwq, tbl);
+static void client_up_read(struct kerneltalk_client *cnt)
+{
+	buffer_up_read(cnt->server);
+	if (cnt->server->spill_max)
+		mutex_unlock(&cnt->read_mutex);
+}
 
-	/*
-	 * We need the write lock here so that we can be certain no readers are
-	 * reading, and thus updating their offsets while we check them.
-	 */
-	down_write(&srv->buffer_lock);
+/*
+ * The same locks for a caller that may not sleep for them: under
+ * NONBLOCK_NOWAIT these only try, and fail with -EAGAIN if they are taken.
+ */
+static int client_lock_read(struct kerneltalk_client *cnt, int nonblock)
+{
+	struct kerneltalk_server *srv = cnt->server;
 
-	mask = 0;
-	if (DIST(cnt->offset, srv->end) > 0)
+	if (nonblock != NONBLOCK_NOWAIT)
 	{
-		mask |= POLLIN | POLLRDNORM;
+		client_down_read(cnt);
+		return SUCCESS;
 	}
+	if (srv->spill_max && !mutex_trylock(&cnt->read_mutex))
+		return -EAGAIN;
+	if (srv->rt ? rt_mutex_trylock(&srv->rt_lock)
+				: down_read_trylock(&srv->buffer_lock))
+		return SUCCESS;
+	if (srv->spill_max)
+		mutex_unlock(&cnt->read_mutex);
+	return -EAGAIN;
+}
 
-	if (room_to_write(srv) > 0)
+static int buffer_lock_write(struct kerneltalk_server *srv, int nonblock)
+{
+	if (nonblock != NONBLOCK_NOWAIT)
 	{
-		mask |= POLLOUT | POLLWRNORM;
+		buffer_down_write(srv);
+		return SUCCESS;
 	}
+	if (srv->rt ? rt_mutex_trylock(&srv->rt_lock)
+				: down_write_trylock(&srv->buffer_lock))
+		return SUCCESS;
+	return -EAGAIN;
+}
 
-	up_write(&srv->buffer_lock);
-	return mask;
+static int stage_lock(struct kerneltalk_client *cnt, int nonblock)
+{
+	if (nonblock == NONBLOCK_NOWAIT)
+		return mutex_trylock(&cnt->stage.lock) ? SUCCESS : -EAGAIN;
+	if (mutex_lock_interruptible(&cnt->stage.lock))
+		return -ERESTARTSYS;
+	return SUCCESS;
 }
 
 /*
- * Write - Put user data into the buffer. Supports blocking and non-blocking
- * variations. Requires mutual exclusion from all readers and writers for
- * safety.
+ * Convenience function for determining how many bytes we have room to write in
+ * our buffer. The client with the most unread data sits at the top of the
+ * heap. Everything between its position and the head is still needed by
+ * somebody, the rest of the buffer is ours to write. Each of recs new records
+ * also needs a free descriptor; a write() asks for none, see commit().
  */
-ssize_t kerneltalk_write(struct file *filp, const char *usrbuf, size_t amt,
-						 loff_t *unused)
+static int room_to_write(struct kerneltalk_server *srv, u32 recs)
+{
+	u64 head = READ_ONCE(srv->head);
+	u64 rec_head = READ_ONCE(srv->rec_head);
+	struct kt_cursor *tail;
+	int room;
+
+	spin_lock(&srv->heap_lock);
+	tail = srv->heap_len ? srv->heap[0] : NULL;
+	if (recs && kt_recs_full(srv->nr_recs, rec_head + recs - 1, tail))
+		room = 0;
+	else
+		room = kt_room_bytes(srv->size, head, tail);
+	spin_unlock(&srv->heap_lock);
+
+	return room;
+}
+
+/*
+ * Whether every record descriptor is still needed by the slowest reader.
+ */
+static int recs_full(struct kerneltalk_server *srv)
+{
+	int full;
+
+	spin_lock(&srv->heap_lock);
+	full = kt_recs_full(srv->nr_recs, srv->rec_head,
+						srv->heap_len ? srv->heap[0] : NULL);
+	spin_unlock(&srv->heap_lock);
+
+	return full;
+}
+
+/*
+ * The copy helpers take iterators, so that read() and write() work with any
+ * kind of buffer: readv()/writev() vectors, and kernel memory for the
+ * benchmark. This wraps a single user buffer for the ioctls; iov must live as
+ * long as the iterator on old kernels.
+ */
+static void user_iter(struct iov_iter *iter, struct iovec *iov,
+					  unsigned int dir, void __user *buf, size_t len)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	iov_iter_ubuf(iter, dir, buf, len);
+#else
+	iov->iov_base = buf;
+	iov->iov_len = len;
+	iov_iter_init(iter, dir, iov, 1, len);
+#endif
+}
+
+/*
+ * Copy len bytes out of the buffer starting at position pos, taking care of
+ * wrap-around. The caller must make sure the bytes are there.
+ */
+static int copy_out(struct kerneltalk_server *srv, struct iov_iter *to,
+					u64 pos, size_t len)
+{
+	char *buffer = local_ring(srv)->data;
+	size_t first = kt_first(srv->size, pos, len);
+
+	if (copy_to_iter(buffer + IDX(srv, pos), first, to) != first)
+		return -EFAULT;
+	if (copy_to_iter(buffer, len - first, to) != len - first)
+		return -EFAULT;
+	return SUCCESS;
+}
+
+static int copy_out_user(struct kerneltalk_server *srv, void __user *usrbuf,
+						 u64 pos, size_t len)
+{
+	struct iov_iter iter;
+	struct iovec iov;
+
+	user_iter(&iter, &iov, ITER_DEST, usrbuf, len);
+	return copy_out(srv, &iter, pos, len);
+}
+
+/*
+ * Copy len bytes from user space into the buffer at the head. They don't
+ * become visible to readers until commit(). The caller must make sure there is
+ * room.
+ */
+static int copy_in(struct kerneltalk_server *srv, struct iov_iter *from,
+				   size_t len)
+{
+	char *buffer;
+	size_t first = kt_first(srv->size, srv->head, len);
+
+	if (!srv->homed)
+		home_ring(srv);
+	buffer = srv->ring->data;
+
+	if (copy_from_iter(buffer + IDX(srv, srv->head), first, from) != first)
+		return -EFAULT;
+	if (copy_from_iter(buffer, len - first, from) != len - first)
+		return -EFAULT;
+	return SUCCESS;
+}
+
+static int copy_in_user(struct kerneltalk_server *srv, void __user *usrbuf,
+						size_t len)
+{
+	struct iov_iter iter;
+	struct iovec iov;
+
+	user_iter(&iter, &iov, ITER_SOURCE, usrbuf, len);
+	return copy_in(srv, &iter, len);
+}
+
+/*
+ * Bring the replicas up to date with len bytes at the head of the ring.
+ */
+static void replicate_head(struct kerneltalk_server *srv, size_t len)
+{
+	char *buffer = srv->ring->data;
+	size_t idx = IDX(srv, srv->head);
+	size_t first = kt_first(srv->size, srv->head, len);
+	struct kerneltalk_ring *replica;
+	int node;
+
+	for (node = 0; node < nr_node_ids; node++)
+	{
+		replica = srv->replicas[node];
+		if (replica == NULL)
+			continue;
+		memcpy(replica->data + idx, buffer + idx, first);
+		memcpy(replica->data, buffer, len - first);
+	}
+}
+
+/*
+ * Make everything committed so far visible to readers of the mapped ring;
+ * read() and the ioctls see it as soon as we let go of buffer_lock. It must
+ * be held for writing; the caller kicks the readers once it has let go of it.
+ */
+static void publish(struct kerneltalk_server *srv)
+{
+	// the data and the new head must be visible before the doorbell rings
+	smp_wmb();
+	WRITE_ONCE(srv->ctrl->head, srv->head);
+	WRITE_ONCE(srv->ctrl->rec_head, srv->rec_head);
+	smp_wmb();
+	WRITE_ONCE(srv->ctrl->seq, srv->ctrl->seq + 1);
+}
+
+/*
+ * Commit len bytes that copy_in() put at the head as a new record from pid.
+ * Readers of the mapped ring see it at the next publish().
+ *
+ * A write() (stream) that finds every record descriptor in use doesn't wait
+ * for one: its bytes extend the newest record, which keeps that record's pid
+ * and stamp. Readers that had read all of it are moved back into it.
+ * buffer_lock must be held for writing.
+ */
+static void commit(struct kerneltalk_client *cnt, u32 len, int stream, pid_t pid)
+{
+	struct kerneltalk_server *srv = cnt->server;
+	struct kt_rec *rec;
+
+	if (srv->replicas)
+		replicate_head(srv, len);
+
+	if (stream && recs_full(srv))
+	{
+		rec = REC(srv, srv->rec_head - 1);
+		rec->len += len;
+		spin_lock(&srv->heap_lock);
+		kt_cursors_rewind(srv->heap, srv->heap_len, srv->rec_head);
+		spin_unlock(&srv->heap_lock);
+	}
+	else
+	{
+		rec = REC(srv, srv->rec_head);
+		rec->pos = srv->head;
+		rec->len = len;
+		rec->pid = pid;
+		rec->stamp = ktime_get_ns();
+		srv->rec_head++;
+		this_cpu_inc(srv->stats->msgs);
+	}
+	srv->head += len;
+	cnt->last_write = srv->head;
+	srv->ctrl->rec_end[(srv->rec_head - 1) & (srv->nr_recs - 1)] = srv->head;
+	this_cpu_add(srv->stats->bytes, len);
+}
+
+static u32 default_cork_ms(void)
+{
+	return min_t(u32, READ_ONCE(cork_ms), KERNELTALK_CORK_MAX_MS);
+}
+
+static void shard_init(struct kerneltalk_shard *shard,
+					   struct kerneltalk_server *srv)
+{
+	shard->server = srv;
+	init_waitqueue_head(&shard->rwq);
+	mutex_init(&shard->notify_lock);
+	INIT_LIST_HEAD(&shard->notify_list);
+	INIT_WORK(&shard->notify_work, notify_work_fn);
+}
+
+/*
+ * Bytes a client has yet to read: in the ring up to head, and in its spill.
+ */
+static u64 unread_bytes(struct kerneltalk_client *cnt, u64 head)
+{
+	return head - READ_ONCE(cnt->cur.pos) + READ_ONCE(cnt->spill.bytes);
+}
+
+/*
+ * True if a client has nothing to read. buffer_lock must be held, or this is
+ * a wait condition.
+ */
+static int nothing_to_read(struct kerneltalk_client *cnt)
+{
+	return READ_ONCE(cnt->cur.pos) == READ_ONCE(cnt->server->head) &&
+		   READ_ONCE(cnt->spill.bytes) == 0;
+}
+
+/*
+ * Notify a client if its unread count reached its low-water mark: signal the
+ * eventfd and send SIGIO. The mark is re-armed in advance() once the client
+ * reads below it. The shard's notify_lock must be held.
+ */
+static void notify_client(struct kerneltalk_client *cnt, u64 head)
+{
+	if (!READ_ONCE(cnt->armed) || unread_bytes(cnt, head) < cnt->lowat)
+		return;
+	WRITE_ONCE(cnt->armed, 0);
+	if (cnt->evfd)
+		kt_eventfd_signal(cnt->evfd);
+	kill_fasync(&cnt->fasync, SIGIO, POLL_IN);
+}
+
+/*
+ * Tell a shard there is new data: wake the sleepers and notify the clients
+ * that asked for it.
+ */
+static void notify_shard(struct kerneltalk_shard *shard)
+{
+	struct kerneltalk_client *cnt;
+	u64 head = READ_ONCE(shard->server->head);
+
+	wake_up(&shard->rwq);
+
+	mutex_lock(&shard->notify_lock);
+	list_for_each_entry(cnt, &shard->notify_list, notify_list)
+		notify_client(cnt, head);
+	mutex_unlock(&shard->notify_lock);
+}
+
+static void notify_work_fn(struct work_struct *work)
+{
+	notify_shard(container_of(work, struct kerneltalk_shard, notify_work));
+}
+
+/*
+ * Called by writers after committing. Small channels, and real-time ones, are
+ * notified right away. Otherwise every shard gets its notification queued;
+ * queue_work() does nothing if one is already pending, so a burst of writes
+ * costs a single fan-out. A writer that may not sleep (nowait) always queues,
+ * notify_shard() takes a mutex.
+ */
+static void kick_readers(struct kerneltalk_server *srv, int nowait)
+{
+	int deferred = nowait ||
+				   (!srv->rt && READ_ONCE(srv->nr_clients) > inline_wakeups);
+	int i;
+
+	this_cpu_inc(srv->stats->wakeups);
+	for (i = 0; i < KERNELTALK_SHARDS; i++)
+	{
+		if (deferred)
+			queue_work(kerneltalk_wq, &srv->shards[i].notify_work);
+		else
+			notify_shard(&srv->shards[i]);
+	}
+}
+
+/*
+ * Move a client's read position forward by len bytes, keeping its record
+ * number in step. Records are contiguous, so a binary search over the ones
+ * still unread finds the new record no matter how far we jump.
+ *
+ * Writers are only woken if we were the slowest reader, since nobody else can
+ * make room for them. buffer_lock must be held (reading is enough).
+ */
+static void advance(struct kerneltalk_client *cnt, u64 len)
+{
+	struct kerneltalk_server *srv = cnt->server;
+	u64 pos = cnt->cur.pos + len;
+	u64 old = cnt->cur.rec;
+	u64 rec, tail, lat;
+
+	rec = kt_rec_find(srv->recs, srv->nr_recs, cnt->cur.rec, srv->rec_head, pos);
+
+	spin_lock(&srv->heap_lock);
+	tail = kt_cursor_move(srv->heap, srv->heap_len, &cnt->cur, pos, rec);
+	spin_unlock(&srv->heap_lock);
+
+	this_cpu_add(srv->stats->read_bytes, len);
+	if (rec != old)
+	{
+		// one latency sample per call, of the newest record we finished
+		this_cpu_add(srv->stats->reads, rec - old);
+		lat = ktime_get_ns() - REC(srv, rec - 1)->stamp;
+		this_cpu_inc(srv->stats->lat[min_t(int, fls64(lat), KERNELTALK_LAT_BUCKETS - 1)]);
+	}
+
+	if (unread_bytes(cnt, srv->head) < cnt->lowat)
+		WRITE_ONCE(cnt->armed, 1);
+
+	if (tail)
+		wake_up(&srv->wwq); // there is more room now that we've read
+	if (wq_has_sleeper(&srv->swq))
+		wake_up(&srv->swq);
+}
+
+/*
+ * Spilling. When writers run out of room, the client at the tail may get its
+ * backlog moved out of the ring into its spill, an unlinked tmpfs file used as
+ * a ring of struct kt_spill_rec and data. Its cursor in the heap then jumps to
+ * where the spilled data ended, so writers go on at the pace of the other
+ * readers, while the client reads its spill before the ring, in order. The
+ * file's pages are given back whenever the spill drains. A client that mapped
+ * the ring reads it directly and never spills.
+ */
+
+/*
+ * Copy len bytes between a kernel buffer and the spill at pos, wrapping
+ * around the end of the file.
+ */
+static int spill_io(struct kerneltalk_spill *sp, u64 pos, void *buf, size_t len,
+					int write)
+{
+	size_t first = kt_first(sp->size, pos, len);
+	loff_t off = kt_idx(sp->size, pos);
+	ssize_t n;
+
+	n = write ? kernel_write(sp->file, buf, first, &off)
+			  : kernel_read(sp->file, buf, first, &off);
+	if (n != first)
+		return -EIO;
+	if (first == len)
+		return SUCCESS;
+	off = 0;
+	n = write ? kernel_write(sp->file, buf + first, len - first, &off)
+			  : kernel_read(sp->file, buf + first, len - first, &off);
+	return n == len - first ? SUCCESS : -EIO;
+}
+
+static int spill_iter(struct kerneltalk_spill *sp, loff_t off,
+					  struct iov_iter *to, size_t len)
+{
+	size_t count = iov_iter_count(to);
+	ssize_t n;
+
+	iov_iter_truncate(to, len);
+	n = vfs_iter_read(sp->file, to, &off, 0);
+	iov_iter_reexpand(to, count - max_t(ssize_t, n, 0));
+	return n == len ? SUCCESS : -EFAULT;
+}
+
+/*
+ * Load the header of the record the client is reading. It must have one.
+ */
+static int spill_load(struct kerneltalk_spill *sp)
+{
+	if (sp->loaded)
+		return SUCCESS;
+	if (spill_io(sp, sp->rd, &sp->cur, sizeof(sp->cur), 0))
+		return -EIO;
+	sp->loaded = 1;
+	return SUCCESS;
+}
+
+/*
+ * Copy len bytes of the current record, from where the client is, out of the
+ * spill. spill_load() must have been called.
+ */
+static int spill_copy_out(struct kerneltalk_spill *sp, struct iov_iter *to,
+						  size_t len)
+{
+	u64 pos = sp->rd + sizeof(sp->cur) + sp->off;
+	size_t first = kt_first(sp->size, pos, len);
+
+	if (spill_iter(sp, kt_idx(sp->size, pos), to, first))
+		return -EFAULT;
+	return spill_iter(sp, 0, to, len - first);
+}
+
+/*
+ * Move the client past len bytes of its current record, and past the record
+ * when that was the rest of it. Like advance(), for the spill.
+ */
+static void spill_consume(struct kerneltalk_client *cnt, u32 len)
+{
+	struct kerneltalk_server *srv = cnt->server;
+	struct kerneltalk_spill *sp = &cnt->spill;
+	u64 lat;
+
+	sp->off += len;
+	WRITE_ONCE(sp->bytes, sp->bytes - len);
+	atomic64_sub(len, &srv->spill_unread);
+	this_cpu_add(srv->stats->read_bytes, len);
+
+	if (sp->off == sp->cur.len)
+	{
+		this_cpu_inc(srv->stats->reads);
+		lat = ktime_get_ns() - sp->cur.stamp;
+		this_cpu_inc(srv->stats->lat[min_t(int, fls64(lat), KERNELTALK_LAT_BUCKETS - 1)]);
+		sp->rd += sizeof(sp->cur) + round_up(sp->cur.len, 8);
+		sp->recs--;
+		sp->off = 0;
+		sp->loaded = 0;
+
+		// a writer may be waiting to spill more, a barrier for this record
+		atomic_inc(&srv->spill_gen);
+		if (wq_has_sleeper(&srv->wwq))
+			wake_up(&srv->wwq);
+		if (wq_has_sleeper(&srv->swq))
+			wake_up(&srv->swq);
+	}
+
+	if (sp->recs == 0)
+	{
+		spin_lock(&srv->heap_lock);
+		list_del_init(&cnt->spill_list);
+		spin_unlock(&srv->heap_lock);
+		vfs_fallocate(sp->file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, sp->size);
+		sp->rd = 0;
+		sp->wr = 0;
+	}
+
+	if (unread_bytes(cnt, srv->head) < cnt->lowat)
+		WRITE_ONCE(cnt->armed, 1);
+}
+
+/*
+ * Read up to len bytes from the spill, across records like read() does in the
+ * ring. Returns the bytes read.
+ */
+static ssize_t spill_read(struct kerneltalk_client *cnt, struct iov_iter *to,
+						  size_t len)
+{
+	struct kerneltalk_spill *sp = &cnt->spill;
+	ssize_t done = 0;
+	u32 n;
+
+	while (done < len && sp->recs)
+	{
+		if (spill_load(sp) < 0)
+			return done ? done : -EIO;
+		n = min_t(size_t, len - done, sp->cur.len - sp->off);
+		if (spill_copy_out(sp, to, n))
+			return done ? done : -EFAULT;
+		spill_consume(cnt, n);
+		done += n;
+	}
+	return done;
+}
+
+/*
+ * Drop up to count bytes, or records, from the spill. Returns how many.
+ */
+static u64 spill_skip(struct kerneltalk_client *cnt, u64 count, int records)
+{
+	struct kerneltalk_spill *sp = &cnt->spill;
+	u64 done = 0;
+	u32 n;
+
+	while (done < count && sp->recs)
+	{
+		if (spill_load(sp) < 0)
+			break;
+		n = sp->cur.len - sp->off;
+		if (!records)
+			n = min_t(u64, n, count - done);
+		spill_consume(cnt, n);
+		done += records ? 1 : n;
+	}
+	return done;
+}
+
+/*
+ * Give a new client of a channel that spills its spill file, in the client's
+ * own context. A client without one never spills.
+ */
+static void spill_open(struct kerneltalk_server *srv, struct kerneltalk_client *cnt)
+{
+	struct kerneltalk_spill *sp = &cnt->spill;
+
+	sp->file = shmem_file_setup("kerneltalk-spill", srv->spill_max, VM_NORESERVE);
+	if (IS_ERR(sp->file))
+	{
+		sp->file = NULL;
+		return;
+	}
+	sp->size = srv->spill_max;
+	cnt->memcg = get_mem_cgroup_from_mm(current->mm);
+}
+
+/*
+ * Drop a client's spill, with whatever is still in it.
+ */
+static void spill_close(struct kerneltalk_server *srv, struct kerneltalk_client *cnt)
+{
+	if (cnt->spill.file == NULL)
+		return;
+	spin_lock(&srv->heap_lock);
+	list_del(&cnt->spill_list);
+	spin_unlock(&srv->heap_lock);
+	atomic64_sub(cnt->spill.bytes, &srv->spill_unread);
+	fput(cnt->spill.file);
+	mem_cgroup_put(cnt->memcg);
+}
+
+/*
+ * Move a client's backlog in the ring to its spill, whole records from its
+ * position up to the head, as far as they fit. Returns true if anything
+ * moved. buffer_lock must be held, for reading at least, with writers kept
+ * out, and the client's read_mutex too, so nobody moves the backlog. The
+ * spill's pages are charged to the client.
+ */
+static int spill_client(struct kerneltalk_server *srv, struct kerneltalk_client *cnt)
+{
+	struct kerneltalk_spill *sp = &cnt->spill;
+	struct kt_spill_rec hdr = {};
+	struct mem_cgroup *old;
+	u64 pos = cnt->cur.pos;
+	u64 rec = cnt->cur.rec;
+	u64 moved = 0;
+	size_t need, first;
+
+	old = kt_set_active_memcg(cnt->memcg);
+	for (; rec < srv->rec_head; rec++)
+	{
+		hdr.seq = rec;
+		hdr.stamp = REC(srv, rec)->stamp;
+		hdr.pid = REC(srv, rec)->pid;
+		hdr.len = REC_END(srv, rec) - pos;
+		hdr.flags = pos != REC(srv, rec)->pos ? KERNELTALK_MSG_PARTIAL : 0;
+		need = sizeof(hdr) + round_up(hdr.len, 8);
+		if (sp->wr + need - sp->rd > sp->size)
+			break;
+
+		first = kt_first(srv->size, pos, hdr.len);
+		if (spill_io(sp, sp->wr, &hdr, sizeof(hdr), 1) ||
+			spill_io(sp, sp->wr + sizeof(hdr), srv->ring->data + IDX(srv, pos), first, 1) ||
+			spill_io(sp, sp->wr + sizeof(hdr) + first, srv->ring->data, hdr.len - first, 1))
+			break;
+		sp->wr += need;
+		sp->recs++;
+		moved += hdr.len;
+		pos += hdr.len;
+	}
+	kt_set_active_memcg(old);
+	if (moved == 0)
+		return 0;
+
+	WRITE_ONCE(sp->bytes, sp->bytes + moved);
+	atomic64_add(moved, &srv->spill_unread);
+	this_cpu_add(srv->stats->spilled, moved);
+	spin_lock(&srv->heap_lock);
+	kt_cursor_move(srv->heap, srv->heap_len, &cnt->cur, pos, rec);
+	if (list_empty(&cnt->spill_list))
+		list_add(&cnt->spill_list, &srv->spill_list);
+	spin_unlock(&srv->heap_lock);
+	return 1;
+}
+
+/*
+ * Spill the clients at the tail until len bytes fit, or one can't spill.
+ * Returns true if the ring has the room now, see room_to_write() for recs.
+ * buffer_lock must be held for writing.
+ *
+ * The copy only needs writers kept out, so buffer_lock is downgraded for it
+ * and the other clients go on reading; the laggard's read_mutex keeps it from
+ * reading what is being moved. A laggard that holds its read_mutex is reading
+ * already and makes room by itself. Writers may get in before the lock is
+ * taken for writing again, so the room is checked anew.
+ */
+static int spill_laggards(struct kerneltalk_server *srv, int len, u32 recs)
+{
+	struct kerneltalk_client *cnt;
+	int spilled;
+
+	while (room_to_write(srv, recs) < len)
+	{
+		spin_lock(&srv->heap_lock);
+		cnt = container_of(srv->heap[0], struct kerneltalk_client, cur);
+		spin_unlock(&srv->heap_lock);
+		// the benchmark's clients have no spill and read the ring only
+		if (cnt->spill.file == NULL || !mutex_trylock(&cnt->read_mutex))
+			return 0;
+		// a client that maps the ring meanwhile must find nothing spilled
+		mutex_lock(&srv->map_lock);
+		if (cnt->mapped)
+		{
+			mutex_unlock(&srv->map_lock);
+			mutex_unlock(&cnt->read_mutex);
+			return 0;
+		}
+		buffer_downgrade(srv);
+		spilled = spill_client(srv, cnt);
+		mutex_unlock(&srv->map_lock);
+		mutex_unlock(&cnt->read_mutex);
+		buffer_up_read(srv);
+		buffer_down_write(srv);
+		if (!spilled)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Sleep until len bytes fit in the ring, or fail with -EAGAIN when we must not
+ * sleep. Either way it counts as a stall. A laggard making room in its spill
+ * ends the wait too, so the caller can try spilling it again. buffer_lock must
+ * not be held.
+ */
+static int wait_for_room(struct kerneltalk_server *srv, int len, u32 recs,
+						 int nonblock)
+{
+	int gen = atomic_read(&srv->spill_gen);
+	u64 start;
+	int rv;
+
+	this_cpu_inc(srv->stats->stalls);
+	if (nonblock)
+		return -EAGAIN;
+	start = ktime_get_ns();
+	rv = wait_event_interruptible(srv->wwq, room_to_write(srv, recs) >= len ||
+												atomic_read(&srv->spill_gen) != gen);
+	this_cpu_add(srv->stats->stall_ns, ktime_get_ns() - start);
+	return rv ? -ERESTARTSYS : SUCCESS;
+}
+
+/*
+ * Remember how full a write left the ring, for the autosizer. buffer_lock must
+ * be held for writing.
+ */
+static void note_used(struct kerneltalk_server *srv, u32 used)
+{
+	if (used > srv->peak_used)
+		WRITE_ONCE(srv->peak_used, used);
+}
+
+/*
+ * Let go of buffer_lock after writing, and wake the readers if the head moved
+ * past where it was when we took it.
+ */
+static void write_done(struct kerneltalk_server *srv, u64 head, int nonblock)
+{
+	int published = srv->head != head;
+
+	buffer_up_write(srv);
+	if (published)
+		kick_readers(srv, nonblock == NONBLOCK_NOWAIT);
+}
+
+/*
+ * Wait until len bytes in recs new records fit, spilling laggards first if the
+ * channel has spills and we may sleep. buffer_lock must be held for writing,
+ * with the head at *head when it was taken; it is let go of while we sleep,
+ * and isn't held when this fails. Returns the room.
+ */
+static int make_room(struct kerneltalk_server *srv, int len, u32 recs,
+					 int nonblock, u64 *head)
+{
+	int room;
+	int rv;
+
+	while ((room = room_to_write(srv, recs)) < len)
+	{
+		// spilling writes to a file
+		if (srv->spill_max && nonblock != NONBLOCK_NOWAIT &&
+			spill_laggards(srv, len, recs))
+			continue;
+		write_done(srv, *head, nonblock);
+		rv = wait_for_room(srv, len, recs, nonblock);
+		if (rv)
+			return rv;
+		buffer_down_write(srv);
+		*head = srv->head;
+	}
+	return room;
+}
+
+/*
+ * Staging. A client that is corked, or in the middle of a KERNELTALK_MSG_MORE
+ * sequence, sends into its own stage instead of the ring. Nobody else waits
+ * for it: flush_stage() commits the whole stage at once, with one wakeup, at
+ * uncork, at the end of the MORE sequence, at SYNC and fsync(), when the stage
+ * fills up, and from stage_work_fn() once cork_ms have passed since the first
+ * staged message. The stage lock is taken before buffer_lock.
+ */
+
+/*
+ * How much a client may stage: no more than the smallest ring the channel may
+ * have, so a flush always fits, and no more than STAGE_MAX.
+ */
+static u32 stage_size(struct kerneltalk_server *srv)
+{
+	return min_t(u32, srv->autosize ? srv->size_min : srv->size, STAGE_MAX);
+}
+
+/*
+ * Give a client its stage. This is the client's own memory, allocated in its
+ * own context without buffer_lock. The stage lock must be held.
+ */
+static int stage_alloc(struct kerneltalk_client *cnt)
+{
+	struct kerneltalk_stage *st = &cnt->stage;
+
+	st->size = stage_size(cnt->server);
+	st->buf = kvmalloc(st->size, GFP_KERNEL);
+	return st->buf ? SUCCESS : -ENOMEM;
+}
+
+/*
+ * Data bytes the next staged message may have. Every message needs a record
+ * descriptor of its own at the flush.
+ */
+static u32 stage_room(struct kerneltalk_client *cnt)
+{
+	struct kerneltalk_stage *st = &cnt->stage;
+	u32 free = st->size - st->used;
+
+	if (st->recs >= cnt->server->nr_recs || free <= sizeof(struct kt_stage_rec))
+		return 0;
+	return free - sizeof(struct kt_stage_rec);
+}
+
+/*
+ * Commit everything staged, once there is room for all of it. A flush that
+ * fails leaves the stage as it was; if it was due, stage_work_fn() tries again
+ * shortly. The stage lock must be held.
+ */
+static int flush_stage(struct kerneltalk_client *cnt, int nonblock)
+{
+	struct kerneltalk_stage *st = &cnt->stage;
+	struct kerneltalk_server *srv = cnt->server;
+	struct kt_stage_rec *hdr;
+	struct iov_iter iter;
+	struct kvec kv;
+	u32 off;
+	u64 head;
+	int room;
+
+	if (st->recs == 0)
+		return SUCCESS;
+
+	room = buffer_lock_write(srv, nonblock);
+	if (room == SUCCESS)
+	{
+		head = srv->head;
+		room = make_room(srv, st->bytes, st->recs, nonblock, &head);
+	}
+	if (room < 0)
+	{
+		if (!st->corked)
+			mod_delayed_work(kerneltalk_wq, &st->work,
+							 msecs_to_jiffies(STAGE_RETRY_MS));
+		return room;
+	}
+
+	for (off = 0; off < st->used; off += sizeof(*hdr) + round_up(hdr->len, 8))
+	{
+		hdr = (struct kt_stage_rec *)(st->buf + off);
+		kv.iov_base = hdr + 1;
+		kv.iov_len = hdr->len;
+		iov_iter_kvec(&iter, ITER_SOURCE, &kv, 1, hdr->len);
+		// kernel memory, this can't fault
+		copy_in(srv, &iter, hdr->len);
+		commit(cnt, hdr->len, 0, hdr->pid);
+	}
+	publish(srv);
+	note_used(srv, srv->size - room + st->bytes);
+	write_done(srv, head, nonblock);
+
+	st->used = 0;
+	st->bytes = 0;
+	st->recs = 0;
+	cancel_delayed_work(&st->work);
+	return SUCCESS;
+}
+
+/*
+ * Copy a message of len bytes into the stage, flushing it first if they don't
+ * fit. With partial, as much of it as fits is staged instead (write()); a
+ * message too big for even an empty stage is otherwise left to the caller.
+ * Returns the bytes staged. The stage lock must be held.
+ */
+static int stage_msg(struct kerneltalk_client *cnt, struct iov_iter *from,
+					 u32 len, int partial, int nonblock)
+{
+	struct kerneltalk_stage *st = &cnt->stage;
+	struct kt_stage_rec *hdr;
+	u32 need = partial ? 1 : len;
+	int rv;
+
+	if (st->buf == NULL)
+	{
+		// allocating may sleep
+		if (nonblock == NONBLOCK_NOWAIT)
+			return -EAGAIN;
+		if (stage_alloc(cnt))
+			return -ENOMEM;
+	}
+	if (stage_room(cnt) < need)
+	{
+		rv = flush_stage(cnt, nonblock);
+		if (rv)
+			return rv;
+		if (stage_room(cnt) < need)
+			return 0;
+	}
+
+	len = min(len, stage_room(cnt));
+	hdr = (struct kt_stage_rec *)(st->buf + st->used);
+	if (copy_from_iter(hdr + 1, len, from) != len)
+		return -EFAULT;
+	hdr->len = len;
+	hdr->pid = task_tgid_nr(current);
+	st->used += sizeof(*hdr) + round_up(len, 8);
+	st->bytes += len;
+	if (st->recs++ == 0)
+		queue_delayed_work(kerneltalk_wq, &st->work,
+						   msecs_to_jiffies(st->cork_ms));
+	return len;
+}
+
+/*
+ * Staged data has waited cork_ms. Flush it without waiting for room, which a
+ * worker must not do, and try again shortly if there is none.
+ */
+static void stage_work_fn(struct work_struct *work)
+{
+	struct kerneltalk_client *cnt = container_of(to_delayed_work(work),
+												 struct kerneltalk_client,
+												 stage.work);
+
+	mutex_lock(&cnt->stage.lock);
+	if (flush_stage(cnt, 1))
+		queue_delayed_work(kerneltalk_wq, &cnt->stage.work,
+						   msecs_to_jiffies(STAGE_RETRY_MS));
+	mutex_unlock(&cnt->stage.lock);
+}
+
+/*
+ * Add up a channel's counters over all CPUs. Counters keep moving while we do,
+ * so this is a snapshot only in the loose sense.
+ */
+static void stats_sum(struct kerneltalk_server *srv, struct kerneltalk_stats *sum)
+{
+	struct kerneltalk_stats *st;
+	int cpu, i;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu)
+	{
+		st = per_cpu_ptr(srv->stats, cpu);
+		sum->msgs += st->msgs;
+		sum->bytes += st->bytes;
+		sum->reads += st->reads;
+		sum->read_bytes += st->read_bytes;
+		sum->stalls += st->stalls;
+		sum->stall_ns += st->stall_ns;
+		sum->wakeups += st->wakeups;
+		sum->spilled += st->spilled;
+		for (i = 0; i < KERNELTALK_LAT_BUCKETS; i++)
+			sum->lat[i] += st->lat[i];
+	}
+}
+
+/*
+ * Copy the bytes at positions [from, to) between rings of different sizes.
+ * Positions are absolute, so each byte lands wherever its position falls in
+ * the destination, and either side may wrap.
+ */
+static void ring_copy(struct kerneltalk_ring *dst, u32 dst_size,
+					  struct kerneltalk_ring *src, u32 src_size, u64 from, u64 to)
+{
+	size_t n;
+
+	while (from < to)
+	{
+		n = min(kt_first(src_size, from, to - from),
+				kt_first(dst_size, from, to - from));
+		memcpy(dst->data + kt_idx(dst_size, from), src->data + kt_idx(src_size, from), n);
+		from += n;
+	}
+}
+
+/*
+ * Move a channel to a ring of another size. Everything between the slowest
+ * reader and the head is copied over at the same positions, so no client
+ * notices apart from the size in the control page. The new rings are
+ * allocated before taking the lock; writers and readers only wait for the
+ * copy. A ring somebody maps can't move, the mapping would keep the old pages.
+ */
+static int resize_ring(struct kerneltalk_server *srv, u32 size)
+{
+	struct kerneltalk_ring *ring, *old;
+	struct kerneltalk_ring **replicas = NULL, **old_replicas;
+	unsigned int order = 0;
+	int node, rv = -EBUSY;
+	u64 tail;
+
+	if (atomic_read(&srv->nr_maps))
+		return -EBUSY;
+	if (READ_ONCE(huge_pages) && size >= PAGE_SIZE << KT_HUGE_ORDER)
+		order = KT_HUGE_ORDER;
+
+	ring = ring_alloc(size, READ_ONCE(srv->ring)->node, order);
+	if (ring == NULL)
+		return -ENOMEM;
+	if (READ_ONCE(srv->replicas))
+	{
+		// as in alloc_replicas(), a node without a replica reads the ring
+		replicas = kcalloc(nr_node_ids, sizeof(*replicas), GFP_KERNEL);
+		if (replicas == NULL)
+		{
+			ring_free(ring);
+			return -ENOMEM;
+		}
+		for_each_online_node(node)
+		{
+			if (node != ring->node)
+				replicas[node] = ring_alloc(size, node, order);
+		}
+	}
+
+	buffer_down_write(srv);
+
+	spin_lock(&srv->heap_lock);
+	tail = srv->heap_len ? srv->heap[0]->pos : srv->head;
+	spin_unlock(&srv->heap_lock);
+
+	// mapped meanwhile, or the unread data no longer fits
+	mutex_lock(&srv->map_lock);
+	if (atomic_read(&srv->nr_maps) || srv->head - tail > size)
+	{
+		mutex_unlock(&srv->map_lock);
+		goto out;
+	}
+
+	ring_copy(ring, size, srv->ring, srv->size, tail, srv->head);
+	if (replicas)
+	{
+		for (node = 0; node < nr_node_ids; node++)
+			if (replicas[node])
+				ring_copy(replicas[node], size, ring, size, tail, srv->head);
+	}
+
+	// room_to_write() reads the size under heap_lock only
+	spin_lock(&srv->heap_lock);
+	old = srv->ring;
+	old_replicas = srv->replicas;
+	srv->ring = ring;
+	srv->replicas = replicas;
+	srv->size = size;
+	spin_unlock(&srv->heap_lock);
+	srv->order = order;
+	srv->ring_pgoff = ALIGN(srv->ctrl_pages, 1UL << order);
+	srv->ctrl->ring_size = size;
+	srv->ctrl->ring_offset = srv->ring_pgoff << PAGE_SHIFT;
+	mutex_unlock(&srv->map_lock);
+	WRITE_ONCE(srv->resizes, srv->resizes + 1);
+	ring = old;
+	replicas = old_replicas;
+	rv = SUCCESS;
+
+out:
+	buffer_up_write(srv);
+
+	// whichever rings lost
+	if (replicas)
+	{
+		for (node = 0; node < nr_node_ids; node++)
+			ring_free(replicas[node]);
+		kfree(replicas);
+	}
+	ring_free(ring);
+	return rv;
+}
+
+static unsigned long autosize_delay(void)
+{
+	return msecs_to_jiffies(max(READ_ONCE(autosize_ms), 10U));
+}
+
+/*
+ * The autosizer. Once a period it decides from the writers' stalls and the
+ * fullest the ring got since last time:
+ *
+ *  - stalls while the ring was at least half full, or three periods in a row
+ *    that left it three quarters full, double the ring. Stalls with the ring
+ *    mostly empty are SENDMMSG messages, small ones, waiting for a record
+ *    descriptor behind a slow reader. There are descriptors for the biggest
+ *    ring already and write() never waits for one, so growing doesn't help.
+ *  - thirty periods in a row that never filled a quarter of it halve it.
+ *
+ * A resize that can't happen now (the ring is mapped, or too much is unread to
+ * shrink) is tried again next period.
+ */
+static void autosize_work_fn(struct work_struct *work)
+{
+	struct kerneltalk_server *srv = container_of(to_delayed_work(work),
+												 struct kerneltalk_server, autosize_work);
+	struct kerneltalk_stats sum;
+	u32 size = READ_ONCE(srv->size);
+	u32 peak = xchg(&srv->peak_used, 0);
+	u32 target = size;
+	u64 stalls;
+
+	stats_sum(srv, &sum);
+	stalls = sum.stalls - srv->last_stalls;
+	srv->last_stalls = sum.stalls;
+
+	srv->hot = peak >= size / 4 * 3 ? srv->hot + 1 : 0;
+	srv->cold = peak < size / 4 ? srv->cold + 1 : 0;
+	if ((stalls && peak >= size / 2) || srv->hot >= AUTOSIZE_HOT)
+		target = min(size * 2, srv->size_max);
+	else if (srv->cold >= AUTOSIZE_COLD)
+		target = max(size / 2, srv->size_min);
+
+	if (target != size && resize_ring(srv, target) == SUCCESS)
+	{
+		printk(KERN_INFO "kerneltalk: autosize: inode=%p ring %u -> %u bytes\n",
+			   srv->inode, size, target);
+		srv->hot = 0;
+		srv->cold = 0;
+	}
+
+	queue_delayed_work(kerneltalk_wq, &srv->autosize_work, autosize_delay());
+}
+
+/*
+ * Return true when every other client has read everything this client wrote.
+ * Clients that joined after our last write start at the head, so they are
+ * caught up by definition. The slowest other client is the top of the heap,
+ * or if that's us, one of our two children. A spilled client's heap position
+ * is where its spill ends; it has read up to as many bytes before that as are
+ * left in the spill.
+ */
+static int readers_caught_up(struct kerneltalk_client *cnt)
+{
+	struct kerneltalk_server *srv = cnt->server;
+	struct kerneltalk_client *other;
+	u64 pos = U64_MAX;
+	unsigned int i;
+
+	spin_lock(&srv->heap_lock);
+	if (srv->heap[0] != &cnt->cur)
+		pos = srv->heap[0]->pos;
+	else
+		for (i = 1; i <= 2 && i < srv->heap_len; i++)
+			pos = min(pos, srv->heap[i]->pos);
+	list_for_each_entry(other, &srv->spill_list, spill_list)
+		if (other != cnt)
+			pos = min(pos, other->cur.pos - READ_ONCE(other->spill.bytes));
+	spin_unlock(&srv->heap_lock);
+
+	return pos >= cnt->last_write;
+}
+
+/*
+ * Delivery barrier: wait up to timeout jiffies for readers_caught_up(). Readers
+ * wake the swq when they consume data and somebody sleeps there.
+ */
+static long wait_for_readers(struct kerneltalk_client *cnt, long timeout)
+{
+	long rv;
+
+	// a barrier is no use if what we wrote is still staged
+	if (mutex_lock_interruptible(&cnt->stage.lock))
+		return -ERESTARTSYS;
+	rv = flush_stage(cnt, timeout == 0);
+	mutex_unlock(&cnt->stage.lock);
+	if (rv)
+		return rv == -EAGAIN ? -ETIMEDOUT : rv;
+	if (readers_caught_up(cnt))
+		return SUCCESS;
+	if (timeout == 0)
+		return -ETIMEDOUT;
+
+	rv = wait_event_interruptible_timeout(cnt->server->swq,
+										  readers_caught_up(cnt), timeout);
+	if (rv < 0)
+		return -ERESTARTSYS;
+	if (rv == 0)
+		return -ETIMEDOUT;
+	return SUCCESS;
+}
+
+/*
+ * Create a new client for a server. Client objects are stored within struct
+ * file's private_data field, so there is no need for any special lookup from
+ * the client list when you want this client again. The benchmark's clients
+ * have no file.
+ */
+static struct kerneltalk_client *create_client(struct file *filp,
+											   struct kerneltalk_server *srv)
+{
+	struct kerneltalk_client *cnt;
+
+	cnt = kmalloc(sizeof(struct kerneltalk_client), GFP_KERNEL);
+	if (cnt == NULL)
+		return NULL;
+
+	cnt->filp = filp;
+	cnt->server = srv;
+	INIT_LIST_HEAD(&cnt->client_list);
+	INIT_LIST_HEAD(&cnt->notify_list);
+	cnt->cur.pos = srv->head; // prevent invalid data
+	cnt->cur.rec = srv->rec_head;
+	cnt->last_write = srv->head;
+	cnt->evfd = NULL;
+	cnt->fasync = NULL;
+	cnt->lowat = 1;
+	cnt->armed = 1;
+	memset(&cnt->stage, 0, sizeof(cnt->stage));
+	mutex_init(&cnt->stage.lock);
+	cnt->stage.cork_ms = default_cork_ms();
+	INIT_DELAYED_WORK(&cnt->stage.work, stage_work_fn);
+	memset(&cnt->spill, 0, sizeof(cnt->spill));
+	INIT_LIST_HEAD(&cnt->spill_list);
+	cnt->memcg = NULL;
+	mutex_init(&cnt->read_mutex);
+	if (filp && srv->spill_max)
+		spill_open(srv, cnt);
+	cnt->mapped = 0;
+	if (filp)
+		filp->private_data = cnt;
+
+	mutex_lock_interruptible(&srv->client_list_lock);
+	if (heap_add(srv, cnt))
+	{
+		mutex_unlock(&srv->client_list_lock);
+		spill_close(srv, cnt);
+		kfree(cnt);
+		return NULL;
+	}
+	list_add(&cnt->client_list, &srv->client_list);
+	cnt->shard = &srv->shards[srv->next_shard++ % KERNELTALK_SHARDS];
+	srv->nr_clients++;
+	mutex_unlock(&srv->client_list_lock);
+
+	return cnt;
+}
+
+/*
+ * Take a client off its server and free it, and the server too if that was
+ * the last client. SIGIO must already be off.
+ */
+static void destroy_client(struct kerneltalk_client *cnt)
+{
+	struct kerneltalk_server *srv = cnt->server;
+
+	kerneltalk_set_eventfd(cnt, -1);
+
+	// what is staged goes out if it fits right now, else it is lost
+	mutex_lock(&cnt->stage.lock);
+	flush_stage(cnt, 1);
+	mutex_unlock(&cnt->stage.lock);
+	cancel_delayed_work_sync(&cnt->stage.work);
+	kvfree(cnt->stage.buf);
+
+	mutex_lock_interruptible(&srv->client_list_lock);
+	list_del(&cnt->client_list);
+	// a writer may be spilling us right now
+	buffer_down_write(srv);
+	heap_remove(srv, cnt);
+	buffer_up_write(srv);
+	srv->nr_clients--;
+	mutex_unlock(&srv->client_list_lock);
+
+	spill_close(srv, cnt);
+
+	// we may have been the reader that writers or a barrier were waiting on
+	wake_up(&srv->wwq);
+	wake_up(&srv->swq);
+
+	mutex_lock_interruptible(&server_list_lock);
+	check_free_server(srv);
+	mutex_unlock(&server_list_lock);
+
+	kfree(cnt);
+}
+
+/*
+ * FILE OPERATIONS
+ */
+
+/*
+ * Open - will get/create a server, and create a client as well
+ */
+static int kerneltalk_open(struct inode *inode, struct file *filp)
+{
+	struct kerneltalk_server *srv;
+	struct kerneltalk_client *cnt;
+
+	// Obtain server list lock so that everything happens atomically to the
+	// server list.
+	mutex_lock_interruptible(&server_list_lock);
+
+	srv = get_server(inode);
+	if (!srv)
+		goto server_create_failed;
+
+	cnt = create_client(filp, srv);
+	if (!cnt)
+		goto client_create_failed;
+
+	// read_iter and write_iter honour IOCB_NOWAIT, see nonblocking(), so
+	// io_uring can try them inline and wait with poll rather than hand them
+	// to a worker thread
+	filp->f_mode |= FMODE_NOWAIT;
+
+	mutex_unlock(&server_list_lock);
+
+	printk(KERN_INFO "kerneltalk: open: inode=%p filp=%p opened file!\n",
+		   inode, filp);
+	return SUCCESS;
+
+client_create_failed:
+	// free the server if we were the only ones who wanted it
+	check_free_server(srv);
+server_create_failed:
+	mutex_unlock(&server_list_lock);
+	printk(KERN_INFO "kerneltalk: open: inode=%p filp=%p fail\n", inode, filp);
+	return -ENOMEM;
+}
+
+/*
+ * Release - called when the last reference to the file goes away. We use this
+ * to free the client and optionally the server when it has no more clients.
+ *
+ * NOTE Due to fork() or dup(), multiple processes and file descriptors can
+ * refer to the same struct file, and a mapping of the device keeps the file
+ * alive after close() too. The VFS only calls us once all of them are gone.
+ *
+ * NOTE If two processes/threads have the same file instance and they both
+ * read/write, bad things will happen and I'll yell at them.
+ */
+static int kerneltalk_release(struct inode *inode, struct file *filp)
+{
+	struct kerneltalk_client *cnt;
+
+	cnt = filp->private_data;
+
+	// stop notifications first, this takes us off the shard's list
+	kerneltalk_fasync(-1, filp, 0);
+	destroy_client(cnt);
+
+	printk(KERN_INFO "kerneltalk: release: filp=%p freed client\n", filp);
+	return SUCCESS;
+}
+
+/*
+ * Read - read from the server. This has blocking and non-blocking variations.
+ * The data goes wherever the iterator points.
+ */
+static ssize_t channel_read(struct kerneltalk_client *cnt, struct iov_iter *to,
+							int nonblock)
+{
+	struct kerneltalk_server *srv = cnt->server;
+	size_t length = iov_iter_count(to);
+	int bytes_read;
+
+	pr_debug("kerneltalk: read: cnt=%p WAIT FOR DATA\n", cnt);
+
+	// acquire buffer read lock to ensure amount of data doesn't change
+	bytes_read = client_lock_read(cnt, nonblock);
+	if (bytes_read)
+		return bytes_read;
+
+	// wait till we have data
+	while (nothing_to_read(cnt))
+	{
+		client_up_read(cnt);
+		if (nonblock)
+			return -EAGAIN;
+		if (wait_event_interruptible(cnt->shard->rwq, !nothing_to_read(cnt)))
+			return -ERESTARTSYS;
+		client_down_read(cnt);
+	}
+
+	// what was spilled is older than anything in the ring
+	if (cnt->spill.bytes)
+	{
+		// it's in a file, reading it may sleep
+		if (nonblock == NONBLOCK_NOWAIT)
+		{
+			client_up_read(cnt);
+			return -EAGAIN;
+		}
+		bytes_read = spill_read(cnt, to, length);
+		client_up_read(cnt);
+		return bytes_read;
+	}
+
+	pr_debug("kerneltalk: read: cnt=%p READING length=%zu srv->head=%llu cnt->cur.pos=%llu\n",
+		   cnt, length, srv->head, cnt->cur.pos);
+
+	bytes_read = min_t(u64, length, srv->head - cnt->cur.pos);
+	if (copy_out(srv, to, cnt->cur.pos, bytes_read))
+	{
+		client_up_read(cnt);
+		return -EFAULT;
+	}
+	advance(cnt, bytes_read);
+	length -= bytes_read;
+
+	client_up_read(cnt);
+
+	pr_debug("kerneltalk: read: cnt=%p READ %d, length=%zu srv->head=%llu cnt->cur.pos=%llu\n",
+		   cnt, bytes_read, length, srv->head, cnt->cur.pos);
+
+	return bytes_read;
+}
+
+/*
+ * O_NONBLOCK on the file, or RWF_NOWAIT for this call. The latter, which is
+ * also how io_uring makes its first try, returns NONBLOCK_NOWAIT: besides not
+ * waiting for data or room we must not sleep at all, so locks are only tried,
+ * there is no allocating or spilling, and readers are woken from the
+ * workqueue.
+ */
+static int nonblocking(struct kiocb *iocb)
+{
+	if (iocb->ki_flags & IOCB_NOWAIT)
+		return NONBLOCK_NOWAIT;
+	return !!(iocb->ki_filp->f_flags & O_NONBLOCK);
+}
+
+static ssize_t kerneltalk_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	return channel_read(iocb->ki_filp->private_data, to, nonblocking(iocb));
+}
+
+/*
+ * Return information about whether the file is ready to read or write.
+ * Additionally register our wait queues with the poll table so that the select
+ * and poll system calls can wake when the state changes.
+ */
+static unsigned int kerneltalk_poll(struct file *filp, poll_table *tbl)
 {
 	struct kerneltalk_client *cnt;
 	struct kerneltalk_server *srv;
+	int mask = 0;
+
+	cnt = filp->private_data;
+	srv = cnt->server;
+
+	pr_debug("kerneltalk: poll filp=%p\n", filp);
+
+	/*
+	 * Only sit on the writers' queue if the caller cares about POLLOUT, or
+	 * every reader in an epoll set would be woken whenever room appears.
+	 */
+	poll_wait(filp, &cnt->shard->rwq, tbl);
+	if (poll_requested_events(tbl) & (POLLOUT | POLLWRNORM))
+		poll_wait(filp, &srv->wwq, tbl);
+
+	/*
+	 * No buffer lock needed: room_to_write() reads the slowest position under
+	 * the heap lock, and our own position only moves when we read. Room means
+	 * room for a new record, so a sender that finds none doesn't spin.
+	 */
+	mask = 0;
+	if (unread_bytes(cnt, READ_ONCE(srv->head)) >= cnt->lowat)
+	{
+		mask |= POLLIN | POLLRDNORM;
+	}
+
+	if (room_to_write(srv, 1) > 0)
+	{
+		mask |= POLLOUT | POLLWRNORM;
+	}
+
+	return mask;
+}
+
+/*
+ * Write - Put data into the buffer. Supports blocking and non-blocking
+ * variations. Requires mutual exclusion from all readers and writers for
+ * safety. A writev() still commits a single record.
+ *
+ * While corked the data goes to the client's stage instead. A write() also
+ * ends a KERNELTALK_MSG_MORE sequence: its data is staged behind the rest and
+ * all of it is flushed. If that finds no room the data stays staged and still
+ * counts as written; it goes out as soon as there is room.
+ */
+static ssize_t channel_write(struct kerneltalk_client *cnt,
+							 struct iov_iter *from, int nonblock)
+{
+	struct kerneltalk_server *srv = cnt->server;
+	struct kerneltalk_stage *st = &cnt->stage;
+	size_t amt = iov_iter_count(from);
+	int room;
+	int bytes_written;
+	u64 head;
+
+	bytes_written = stage_lock(cnt, nonblock);
+	if (bytes_written)
+		return bytes_written;
+
+	if (st->corked || st->recs)
+	{
+		bytes_written = 0;
+		st->more = 0;
+		if (amt)
+			bytes_written = stage_msg(cnt, from, min_t(size_t, amt, U32_MAX),
+									  1, nonblock);
+		if (bytes_written >= 0 && !st->corked)
+			flush_stage(cnt, nonblock);
+		mutex_unlock(&st->lock);
+		return bytes_written;
+	}
+
+	pr_debug("kerneltalk: write: cnt=%p WAIT FOR ROOM\n", cnt);
+
+	room = buffer_lock_write(srv, nonblock);
+	if (room)
+	{
+		mutex_unlock(&st->lock);
+		return room;
+	}
+	// homing the ring allocates
+	if (nonblock == NONBLOCK_NOWAIT && !srv->homed)
+	{
+		buffer_up_write(srv);
+		mutex_unlock(&st->lock);
+		return -EAGAIN;
+	}
+	head = srv->head;
+
+	// wait until there is room to write
+	room = make_room(srv, 1, 0, nonblock, &head);
+	if (room < 0)
+	{
+		mutex_unlock(&st->lock);
+		return room;
+	}
+
+	pr_debug("kerneltalk: write: cnt=%p WRITING room=%d amt=%zu srv->head=%llu\n",
+		   cnt, room, amt, srv->head);
+
+	bytes_written = min_t(size_t, room, amt);
+	if (copy_in(srv, from, bytes_written))
+	{
+		buffer_up_write(srv);
+		mutex_unlock(&st->lock);
+		return -EFAULT;
+	}
+	if (bytes_written > 0)
+	{
+		commit(cnt, bytes_written, 1, task_tgid_nr(current));
+		publish(srv);
+	}
+	note_used(srv, srv->size - room + bytes_written);
+	amt -= bytes_written;
+	room -= bytes_written;
+
+	pr_debug("kerneltalk: write: cnt=%p WROTE %d, room=%d amt=%zu srv->head=%llu\n",
+		   cnt, bytes_written, room, amt, srv->head);
+
+	write_done(srv, head, nonblock); // there is more data for readers
+	mutex_unlock(&st->lock);
+	return bytes_written;
+}
+
+static ssize_t kerneltalk_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	return channel_write(iocb->ki_filp->private_data, from, nonblocking(iocb));
+}
+
+/*
+ * Fsync - the delivery barrier. Returns once every other client has read all
+ * the data we have written, so a producer can pipeline many writes and then
+ * synchronize once.
+ */
+static int kerneltalk_fsync(struct file *filp, loff_t start, loff_t end,
+							int datasync)
+{
+	return wait_for_readers(filp->private_data, MAX_SCHEDULE_TIMEOUT);
+}
+
+/*
+ * Batch send - commit each message of the vector as its own record, taking the
+ * buffer lock once and waking readers once for the whole batch (unless we have
+ * to wait for room halfway, in which case readers get what we have so far).
+ * Messages sent while corked or with KERNELTALK_MSG_MORE go to the stage, and
+ * the first one without the flag flushes it.
+ */
+static long kerneltalk_sendmmsg(struct file *filp,
+								struct kerneltalk_mmsg __user *usrmm)
+{
+	struct kerneltalk_client *cnt = filp->private_data;
+	struct kerneltalk_server *srv = cnt->server;
+	struct kerneltalk_stage *st = &cnt->stage;
+	struct kerneltalk_msg __user *usrmsgs;
+	struct kerneltalk_mmsg mm;
+	struct kerneltalk_msg msg;
+	struct iov_iter iter;
+	struct iovec iov;
+	int nonblock;
+	long err = 0;
+	u32 sent;
 	int room;
-	int bytes_written = 0;
+	int more;
+	int locked = 0;
+	u64 head = 0;
+
+	if (copy_from_user(&mm, usrmm, sizeof(mm)))
+		return -EFAULT;
+	if (mm.flags & ~KERNELTALK_MMSG_DONTWAIT)
+		return -EINVAL;
+	usrmsgs = u64_to_user_ptr(mm.msgs);
+	nonblock = (filp->f_flags & O_NONBLOCK) || (mm.flags & KERNELTALK_MMSG_DONTWAIT);
+
+	if (mutex_lock_interruptible(&st->lock))
+		return -ERESTARTSYS;
+
+	for (sent = 0; sent < mm.count; sent++)
+	{
+		if (copy_from_user(&msg, &usrmsgs[sent], sizeof(msg)))
+		{
+			err = -EFAULT;
+			break;
+		}
+		if (msg.len == 0 || msg.len > srv->size)
+		{
+			err = msg.len ? -EMSGSIZE : -EINVAL;
+			break;
+		}
+
+		more = !!(msg.flags & KERNELTALK_MSG_MORE);
+		if (st->corked || more || st->recs)
+		{
+			if (locked)
+				write_done(srv, head, nonblock);
+			locked = 0;
+			st->more = more;
+			user_iter(&iter, &iov, ITER_SOURCE, u64_to_user_ptr(msg.buf), msg.len);
+			room = stage_msg(cnt, &iter, msg.len, 0, nonblock);
+			if (room < 0)
+			{
+				err = room;
+				break;
+			}
+			// staged, like a write() it stays so if the flush finds no room
+			if (room > 0)
+			{
+				if (!st->corked && !more)
+					flush_stage(cnt, nonblock);
+				continue;
+			}
+			// too big for the stage, which is empty now
+		}
+
+		if (!locked)
+		{
+			buffer_down_write(srv);
+			head = srv->head;
+			locked = 1;
+		}
 
-	cnt = filp->private_data;
-	srv = cnt->server;
+		// wait until the whole message fits
+		room = make_room(srv, msg.len, 1, nonblock, &head);
+		if (room < 0)
+		{
+			err = room;
+			locked = 0;
+			break;
+		}
 
-	printk(KERN_INFO "kerneltalk: write: filp=%p WAIT FOR ROOM\n", filp);
+		if (copy_in_user(srv, u64_to_user_ptr(msg.buf), msg.len))
+		{
+			err = -EFAULT;
+			break;
+		}
+		commit(cnt, msg.len, 0, task_tgid_nr(current));
+		publish(srv);
+		note_used(srv, srv->size - room + msg.len);
+	}
 
-	down_write(&srv->buffer_lock);
+	if (locked)
+		write_done(srv, head, nonblock);
+	mutex_unlock(&st->lock);
 
-	// wait until there is room to write
-	while ((room = room_to_write(srv)) == 0)
+	pr_debug("kerneltalk: sendmmsg: filp=%p SENT %u of %u srv->head=%llu\n",
+		   filp, sent, mm.count, srv->head);
+
+	if (sent)
+		return sent;
+	return err ? err : -EAGAIN;
+}
+
+/*
+ * Batch receive - hand out up to count whole records with their metadata. A
+ * record that doesn't fit the caller's buffer is truncated and the rest of it
+ * is dropped, like recvmmsg().
+ */
+static long kerneltalk_recvmmsg(struct file *filp,
+								struct kerneltalk_mmsg __user *usrmm)
+{
+	struct kerneltalk_client *cnt = filp->private_data;
+	struct kerneltalk_server *srv = cnt->server;
+	struct kerneltalk_msg __user *usrmsgs;
+	struct kerneltalk_mmsg mm;
+	struct kerneltalk_msg msg;
+	struct kerneltalk_spill *sp = &cnt->spill;
+	struct kt_rec *rec;
+	struct iov_iter iter;
+	struct iovec iov;
+	long err = 0;
+	u32 received;
+	u64 avail;
+
+	if (copy_from_user(&mm, usrmm, sizeof(mm)))
+		return -EFAULT;
+	if (mm.flags & ~KERNELTALK_MMSG_DONTWAIT)
+		return -EINVAL;
+	if (mm.count == 0)
+		return 0;
+	usrmsgs = u64_to_user_ptr(mm.msgs);
+
+	client_down_read(cnt);
+
+	while (nothing_to_read(cnt))
 	{
-		up_write(&srv->buffer_lock);
+		client_up_read(cnt);
+		if ((filp->f_flags & O_NONBLOCK) || (mm.flags & KERNELTALK_MMSG_DONTWAIT))
+			return -EAGAIN;
+		if (wait_event_interruptible(cnt->shard->rwq, !nothing_to_read(cnt)))
+			return -ERESTARTSYS;
+		client_down_read(cnt);
+	}
+
+	// spilled records first, they are older
+	for (received = 0; received < mm.count && sp->recs; received++)
+	{
+		if (copy_from_user(&msg, &usrmsgs[received], sizeof(msg)))
+		{
+			err = -EFAULT;
+			break;
+		}
+		if (spill_load(sp))
+		{
+			err = -EIO;
+			break;
+		}
+
+		avail = sp->cur.len - sp->off;
+		msg.flags = sp->cur.flags | (sp->off ? KERNELTALK_MSG_PARTIAL : 0);
+		if (avail > msg.len)
+			msg.flags |= KERNELTALK_MSG_TRUNC;
+		else
+			msg.len = avail;
+		msg.seq = sp->cur.seq;
+		msg.stamp_ns = sp->cur.stamp;
+		msg.pid = sp->cur.pid;
+
+		user_iter(&iter, &iov, ITER_DEST, u64_to_user_ptr(msg.buf), msg.len);
+		if (spill_copy_out(sp, &iter, msg.len) ||
+			copy_to_user(&usrmsgs[received], &msg, sizeof(msg)))
+		{
+			err = -EFAULT;
+			break;
+		}
+		spill_consume(cnt, avail);
+	}
+
+	for (; !err && received < mm.count && cnt->cur.rec < srv->rec_head; received++)
+	{
+		if (copy_from_user(&msg, &usrmsgs[received], sizeof(msg)))
+		{
+			err = -EFAULT;
+			break;
+		}
+
+		rec = REC(srv, cnt->cur.rec);
+		avail = REC_END(srv, cnt->cur.rec) - cnt->cur.pos;
+		msg.flags = 0;
+		if (cnt->cur.pos != rec->pos)
+			msg.flags |= KERNELTALK_MSG_PARTIAL;
+		if (avail > msg.len)
+			msg.flags |= KERNELTALK_MSG_TRUNC;
+		else
+			msg.len = avail;
+		msg.seq = cnt->cur.rec;
+		msg.stamp_ns = rec->stamp;
+		msg.pid = rec->pid;
+
+		if (copy_out_user(srv, u64_to_user_ptr(msg.buf), cnt->cur.pos, msg.len) ||
+			copy_to_user(&usrmsgs[received], &msg, sizeof(msg)))
+		{
+			err = -EFAULT;
+			break;
+		}
+		advance(cnt, avail);
+	}
+
+	client_up_read(cnt);
+
+	pr_debug("kerneltalk: recvmmsg: filp=%p RECEIVED %u of %u cnt->cur.pos=%llu\n",
+		   filp, received, mm.count, cnt->cur.pos);
+
+	return received ? received : err;
+}
+
+/*
+ * Peek - like read, but the read position stays where it is.
+ */
+static long kerneltalk_peek(struct file *filp, struct kerneltalk_peek __user *usrpeek)
+{
+	struct kerneltalk_client *cnt = filp->private_data;
+	struct kerneltalk_server *srv = cnt->server;
+	struct kerneltalk_peek peek;
+	struct iov_iter iter;
+	struct iovec iov;
+	long bytes;
+
+	if (copy_from_user(&peek, usrpeek, sizeof(peek)))
+		return -EFAULT;
+	if (peek.flags)
+		return -EINVAL;
+
+	client_down_read(cnt);
+
+	while (nothing_to_read(cnt))
+	{
+		client_up_read(cnt);
 		if (filp->f_flags & O_NONBLOCK)
 			return -EAGAIN;
-		if (wait_event_interruptible(srv->wwq, room_to_write(srv) > 0))
+		if (wait_event_interruptible(cnt->shard->rwq, !nothing_to_read(cnt)))
 			return -ERESTARTSYS;
-		down_write(&srv->buffer_lock);
+		client_down_read(cnt);
+	}
+
+	if (cnt->spill.bytes)
+	{
+		// only as far as the current spilled record, that's where its header is
+		bytes = spill_load(&cnt->spill);
+		if (bytes == SUCCESS)
+		{
+			bytes = min_t(u64, peek.len, cnt->spill.cur.len - cnt->spill.off);
+			user_iter(&iter, &iov, ITER_DEST, u64_to_user_ptr(peek.buf), bytes);
+			if (spill_copy_out(&cnt->spill, &iter, bytes))
+				bytes = -EFAULT;
+		}
+		client_up_read(cnt);
+		return bytes;
+	}
+
+	bytes = min_t(u64, peek.len, srv->head - cnt->cur.pos);
+	if (copy_out_user(srv, u64_to_user_ptr(peek.buf), cnt->cur.pos, bytes))
+		bytes = -EFAULT;
+
+	client_up_read(cnt);
+	return bytes;
+}
+
+/*
+ * Skip - drop unread bytes or records without copying them anywhere.
+ */
+static long kerneltalk_skip(struct file *filp, struct kerneltalk_skip __user *usrskip)
+{
+	struct kerneltalk_client *cnt = filp->private_data;
+	struct kerneltalk_server *srv = cnt->server;
+	struct kerneltalk_skip skip;
+	u64 target;
+	u64 count;
+	long skipped;
+
+	if (copy_from_user(&skip, usrskip, sizeof(skip)))
+		return -EFAULT;
+	if (skip.flags & ~KERNELTALK_SKIP_RECORDS)
+		return -EINVAL;
+
+	client_down_read(cnt);
+
+	// the spill goes first; it ends on a record boundary
+	count = spill_skip(cnt, skip.count, skip.flags & KERNELTALK_SKIP_RECORDS);
+	skipped = count;
+	count = cnt->spill.recs ? 0 : skip.count - count;
+
+	if (skip.flags & KERNELTALK_SKIP_RECORDS)
+	{
+		count = min_t(u64, count, srv->rec_head - cnt->cur.rec);
+		target = kt_skip_target(srv->recs, srv->nr_recs, srv->head,
+								srv->rec_head, &cnt->cur, count);
+	}
+	else
+	{
+		count = min_t(u64, count, srv->head - cnt->cur.pos);
+		target = cnt->cur.pos + count;
 	}
+	advance(cnt, target - cnt->cur.pos);
+
+	client_up_read(cnt);
+	return skipped + count;
+}
+
+/*
+ * Wait - sleep until the doorbell in the control page no longer shows seq.
+ */
+static long kerneltalk_wait(struct file *filp, struct kerneltalk_wait __user *usrwait)
+{
+	struct kerneltalk_client *cnt = filp->private_data;
+	struct kerneltalk_server *srv = cnt->server;
+	struct kerneltalk_wait wait;
+	long timeout = MAX_SCHEDULE_TIMEOUT;
+	long rv;
+
+	if (copy_from_user(&wait, usrwait, sizeof(wait)))
+		return -EFAULT;
+	if (wait.timeout_ms != KERNELTALK_SYNC_FOREVER)
+		timeout = msecs_to_jiffies(wait.timeout_ms);
+
+	rv = wait_event_interruptible_timeout(cnt->shard->rwq,
+										  READ_ONCE(srv->ctrl->seq) != wait.seq,
+										  timeout);
+	if (rv < 0)
+		return -ERESTARTSYS;
+	if (rv == 0 && READ_ONCE(srv->ctrl->seq) == wait.seq)
+		return -ETIMEDOUT;
+	return SUCCESS;
+}
+
+/*
+ * Only clients with an eventfd or SIGIO sit on their shard's notify list, so
+ * a fan-out doesn't walk the ones that just sleep or poll.
+ * The shard's notify_lock must be held.
+ */
+static void update_notify_list(struct kerneltalk_client *cnt)
+{
+	int wanted = cnt->evfd || cnt->fasync;
+
+	if (wanted && list_empty(&cnt->notify_list))
+		list_add(&cnt->notify_list, &cnt->shard->notify_list);
+	else if (!wanted && !list_empty(&cnt->notify_list))
+		list_del_init(&cnt->notify_list);
+}
 
-	printk(KERN_INFO "kerneltalk: write: filp=%p WRITING room=%d amt=%zu srv->end=%d\n",
-		   filp, room, amt, srv->end);
+/*
+ * Register (or with -1, unregister) the eventfd notify_client() signals. If
+ * the mark is already reached, signal right away so that a commit racing with
+ * the registration can't be missed.
+ */
+static long kerneltalk_set_eventfd(struct kerneltalk_client *cnt, int fd)
+{
+	struct kerneltalk_shard *shard = cnt->shard;
+	struct eventfd_ctx *evfd = NULL;
+	struct eventfd_ctx *old;
 
-	while (room > 0 && amt > 0)
+	if (fd >= 0)
 	{
-		get_user(srv->buffer[srv->end], usrbuf++);
-		srv->end = (srv->end + 1) % KERNELTALK_BUF;
-		amt--;
-		room--;
-		bytes_written++;
+		evfd = eventfd_ctx_fdget(fd);
+		if (IS_ERR(evfd))
+			return PTR_ERR(evfd);
 	}
 
-	up_write(&srv->buffer_lock);
+	mutex_lock(&shard->notify_lock);
+	old = cnt->evfd;
+	cnt->evfd = evfd;
+	update_notify_list(cnt);
+	if (evfd)
+		notify_client(cnt, READ_ONCE(cnt->server->head));
+	mutex_unlock(&shard->notify_lock);
 
-	printk(KERN_INFO "kerneltalk: write: filp=%p WROTE %d, room=%d amt=%zu srv->end=%d\n",
-		   filp, bytes_written, room, amt, srv->end);
+	if (old)
+		eventfd_ctx_put(old);
+	return SUCCESS;
+}
 
-	wake_up(&srv->rwq); // there is more data for readers
-	return bytes_written;
+/*
+ * Set the low-water mark. If we are already below it, the next notification
+ * is armed right away.
+ */
+static long kerneltalk_set_lowat(struct kerneltalk_client *cnt, u32 lowat)
+{
+	struct kerneltalk_server *srv = cnt->server;
+
+	if (lowat == 0 || lowat > srv->size)
+		return -EINVAL;
+
+	buffer_down_read(srv);
+	cnt->lowat = lowat;
+	if (unread_bytes(cnt, srv->head) < lowat)
+		WRITE_ONCE(cnt->armed, 1);
+	buffer_up_read(srv);
+
+	return SUCCESS;
+}
+
+/*
+ * Cork or uncork. Corking sets up the stage ahead of the first message;
+ * uncorking flushes it, unless a KERNELTALK_MSG_MORE sequence goes on.
+ */
+static long kerneltalk_cork(struct kerneltalk_client *cnt, u32 timeout_ms)
+{
+	struct kerneltalk_stage *st = &cnt->stage;
+	long rv = SUCCESS;
+	int was;
+
+	if (timeout_ms > KERNELTALK_CORK_MAX_MS)
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&st->lock))
+		return -ERESTARTSYS;
+	was = st->corked;
+	st->cork_ms = timeout_ms ? timeout_ms : default_cork_ms();
+	st->corked = timeout_ms != 0;
+	if (st->corked && st->buf == NULL && (rv = stage_alloc(cnt)))
+		st->corked = was;
+	else if (was && !st->corked && !st->more)
+		rv = flush_stage(cnt, !!(cnt->filp->f_flags & O_NONBLOCK));
+	mutex_unlock(&st->lock);
+	return rv;
+}
+
+/*
+ * Ioctl - extra channel operations, see kerneltalk.h for the interface.
+ */
+static long kerneltalk_ioctl(struct file *filp, unsigned int cmd,
+							 unsigned long arg)
+{
+	struct kerneltalk_client *cnt = filp->private_data;
+	struct kerneltalk_server *srv = cnt->server;
+	struct kerneltalk_pending pending;
+	__u32 timeout_ms;
+	__u32 lowat;
+	__s32 fd;
+
+	switch (cmd)
+	{
+	case FIONREAD:
+		return put_user((int)min_t(u64, unread_bytes(cnt, READ_ONCE(srv->head)), INT_MAX),
+						(int __user *)arg);
+	case KERNELTALK_IOC_PENDING:
+		client_down_read(cnt);
+		pending.pos = cnt->cur.pos - cnt->spill.bytes;
+		pending.bytes = unread_bytes(cnt, srv->head);
+		pending.records = srv->rec_head - cnt->cur.rec + cnt->spill.recs;
+		client_up_read(cnt);
+		if (copy_to_user((void __user *)arg, &pending, sizeof(pending)))
+			return -EFAULT;
+		return SUCCESS;
+	case KERNELTALK_IOC_PEEK:
+		return kerneltalk_peek(filp, (struct kerneltalk_peek __user *)arg);
+	case KERNELTALK_IOC_SKIP:
+		return kerneltalk_skip(filp, (struct kerneltalk_skip __user *)arg);
+	case KERNELTALK_IOC_WAIT:
+		return kerneltalk_wait(filp, (struct kerneltalk_wait __user *)arg);
+	case KERNELTALK_IOC_SET_EVENTFD:
+		if (get_user(fd, (__s32 __user *)arg))
+			return -EFAULT;
+		return kerneltalk_set_eventfd(cnt, fd);
+	case KERNELTALK_IOC_SET_LOWAT:
+		if (get_user(lowat, (__u32 __user *)arg))
+			return -EFAULT;
+		return kerneltalk_set_lowat(cnt, lowat);
+	case KERNELTALK_IOC_SYNC:
+		if (get_user(timeout_ms, (__u32 __user *)arg))
+			return -EFAULT;
+		if (timeout_ms == KERNELTALK_SYNC_FOREVER)
+			return wait_for_readers(cnt, MAX_SCHEDULE_TIMEOUT);
+		return wait_for_readers(cnt, msecs_to_jiffies(timeout_ms));
+	case KERNELTALK_IOC_CORK:
+		if (get_user(timeout_ms, (__u32 __user *)arg))
+			return -EFAULT;
+		return kerneltalk_cork(cnt, timeout_ms);
+	case KERNELTALK_IOC_SENDMMSG:
+		return kerneltalk_sendmmsg(filp, (struct kerneltalk_mmsg __user *)arg);
+	case KERNELTALK_IOC_RECVMMSG:
+		return kerneltalk_recvmmsg(filp, (struct kerneltalk_mmsg __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/*
+ * Mappings pin the ring pages they faulted in, so the ring must
+ * not be moved while any exist. Count them, including copies made by fork().
+ * Mappings of just the control pages get kerneltalk_ctrl_vm_ops and don't
+ * count.
+ */
+static void kerneltalk_vm_open(struct vm_area_struct *vma)
+{
+	struct kerneltalk_server *srv = vma->vm_private_data;
+
+	atomic_inc(&srv->nr_maps);
+}
+
+static void kerneltalk_vm_close(struct vm_area_struct *vma)
+{
+	struct kerneltalk_server *srv = vma->vm_private_data;
+
+	atomic_dec(&srv->nr_maps);
+}
+
+/*
+ * Hand out the page behind a faulting address: the control pages first, then
+ * the ring from the replica on the faulting CPU's node. The ring can't change
+ * while it is mapped, see home_ring().
+ */
+static vm_fault_t kerneltalk_vm_fault(struct vm_fault *vmf)
+{
+	struct kerneltalk_server *srv = vmf->vma->vm_private_data;
+	struct kerneltalk_ring *ring = local_ring(srv);
+	struct page *page;
+
+	if (vmf->pgoff < srv->ctrl_pages)
+		page = vmalloc_to_page((char *)srv->ctrl + (vmf->pgoff << PAGE_SHIFT));
+	else if (vmf->pgoff >= srv->ring_pgoff &&
+			 vmf->pgoff - srv->ring_pgoff < ring->nr_pages)
+		page = ring->pages[vmf->pgoff - srv->ring_pgoff];
+	else
+		return VM_FAULT_SIGBUS; // the hole between the two
+	get_page(page);
+	vmf->page = page;
+	return 0;
+}
+
+#ifdef KT_HUGE_MAP
+/*
+ * Map a whole huge folio of the ring with one PMD, if the mapping lines up
+ * with it. Anything else falls back to kerneltalk_vm_fault().
+ */
+static vm_fault_t kerneltalk_vm_huge_fault(struct vm_fault *vmf,
+										   unsigned int order)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct kerneltalk_server *srv = vma->vm_private_data;
+	struct kerneltalk_ring *ring = local_ring(srv);
+	unsigned long addr = vmf->address & PMD_MASK;
+	pgoff_t pgoff;
+
+	if (order != HPAGE_PMD_ORDER || ring->order != HPAGE_PMD_ORDER ||
+		addr < vma->vm_start || addr + PMD_SIZE > vma->vm_end)
+		return VM_FAULT_FALLBACK;
+
+	pgoff = linear_page_index(vma, addr);
+	if (pgoff < srv->ring_pgoff || pgoff - srv->ring_pgoff >= ring->nr_pages)
+		return VM_FAULT_FALLBACK;
+	pgoff -= srv->ring_pgoff;
+	if (pgoff % HPAGE_PMD_NR)
+		return VM_FAULT_FALLBACK;
+
+	return vmf_insert_folio_pmd(vmf, page_folio(ring->pages[pgoff]), false);
+}
+#endif
+
+static const struct vm_operations_struct kerneltalk_vm_ops = {
+	.open = kerneltalk_vm_open,
+	.close = kerneltalk_vm_close,
+	.fault = kerneltalk_vm_fault,
+#ifdef KT_HUGE_MAP
+	.huge_fault = kerneltalk_vm_huge_fault,
+#endif
+};
+
+static const struct vm_operations_struct kerneltalk_ctrl_vm_ops = {
+	.fault = kerneltalk_vm_fault,
+};
+
+/*
+ * Whether a mapping reaches past the control pages. The hole behind them
+ * counts as ring: resize_ring() may start the ring right behind them.
+ */
+static int maps_ring(struct kerneltalk_server *srv, struct vm_area_struct *vma)
+{
+	return vma->vm_pgoff + vma_pages(vma) > srv->ctrl_pages;
+}
+
+/*
+ * Mmap - share the control pages and the ring with user space, read-only. The
+ * ring starts at ctrl->ring_offset, which is a huge page into the file when
+ * the ring is made of huge pages, so that it can be mapped with huge pages as
+ * well. Pages are mapped as they are touched.
+ *
+ * This runs under mmap_lock, and the copies to and from user space done under
+ * buffer_lock may fault and take mmap_lock, so buffer_lock can't be taken here.
+ * map_lock does the job instead: it keeps home_ring() and resize_ring() from
+ * moving a ring that is being mapped, and spill_laggards() from spilling a
+ * client that maps it. It is never held across a user copy.
+ */
+static int kerneltalk_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct kerneltalk_client *cnt = filp->private_data;
+	struct kerneltalk_server *srv = cnt->server;
+	int rv = SUCCESS;
+
+	if (!(vma->vm_flags & VM_SHARED) || (vma->vm_flags & VM_WRITE))
+		return -EINVAL;
+
+	mutex_lock(&srv->map_lock);
+	if (vma->vm_pgoff + vma_pages(vma) > srv->ring_pgoff + srv->ring->nr_pages)
+	{
+		rv = -EINVAL;
+		goto out;
+	}
+
+	/*
+	 * A client that maps the ring reads it there from now on, so it must not
+	 * spill, and must not have spilled. Just the control pages are fine.
+	 */
+	if (maps_ring(srv, vma))
+	{
+		if (READ_ONCE(cnt->spill.bytes))
+		{
+			rv = -EBUSY;
+			goto out;
+		}
+		cnt->mapped = 1;
+	}
+
+	// no mprotect(PROT_WRITE) later on either, and no mremap() growing it
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+	vm_flags_set(vma, VM_DONTEXPAND | (srv->order ? VM_HUGEPAGE : 0));
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_DONTEXPAND | (srv->order ? VM_HUGEPAGE : 0);
+#endif
+
+	vma->vm_private_data = srv;
+	vma->vm_ops = &kerneltalk_ctrl_vm_ops;
+	if (maps_ring(srv, vma))
+	{
+		// keep home_ring() and resize_ring() from swapping the ring from now on
+		vma->vm_ops = &kerneltalk_vm_ops;
+		atomic_inc(&srv->nr_maps);
+	}
+out:
+	mutex_unlock(&srv->map_lock);
+	return rv;
+}
+
+/*
+ * Fasync - add or remove the file from the SIGIO list (O_ASYNC via fcntl).
+ */
+static int kerneltalk_fasync(int fd, struct file *filp, int on)
+{
+	struct kerneltalk_client *cnt = filp->private_data;
+	int rv;
+
+	mutex_lock(&cnt->shard->notify_lock);
+	rv = fasync_helper(fd, filp, on, &cnt->fasync);
+	update_notify_list(cnt);
+	mutex_unlock(&cnt->shard->notify_lock);
+
+	return rv;
+}
+
+/*
+ * IN-KERNEL BENCHMARK
+ *
+ * Writing something like "producers=2 consumers=2 size=64 msecs=1000 cpus=0-3"
+ * to /sys/kernel/debug/kerneltalk/bench runs kthreads against a private
+ * channel, bound round-robin to the given CPUs. They go through
+ * channel_write() and channel_read() with kernel buffers, so the numbers show
+ * what the ring, the locking and the wakeups cost without the system call and
+ * user copies around them. Reading the file shows the last result.
+ */
+#define BENCH_MAX_THREADS 64
+
+struct bench_thread
+{
+	struct task_struct *task;
+	struct kerneltalk_client *cnt;
+	int producer;
+	unsigned int size;
+	u64 ops;
+	u64 bytes;
+	u64 cycles;
+};
+
+static struct dentry *kerneltalk_debugfs;
+static DEFINE_MUTEX(bench_lock); // one run at a time, protects bench_result
+static char bench_result[512];
+
+/*
+ * Producers write and then skip their own data, since every client is also a
+ * reader. They don't sleep for room: two producers waiting for each other to
+ * read would never wake up. Consumers sleep like read() does, but also wake
+ * for kthread_stop().
+ */
+static int bench_thread_fn(void *data)
+{
+	struct bench_thread *bt = data;
+	struct kerneltalk_client *cnt = bt->cnt;
+	struct kerneltalk_server *srv = cnt->server;
+	struct iov_iter iter;
+	struct kvec kv;
+	cycles_t start;
+	ssize_t rv;
+	char *buf;
+
+	buf = kzalloc(bt->size, GFP_KERNEL);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	start = get_cycles();
+	while (!kthread_should_stop())
+	{
+		kv.iov_base = buf;
+		kv.iov_len = bt->size;
+		if (bt->producer)
+		{
+			iov_iter_kvec(&iter, ITER_SOURCE, &kv, 1, bt->size);
+			rv = channel_write(cnt, &iter, 1);
+			buffer_down_read(srv);
+			advance(cnt, srv->head - cnt->cur.pos);
+			buffer_up_read(srv);
+			if (rv == -EAGAIN)
+				cond_resched();
+		}
+		else
+		{
+			iov_iter_kvec(&iter, ITER_DEST, &kv, 1, bt->size);
+			rv = channel_read(cnt, &iter, 1);
+			if (rv == -EAGAIN)
+				wait_event_interruptible(cnt->shard->rwq,
+										 READ_ONCE(cnt->cur.pos) != READ_ONCE(srv->head) ||
+											 kthread_should_stop());
+		}
+		if (rv > 0)
+		{
+			bt->ops++;
+			bt->bytes += rv;
+		}
+	}
+	bt->cycles = get_cycles() - start;
+
+	kfree(buf);
+	return SUCCESS;
+}
+
+static void bench_report(struct bench_thread *bt, unsigned int nr,
+						 unsigned int msecs, int producer, char *out,
+						 size_t len)
+{
+	u64 ops = 0, bytes = 0, cycles = 0;
+	unsigned int i;
+
+	for (i = 0; i < nr; i++)
+	{
+		if (bt[i].producer != producer)
+			continue;
+		ops += bt[i].ops;
+		bytes += bt[i].bytes;
+		cycles += bt[i].cycles;
+	}
+	scnprintf(out, len, "%s: %llu ops, %llu ops/s, %llu MiB/s, %llu cycles/op\n",
+			  producer ? "write" : "read", ops, div64_u64(ops * 1000, msecs),
+			  div64_u64(bytes * 1000, (u64)msecs << 20),
+			  ops ? div64_u64(cycles, ops) : 0);
 }
 
+static int bench_run(unsigned int producers, unsigned int consumers,
+					 unsigned int size, unsigned int msecs,
+					 const struct cpumask *cpus)
+{
+	unsigned int nr = producers + consumers;
+	struct kerneltalk_server *srv;
+	struct bench_thread *bt;
+	unsigned int i, cpu;
+	size_t used;
+	int rv = SUCCESS;
+
+	bt = kcalloc(nr, sizeof(*bt), GFP_KERNEL);
+	if (bt == NULL)
+		return -ENOMEM;
+
+	// nobody can open this one, no inode leads to it
+	mutex_lock(&server_list_lock);
+	srv = create_server(NULL);
+	mutex_unlock(&server_list_lock);
+	if (srv == NULL)
+	{
+		kfree(bt);
+		return -ENOMEM;
+	}
+
+	cpu = cpumask_first(cpus);
+	for (i = 0; i < nr; i++)
+	{
+		bt[i].producer = i < producers;
+		bt[i].size = size;
+		bt[i].cnt = create_client(NULL, srv);
+		if (bt[i].cnt == NULL)
+		{
+			rv = -ENOMEM;
+			goto out;
+		}
+		bt[i].task = kthread_create(bench_thread_fn, &bt[i], "kerneltalk_bench/%u", i);
+		if (IS_ERR(bt[i].task))
+		{
+			rv = PTR_ERR(bt[i].task);
+			bt[i].task = NULL;
+			goto out;
+		}
+		get_task_struct(bt[i].task);
+		kthread_bind(bt[i].task, cpu);
+		cpu = cpumask_next(cpu, cpus);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpus);
+	}
+
+	for (i = 0; i < nr; i++)
+		wake_up_process(bt[i].task);
+	msleep(msecs);
+
+out:
+	// producers first, so consumers aren't stopped with data still coming
+	for (i = 0; i < nr && bt[i].task; i++)
+	{
+		kthread_stop(bt[i].task);
+		put_task_struct(bt[i].task);
+	}
+
+	if (rv == SUCCESS)
+	{
+		used = scnprintf(bench_result, sizeof(bench_result),
+						 "producers=%u consumers=%u size=%u msecs=%u\n",
+						 producers, consumers, size, msecs);
+		bench_report(bt, nr, msecs, 1, bench_result + used,
+					 sizeof(bench_result) - used);
+		used = strlen(bench_result);
+		bench_report(bt, nr, msecs, 0, bench_result + used,
+					 sizeof(bench_result) - used);
+	}
+
+	// the last client takes the server with it
+	for (i = 0; i < nr && bt[i].cnt; i++)
+		destroy_client(bt[i].cnt);
+	if (bt[0].cnt == NULL)
+	{
+		mutex_lock(&server_list_lock);
+		check_free_server(srv);
+		mutex_unlock(&server_list_lock);
+	}
+
+	kfree(bt);
+	return rv;
+}
+
+static ssize_t bench_write(struct file *filp, const char __user *usrbuf,
+						   size_t len, loff_t *off)
+{
+	unsigned int producers = 1, consumers = 1, size = 64, msecs = 1000;
+	cpumask_var_t cpus;
+	char *args, *next, *arg, *val;
+	int rv = SUCCESS;
+
+	if (!zalloc_cpumask_var(&cpus, GFP_KERNEL))
+		return -ENOMEM;
+	cpumask_copy(cpus, cpu_online_mask);
+
+	args = memdup_user_nul(usrbuf, len);
+	if (IS_ERR(args))
+	{
+		free_cpumask_var(cpus);
+		return PTR_ERR(args);
+	}
+
+	next = args;
+	while (rv == SUCCESS && (arg = strsep(&next, " \t\n")))
+	{
+		if (*arg == '\0')
+			continue;
+		val = strchr(arg, '=');
+		if (val == NULL)
+		{
+			rv = -EINVAL;
+			break;
+		}
+		*val++ = '\0';
+		if (strcmp(arg, "producers") == 0)
+			rv = kstrtouint(val, 0, &producers);
+		else if (strcmp(arg, "consumers") == 0)
+			rv = kstrtouint(val, 0, &consumers);
+		else if (strcmp(arg, "size") == 0)
+			rv = kstrtouint(val, 0, &size);
+		else if (strcmp(arg, "msecs") == 0)
+			rv = kstrtouint(val, 0, &msecs);
+		else if (strcmp(arg, "cpus") == 0)
+			rv = cpulist_parse(val, cpus);
+		else
+			rv = -EINVAL;
+	}
+	kfree(args);
+
+	if (rv == SUCCESS &&
+		(producers < 1 || producers + consumers > BENCH_MAX_THREADS ||
+		 size < 1 || size > KERNELTALK_BUF || msecs < 1 || msecs > 60000 ||
+		 cpumask_empty(cpus) || !cpumask_subset(cpus, cpu_online_mask)))
+		rv = -EINVAL;
+
+	if (rv == SUCCESS)
+	{
+		mutex_lock(&bench_lock);
+		rv = bench_run(producers, consumers, size, msecs, cpus);
+		mutex_unlock(&bench_lock);
+	}
+
+	free_cpumask_var(cpus);
+	return rv ? rv : len;
+}
+
+static ssize_t bench_read(struct file *filp, char __user *usrbuf, size_t len,
+						  loff_t *off)
+{
+	ssize_t rv;
+
+	mutex_lock(&bench_lock);
+	rv = simple_read_from_buffer(usrbuf, len, off, bench_result,
+								 strlen(bench_result));
+	mutex_unlock(&bench_lock);
+	return rv;
+}
+
+static const struct file_operations bench_fops = {
+	.owner = THIS_MODULE,
+	.read = bench_read,
+	.write = bench_write,
+};
+
+/*
+ * CHANNEL STATISTICS
+ *
+ * /sys/kernel/debug/kerneltalk/channels lists every channel with its counters
+ * since it was created, one line each after a line naming the columns: the
+ * inode, clients, ring size, bytes the slowest reader has yet to read, then
+ * the fields of struct kerneltalk_stats, the autosizer's resizes and the bytes
+ * in clients' spills, the latency histogram last. Rates are for the reader to
+ * work out, see kerneltalk_stat.
+ */
+static int stats_show(struct seq_file *m, void *v)
+{
+	struct kerneltalk_server *srv;
+	struct kerneltalk_stats sum;
+	u64 unread;
+	int i;
+
+	seq_puts(m, "ino clients size unread msgs bytes reads read_bytes stalls stall_ns wakeups resizes spilled spill_unread");
+	for (i = 0; i < KERNELTALK_LAT_BUCKETS; i++)
+		seq_printf(m, " lat%d", i);
+	seq_putc(m, '\n');
+
+	mutex_lock(&server_list_lock);
+	list_for_each_entry(srv, &server_list, server_list)
+	{
+		// the benchmark's private channels
+		if (srv->inode == NULL)
+			continue;
+
+		stats_sum(srv, &sum);
+		spin_lock(&srv->heap_lock);
+		unread = srv->heap_len ? READ_ONCE(srv->head) - srv->heap[0]->pos : 0;
+		spin_unlock(&srv->heap_lock);
+
+		seq_printf(m, "%lu %u %u %llu %llu %llu %llu %llu %llu %llu %llu %u %llu %lld",
+				   srv->inode->i_ino, READ_ONCE(srv->nr_clients), READ_ONCE(srv->size),
+				   unread, sum.msgs, sum.bytes, sum.reads, sum.read_bytes, sum.stalls,
+				   sum.stall_ns, sum.wakeups, READ_ONCE(srv->resizes), sum.spilled,
+				   (long long)atomic64_read(&srv->spill_unread));
+		for (i = 0; i < KERNELTALK_LAT_BUCKETS; i++)
+			seq_printf(m, " %llu", sum.lat[i]);
+		seq_putc(m, '\n');
+	}
+	mutex_unlock(&server_list_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
 /*
  * Module initialization and exit routines.
  */
 static int __init init_kerneltalk(void)
 {
+	// unbound, so the fan-out runs on an idle CPU rather than the writer's
+	kerneltalk_wq = alloc_workqueue("kerneltalk", WQ_UNBOUND | WQ_HIGHPRI, 0);
+	if (!kerneltalk_wq)
+		return -ENOMEM;
+
 	major = register_chrdev(0, DEVICE_NAME, &kerneltalk_fops);
 	if (major < 0)
 	{
 		printk(KERN_ALERT "Registering char device failed with %d\n",
 			   major);
+		destroy_workqueue(kerneltalk_wq);
 		return major;
 	}
 
+	// no debugfs is no reason to fail, the benchmark and statistics just won't be there
+	kerneltalk_debugfs = debugfs_create_dir("kerneltalk", NULL);
+	debugfs_create_file("bench", 0600, kerneltalk_debugfs, NULL, &bench_fops);
+	debugfs_create_file("channels", 0400, kerneltalk_debugfs, NULL, &stats_fops);
+
 	printk(KERN_INFO "kerneltalk v%d.%d -- assigned major number %d\n",
 		   KERNELTALK_VMAJOR, KERNELTALK_VMINOR, major);
 	printk(KERN_INFO "'mknod /dev/kerneltalk c %d 0' to make chat file!\n", major);
@@ -471,12 +3464,14 @@ static int __init init_kerneltalk(void)
 
 static void __exit exit_kerneltalk(void)
 {
+	debugfs_remove_recursive(kerneltalk_debugfs);
 	unregister_chrdev(major, DEVICE_NAME);
 	if (!list_empty(&server_list))
 	{
 		printk(KERN_ALERT "Uh-oh: kerneltalk module unloaded without "
 						  "all files being closed!\n");
 	}
+	destroy_workqueue(kerneltalk_wq);
 }
 
 module_init(init_kerneltalk);
@@ -0,0 +1,264 @@
+/*
+ * KernelTalk: kernel based chat
+ *
+ * The ring and cursor arithmetic of a channel, shared between the kernel
+ * module and user-space programs. Nothing in here locks, allocates, sleeps or
+ * copies data, so the same code the module runs can be exercised in user space
+ * (see the ring mode of kerneltalk_bench). The caller provides the locking.
+ */
+
+#ifndef KERNELTALK_RING_H
+#define KERNELTALK_RING_H
+
+#include <linux/types.h>
+
+/*
+ * Record descriptors per channel, a power of two: one per KT_REC_BYTES of
+ * ring, within bounds. See kt_nr_recs().
+ */
+#define KT_REC_BYTES 64
+#define KT_RECS_MIN 256
+#define KT_RECS_MAX 65536
+
+/*
+ * Positions are byte counts since the channel was created, so they only ever
+ * grow. The index into the ring is the position modulo its size, which is a
+ * power of two.
+ */
+static inline __u32 kt_idx(__u32 size, __u64 pos)
+{
+	return pos & (size - 1);
+}
+
+/*
+ * How much of len bytes starting at pos fits before the end of the ring; the
+ * rest wraps around to the start.
+ */
+static inline __u32 kt_first(__u32 size, __u64 pos, __u32 len)
+{
+	__u32 left = size - kt_idx(size, pos);
+
+	return len < left ? len : left;
+}
+
+/*
+ * Every write commits one record. Record numbers only grow too, and index a
+ * ring of nr descriptors. A write() that finds that ring full extends the
+ * newest record instead, see kt_cursors_rewind().
+ */
+struct kt_rec
+{
+	__u64 pos;	 /* position of the first byte */
+	__u32 len;
+	__s32 pid;	 /* writer's tgid */
+	__u64 stamp; /* commit time in ns */
+};
+
+/*
+ * How many descriptors a ring of size bytes gets. Both are powers of two, so
+ * this is one too.
+ */
+static inline __u32 kt_nr_recs(__u32 size)
+{
+	__u32 nr = size / KT_REC_BYTES;
+
+	return nr < KT_RECS_MIN ? KT_RECS_MIN : nr > KT_RECS_MAX ? KT_RECS_MAX : nr;
+}
+
+static inline struct kt_rec *kt_rec(struct kt_rec *recs, __u32 nr, __u64 n)
+{
+	return &recs[n & (nr - 1)];
+}
+
+static inline __u64 kt_rec_end(struct kt_rec *recs, __u32 nr, __u64 n)
+{
+	return kt_rec(recs, nr, n)->pos + kt_rec(recs, nr, n)->len;
+}
+
+/*
+ * Find the first record in [lo, hi) that ends after pos, or hi if there is
+ * none. Records are contiguous, so this is a binary search no matter how far
+ * pos is from lo.
+ */
+static inline __u64 kt_rec_find(struct kt_rec *recs, __u32 nr, __u64 lo,
+								__u64 hi, __u64 pos)
+{
+	__u64 mid;
+
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (kt_rec_end(recs, nr, mid) <= pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * A reader's place in the channel.
+ */
+struct kt_cursor
+{
+	__u64 pos;			   /* position of the next byte to read */
+	__u64 rec;			   /* record containing pos, rec_head when caught up */
+	unsigned int heap_idx; /* slot in the channel's heap */
+};
+
+/*
+ * How many bytes a writer may put at head. Everything from the slowest
+ * cursor (tail, NULL without readers) up to head is still needed by somebody,
+ * the rest of the ring is free.
+ */
+static inline __u32 kt_room_bytes(__u32 size, __u64 head,
+								  const struct kt_cursor *tail)
+{
+	if (tail == NULL)
+		return size;
+	return size - (head - tail->pos);
+}
+
+/*
+ * Whether the slowest reader is so far behind that all nr descriptors are in
+ * use, so no new record can be committed.
+ */
+static inline int kt_recs_full(__u32 nr, __u64 rec_head,
+							   const struct kt_cursor *tail)
+{
+	return tail != NULL && rec_head - tail->rec >= nr;
+}
+
+/*
+ * How many bytes a new record may have: none at all if the descriptors are
+ * used up, see kt_recs_full().
+ */
+static inline __u32 kt_room(__u32 size, __u32 nr, __u64 head, __u64 rec_head,
+							const struct kt_cursor *tail)
+{
+	if (kt_recs_full(nr, rec_head, tail))
+		return 0;
+	return kt_room_bytes(size, head, tail);
+}
+
+/*
+ * Min-heap of cursors keyed on their position, so the slowest reader is
+ * always heap[0]. The caller owns the array and makes sure it has room.
+ */
+static inline void kt_heap_swap(struct kt_cursor **heap, unsigned int a,
+								unsigned int b)
+{
+	struct kt_cursor *tmp = heap[a];
+
+	heap[a] = heap[b];
+	heap[b] = tmp;
+	heap[a]->heap_idx = a;
+	heap[b]->heap_idx = b;
+}
+
+static inline void kt_heap_up(struct kt_cursor **heap, unsigned int i)
+{
+	unsigned int parent;
+
+	while (i > 0)
+	{
+		parent = (i - 1) / 2;
+		if (heap[parent]->pos <= heap[i]->pos)
+			break;
+		kt_heap_swap(heap, i, parent);
+		i = parent;
+	}
+}
+
+static inline void kt_heap_down(struct kt_cursor **heap, unsigned int len,
+								unsigned int i)
+{
+	unsigned int child, min;
+
+	for (;;)
+	{
+		min = i;
+		child = 2 * i + 1;
+		if (child < len && heap[child]->pos < heap[min]->pos)
+			min = child;
+		child++;
+		if (child < len && heap[child]->pos < heap[min]->pos)
+			min = child;
+		if (min == i)
+			break;
+		kt_heap_swap(heap, i, min);
+		i = min;
+	}
+}
+
+static inline void kt_heap_add(struct kt_cursor **heap, unsigned int *len,
+							   struct kt_cursor *cur)
+{
+	cur->heap_idx = (*len)++;
+	heap[cur->heap_idx] = cur;
+	kt_heap_up(heap, cur->heap_idx);
+}
+
+static inline void kt_heap_remove(struct kt_cursor **heap, unsigned int *len,
+								  struct kt_cursor *cur)
+{
+	unsigned int i = cur->heap_idx;
+
+	(*len)--;
+	if (i != *len)
+	{
+		kt_heap_swap(heap, i, *len);
+		kt_heap_down(heap, *len, i);
+		kt_heap_up(heap, i);
+	}
+}
+
+/*
+ * Move a cursor forward to pos, which lies in record rec (see kt_rec_find()).
+ * Returns how far the tail of the heap moved, which is the room made for
+ * writers; only the slowest reader can make any.
+ */
+static inline __u64 kt_cursor_move(struct kt_cursor **heap, unsigned int len,
+								   struct kt_cursor *cur, __u64 pos, __u64 rec)
+{
+	__u64 tail = heap[0]->pos;
+
+	cur->pos = pos;
+	cur->rec = rec;
+	kt_heap_down(heap, len, cur->heap_idx);
+	return heap[0]->pos - tail;
+}
+
+/*
+ * Where a cursor lands after skipping count whole records: the start of the
+ * record count after its own, or head if there aren't that many. Skipping
+ * none must not rewind a record the cursor is partway through.
+ */
+static inline __u64 kt_skip_target(struct kt_rec *recs, __u32 nr, __u64 head,
+								   __u64 rec_head, const struct kt_cursor *cur,
+								   __u64 count)
+{
+	__u64 pos;
+
+	if (count >= rec_head - cur->rec)
+		return head;
+	pos = kt_rec(recs, nr, cur->rec + count)->pos;
+	return pos > cur->pos ? pos : cur->pos;
+}
+
+/*
+ * The newest record, rec_head - 1, grew at the end. Cursors that had read all
+ * of it, and so were at rec_head, are inside it again. Their positions don't
+ * change, so neither does the heap.
+ */
+static inline void kt_cursors_rewind(struct kt_cursor **heap, unsigned int len,
+									 __u64 rec_head)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+		if (heap[i]->rec == rec_head)
+			heap[i]->rec = rec_head - 1;
+}
+
+#endif /* KERNELTALK_RING_H */
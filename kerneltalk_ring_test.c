@@ -0,0 +1,206 @@
+/*
+ * KernelTalk: kernel based chat
+ *
+ * KUnit tests for the ring and cursor arithmetic in kerneltalk_ring.h. Build
+ * with "make kunit" against a kernel with CONFIG_KUNIT; loading
+ * kerneltalk_ring_test.ko runs the suite and logs the results.
+ */
+
+#include <kunit/test.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+
+#include "kerneltalk_ring.h"
+
+#define TEST_SIZE 4096
+#define TEST_RECS 256
+#define TEST_CURSORS 32
+
+/*
+ * Records 0 to count - 1 of len bytes each, from position 0. The descriptor
+ * ring keeps the newest TEST_RECS of them. Too big for the stack.
+ */
+static struct kt_rec *test_recs(struct kunit *test, __u64 count, __u32 len)
+{
+	struct kt_rec *recs;
+	__u64 n;
+
+	recs = kunit_kcalloc(test, TEST_RECS, sizeof(*recs), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, recs);
+	for (n = 0; n < count; n++)
+	{
+		kt_rec(recs, TEST_RECS, n)->pos = n * len;
+		kt_rec(recs, TEST_RECS, n)->len = len;
+	}
+	return recs;
+}
+
+/*
+ * Every parent sorts before its children and knows its slot.
+ */
+static void expect_heap(struct kunit *test, struct kt_cursor **heap,
+						unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+	{
+		KUNIT_EXPECT_EQ(test, heap[i]->heap_idx, i);
+		if (i > 0)
+			KUNIT_EXPECT_LE(test, heap[(i - 1) / 2]->pos, heap[i]->pos);
+	}
+}
+
+static void kt_nr_recs_test(struct kunit *test)
+{
+	KUNIT_EXPECT_EQ(test, kt_nr_recs(4096), (__u32)KT_RECS_MIN);
+	KUNIT_EXPECT_EQ(test, kt_nr_recs(1 << 20), (__u32)((1 << 20) / KT_REC_BYTES));
+	KUNIT_EXPECT_EQ(test, kt_nr_recs(1U << 31), (__u32)KT_RECS_MAX);
+}
+
+static void kt_room_test(struct kunit *test)
+{
+	struct kt_cursor tail = {.pos = 1000, .rec = 10};
+
+	// nobody reading, everything is free
+	KUNIT_EXPECT_EQ(test, kt_room_bytes(TEST_SIZE, 5000, NULL), (__u32)TEST_SIZE);
+	KUNIT_EXPECT_EQ(test, kt_room(TEST_SIZE, TEST_RECS, 5000, 20, NULL), (__u32)TEST_SIZE);
+
+	KUNIT_EXPECT_EQ(test, kt_room_bytes(TEST_SIZE, 1000, &tail), (__u32)TEST_SIZE);
+	KUNIT_EXPECT_EQ(test, kt_room_bytes(TEST_SIZE, 3000, &tail), (__u32)(TEST_SIZE - 2000));
+	KUNIT_EXPECT_EQ(test, kt_room_bytes(TEST_SIZE, 1000 + TEST_SIZE, &tail), (__u32)0);
+	KUNIT_EXPECT_EQ(test, kt_room(TEST_SIZE, TEST_RECS, 3000, 20, &tail),
+					(__u32)(TEST_SIZE - 2000));
+
+	// descriptors used up: no new record, but the bytes are still there
+	KUNIT_EXPECT_FALSE(test, kt_recs_full(TEST_RECS, 10 + TEST_RECS - 1, &tail));
+	KUNIT_EXPECT_TRUE(test, kt_recs_full(TEST_RECS, 10 + TEST_RECS, &tail));
+	KUNIT_EXPECT_EQ(test, kt_room(TEST_SIZE, TEST_RECS, 3000, 10 + TEST_RECS, &tail),
+					(__u32)0);
+	KUNIT_EXPECT_EQ(test, kt_room_bytes(TEST_SIZE, 3000, &tail), (__u32)(TEST_SIZE - 2000));
+}
+
+static void kt_rec_find_test(struct kunit *test)
+{
+	// 300 records of 10 bytes wrap the descriptor ring; look in the last 256
+	struct kt_rec *recs = test_recs(test, 300, 10);
+
+	KUNIT_EXPECT_EQ(test, kt_rec_find(recs, TEST_RECS, 44, 300, 440), (__u64)44);
+	KUNIT_EXPECT_EQ(test, kt_rec_find(recs, TEST_RECS, 44, 300, 449), (__u64)44);
+	KUNIT_EXPECT_EQ(test, kt_rec_find(recs, TEST_RECS, 44, 300, 450), (__u64)45);
+	KUNIT_EXPECT_EQ(test, kt_rec_find(recs, TEST_RECS, 44, 300, 2995), (__u64)299);
+	KUNIT_EXPECT_EQ(test, kt_rec_find(recs, TEST_RECS, 44, 300, 3000), (__u64)300);
+}
+
+static void kt_heap_order_test(struct kunit *test)
+{
+	struct kt_cursor cur[TEST_CURSORS];
+	struct kt_cursor *heap[TEST_CURSORS];
+	struct kt_cursor *top;
+	unsigned int len = 0, i;
+
+	// positions in a scrambled order, some of them equal
+	for (i = 0; i < TEST_CURSORS; i++)
+	{
+		cur[i].pos = (i * 37) % 23;
+		cur[i].rec = cur[i].pos;
+		kt_heap_add(heap, &len, &cur[i]);
+		expect_heap(test, heap, len);
+	}
+	KUNIT_EXPECT_EQ(test, heap[0]->pos, (__u64)0);
+
+	// drop every third, including whatever sits at the top
+	for (i = 0; i < TEST_CURSORS; i += 3)
+	{
+		kt_heap_remove(heap, &len, &cur[i]);
+		expect_heap(test, heap, len);
+	}
+
+	// drain it in order
+	while (len > 0)
+	{
+		top = heap[0];
+		for (i = 1; i < len; i++)
+			KUNIT_EXPECT_LE(test, top->pos, heap[i]->pos);
+		kt_heap_remove(heap, &len, top);
+		expect_heap(test, heap, len);
+	}
+}
+
+static void kt_cursor_move_test(struct kunit *test)
+{
+	struct kt_cursor cur[3] = {{.pos = 100}, {.pos = 200}, {.pos = 300}};
+	struct kt_cursor *heap[3];
+	unsigned int len = 0, i;
+
+	for (i = 0; i < 3; i++)
+		kt_heap_add(heap, &len, &cur[i]);
+
+	// only the slowest reader makes room, and only up to the next slowest
+	KUNIT_EXPECT_EQ(test, kt_cursor_move(heap, len, &cur[1], 250, 25), (__u64)0);
+	KUNIT_EXPECT_EQ(test, cur[1].rec, (__u64)25);
+	KUNIT_EXPECT_EQ(test, kt_cursor_move(heap, len, &cur[0], 400, 40), (__u64)150);
+	KUNIT_EXPECT_PTR_EQ(test, heap[0], &cur[1]);
+	KUNIT_EXPECT_EQ(test, kt_cursor_move(heap, len, &cur[1], 350, 35), (__u64)50);
+	KUNIT_EXPECT_PTR_EQ(test, heap[0], &cur[2]);
+	// standing still makes nothing
+	KUNIT_EXPECT_EQ(test, kt_cursor_move(heap, len, &cur[2], 300, 30), (__u64)0);
+	expect_heap(test, heap, len);
+}
+
+static void kt_skip_target_test(struct kunit *test)
+{
+	// records 0..19 of 10 bytes, the cursor halfway into record 10
+	struct kt_rec *recs = test_recs(test, 20, 10);
+	struct kt_cursor cur = {.pos = 105, .rec = 10};
+
+	// skipping no records stays put instead of rewinding to 100
+	KUNIT_EXPECT_EQ(test, kt_skip_target(recs, TEST_RECS, 200, 20, &cur, 0), (__u64)105);
+	KUNIT_EXPECT_EQ(test, kt_skip_target(recs, TEST_RECS, 200, 20, &cur, 1), (__u64)110);
+	KUNIT_EXPECT_EQ(test, kt_skip_target(recs, TEST_RECS, 200, 20, &cur, 9), (__u64)190);
+	KUNIT_EXPECT_EQ(test, kt_skip_target(recs, TEST_RECS, 200, 20, &cur, 10), (__u64)200);
+	KUNIT_EXPECT_EQ(test, kt_skip_target(recs, TEST_RECS, 200, 20, &cur, ~0ULL), (__u64)200);
+
+	// at a record boundary skipping none is a no-op too
+	cur.pos = 100;
+	KUNIT_EXPECT_EQ(test, kt_skip_target(recs, TEST_RECS, 200, 20, &cur, 0), (__u64)100);
+}
+
+static void kt_cursors_rewind_test(struct kunit *test)
+{
+	struct kt_cursor cur[3] = {{.pos = 100, .rec = 10}, {.pos = 200, .rec = 20},
+							   {.pos = 200, .rec = 20}};
+	struct kt_cursor *heap[3];
+	unsigned int len = 0, i;
+
+	for (i = 0; i < 3; i++)
+		kt_heap_add(heap, &len, &cur[i]);
+
+	// record 19 grew: the caught-up readers are back inside it
+	kt_cursors_rewind(heap, len, 20);
+	KUNIT_EXPECT_EQ(test, cur[0].rec, (__u64)10);
+	KUNIT_EXPECT_EQ(test, cur[1].rec, (__u64)19);
+	KUNIT_EXPECT_EQ(test, cur[2].rec, (__u64)19);
+	expect_heap(test, heap, len);
+}
+
+static struct kunit_case kt_ring_test_cases[] = {
+	KUNIT_CASE(kt_nr_recs_test),
+	KUNIT_CASE(kt_room_test),
+	KUNIT_CASE(kt_rec_find_test),
+	KUNIT_CASE(kt_heap_order_test),
+	KUNIT_CASE(kt_cursor_move_test),
+	KUNIT_CASE(kt_skip_target_test),
+	KUNIT_CASE(kt_cursors_rewind_test),
+	{}
+};
+
+static struct kunit_suite kt_ring_test_suite = {
+	.name = "kerneltalk_ring",
+	.test_cases = kt_ring_test_cases,
+};
+
+kunit_test_suite(kt_ring_test_suite);
+
+MODULE_DESCRIPTION("KUnit tests for the KernelTalk ring arithmetic.");
+MODULE_LICENSE("GPL");
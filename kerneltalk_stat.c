@@ -0,0 +1,374 @@
+/*
+ * KernelTalk: kernel based chat
+ *
+ * Watch the module's channels, in the manner of vmstat and iostat.
+ *
+ *   kerneltalk_stat [-i SECONDS] [-c COUNT] [-n TOP] [-j] [-f FILE] [-d DIR]
+ *
+ * Every SECONDS (1) the channel statistics are read again and the busiest TOP
+ * channels (10, 0 for all) are printed with their rates over the interval:
+ * messages and bytes written per second, the time writers spent waiting for
+ * room (as a share of the interval, so several writers can add up to more
+ * than 100%), the bytes the slowest reader has yet to read and how full that
+ * leaves the ring, reader wakeups per second and percentiles of the time from
+ * commit to read. Percentiles come from a histogram by powers of two, so they
+ * are upper bounds within a factor of two.
+ *
+ * With -j every channel of every interval is one JSON object on a line of its
+ * own, for feeding a metrics pipeline. COUNT stops after that many intervals.
+ *
+ * The statistics are read from FILE, /sys/kernel/debug/kerneltalk/channels
+ * by default, which needs root. Channels are named after the device files in
+ * DIR (/dev) that lead to them.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#define STATS_FILE "/sys/kernel/debug/kerneltalk/channels"
+#define MAX_CHANNELS 4096
+#define LAT_BUCKETS 64 // more than the module has, in case it grows
+#define MAX_COLUMNS 256
+
+/*
+ * The counters of one channel, as the module lists them.
+ */
+enum
+{
+    F_INO,
+    F_CLIENTS,
+    F_SIZE,
+    F_UNREAD,
+    F_MSGS,
+    F_BYTES,
+    F_READS,
+    F_READ_BYTES,
+    F_STALLS,
+    F_STALL_NS,
+    F_WAKEUPS,
+    F_SPILLED,
+    F_SPILL_UNREAD,
+    F_COUNT
+};
+
+const char *field_names[F_COUNT] = {
+    "ino",   "clients",    "size",   "unread",   "msgs",    "bytes",
+    "reads", "read_bytes", "stalls", "stall_ns", "wakeups", "spilled", "spill_unread",
+};
+
+struct sample
+{
+    unsigned long long f[F_COUNT];
+    unsigned long long lat[LAT_BUCKETS];
+};
+
+/*
+ * What is printed for a channel over one interval.
+ */
+struct row
+{
+    const struct sample *cur;
+    char name[256];
+    double msgs, bytes, reads, stall_pct, stalls, wakeups, occupancy, spilled;
+    double p50, p99, p999; // microseconds, 0 without reads
+};
+
+void die(const char *what)
+{
+    perror(what);
+    exit(EXIT_FAILURE);
+}
+
+double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Read every channel's counters. Columns are matched by name, so columns the
+ * module adds later are skipped and missing ones read as 0.
+ */
+int read_samples(const char *path, struct sample *out, int max)
+{
+    int cols[MAX_COLUMNS];
+    char *line = NULL, *tok, *save;
+    size_t cap = 0;
+    int ncols = 0, n = 0, i, c;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f)
+        die(path);
+    if (getline(&line, &cap, f) < 0)
+    {
+        fprintf(stderr, "kerneltalk_stat: %s: empty\n", path);
+        exit(EXIT_FAILURE);
+    }
+    for (tok = strtok_r(line, " \n", &save); tok && ncols < MAX_COLUMNS;
+         tok = strtok_r(NULL, " \n", &save))
+    {
+        cols[ncols] = -1;
+        for (i = 0; i < F_COUNT; i++)
+            if (strcmp(tok, field_names[i]) == 0)
+                cols[ncols] = i;
+        if (strncmp(tok, "lat", 3) == 0 && sscanf(tok + 3, "%d", &i) == 1 && i >= 0 &&
+            i < LAT_BUCKETS)
+            cols[ncols] = F_COUNT + i;
+        ncols++;
+    }
+
+    while (n < max && getline(&line, &cap, f) > 0)
+    {
+        memset(&out[n], 0, sizeof(out[n]));
+        c = 0;
+        for (tok = strtok_r(line, " \n", &save); tok && c < ncols;
+             tok = strtok_r(NULL, " \n", &save), c++)
+        {
+            if (cols[c] < 0)
+                continue;
+            if (cols[c] < F_COUNT)
+                out[n].f[cols[c]] = strtoull(tok, NULL, 10);
+            else
+                out[n].lat[cols[c] - F_COUNT] = strtoull(tok, NULL, 10);
+        }
+        n++;
+    }
+    free(line);
+    fclose(f);
+    return n;
+}
+
+/*
+ * The module's major number, to tell its device files apart.
+ */
+int kerneltalk_major(void)
+{
+    char line[256], name[64];
+    int major = -1, m;
+    FILE *f;
+
+    f = fopen("/proc/devices", "r");
+    if (!f)
+        return -1;
+    // character devices come first, the module registers no block device
+    while (major < 0 && fgets(line, sizeof(line), f))
+        if (sscanf(line, "%d %63s", &m, name) == 2 && strcmp(name, "kerneltalk") == 0)
+            major = m;
+    fclose(f);
+    return major;
+}
+
+/*
+ * The device file in dir for a channel's inode, or its inode number.
+ */
+void channel_name(const char *dir, int major, unsigned long long ino, char *out, size_t len)
+{
+    char path[4096];
+    struct dirent *de;
+    struct stat st;
+    DIR *d;
+
+    snprintf(out, len, "ino:%llu", ino);
+    d = opendir(dir);
+    if (!d)
+        return;
+    while ((de = readdir(d)))
+    {
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (stat(path, &st) == 0 && S_ISCHR(st.st_mode) && st.st_ino == ino &&
+            (major < 0 || (int)major(st.st_rdev) == major))
+        {
+            snprintf(out, len, "%s", path);
+            break;
+        }
+    }
+    closedir(d);
+}
+
+/*
+ * The upper bound in microseconds of the bucket the p-th percentile of the
+ * latency histogram falls in.
+ */
+double lat_percentile(const unsigned long long *hist, unsigned long long total, double p)
+{
+    unsigned long long seen = 0, want = (unsigned long long)(total * p / 100.0);
+    int b;
+
+    for (b = 0; b < LAT_BUCKETS; b++)
+    {
+        seen += hist[b];
+        if (seen > want)
+            return (double)(1ULL << b) / 1000.0;
+    }
+    return (double)(1ULL << (LAT_BUCKETS - 1)) / 1000.0;
+}
+
+/*
+ * Rates of a channel from two samples secs apart. A channel that is new, or
+ * whose inode was reused by a new one, counts from zero.
+ */
+void make_row(struct row *r, const struct sample *cur, const struct sample *prev, double secs)
+{
+    static const struct sample zero;
+    unsigned long long hist[LAT_BUCKETS], total = 0;
+    int b;
+
+    if (!prev || prev->f[F_MSGS] > cur->f[F_MSGS] || prev->f[F_READS] > cur->f[F_READS])
+        prev = &zero;
+    r->cur = cur;
+    r->msgs = (cur->f[F_MSGS] - prev->f[F_MSGS]) / secs;
+    r->bytes = (cur->f[F_BYTES] - prev->f[F_BYTES]) / secs;
+    r->reads = (cur->f[F_READS] - prev->f[F_READS]) / secs;
+    r->stalls = (cur->f[F_STALLS] - prev->f[F_STALLS]) / secs;
+    r->stall_pct = (cur->f[F_STALL_NS] - prev->f[F_STALL_NS]) / (secs * 1e9) * 100;
+    r->wakeups = (cur->f[F_WAKEUPS] - prev->f[F_WAKEUPS]) / secs;
+    r->spilled = (cur->f[F_SPILLED] - prev->f[F_SPILLED]) / secs;
+    r->occupancy = cur->f[F_SIZE] ? 100.0 * cur->f[F_UNREAD] / cur->f[F_SIZE] : 0;
+    for (b = 0; b < LAT_BUCKETS; b++)
+    {
+        hist[b] = cur->lat[b] - prev->lat[b];
+        total += hist[b];
+    }
+    r->p50 = total ? lat_percentile(hist, total, 50) : 0;
+    r->p99 = total ? lat_percentile(hist, total, 99) : 0;
+    r->p999 = total ? lat_percentile(hist, total, 99.9) : 0;
+}
+
+int cmp_rows(const void *a, const void *b)
+{
+    const struct row *x = a, *y = b;
+
+    if (x->msgs != y->msgs)
+        return x->msgs < y->msgs ? 1 : -1;
+    return x->bytes < y->bytes ? 1 : x->bytes > y->bytes ? -1 : 0;
+}
+
+void print_table(const struct row *rows, int n, int total)
+{
+    char stamp[32];
+    time_t t = time(NULL);
+    int i;
+
+    strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime(&t));
+    printf("%s  %d channel%s\n", stamp, total, total == 1 ? "" : "s");
+    printf("%-24s %7s %10s %9s %7s %10s %6s %11s %9s %9s %9s\n", "CHANNEL", "CLIENTS", "MSGS/S",
+           "MIB/S", "STALL%", "UNREAD", "OCC%", "SPILL_MIB/S", "WAKEUPS/S", "P50_US", "P99_US");
+    for (i = 0; i < n; i++)
+        printf("%-24s %7llu %10.0f %9.2f %7.1f %10llu %6.1f %11.2f %9.0f %9.1f %9.1f\n",
+               rows[i].name, rows[i].cur->f[F_CLIENTS], rows[i].msgs, rows[i].bytes / (1 << 20),
+               rows[i].stall_pct, rows[i].cur->f[F_UNREAD], rows[i].occupancy,
+               rows[i].spilled / (1 << 20), rows[i].wakeups, rows[i].p50, rows[i].p99);
+    printf("\n");
+}
+
+void print_json(const struct row *rows, int n)
+{
+    struct timespec ts;
+    int i;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    for (i = 0; i < n; i++)
+        printf("{\"time\":%ld.%03ld,\"channel\":\"%s\",\"ino\":%llu,\"clients\":%llu,"
+               "\"ring_size\":%llu,\"unread_bytes\":%llu,\"occupancy_pct\":%.1f,"
+               "\"msgs_per_s\":%.1f,\"bytes_per_s\":%.1f,\"reads_per_s\":%.1f,"
+               "\"stalls_per_s\":%.1f,\"stall_pct\":%.2f,\"wakeups_per_s\":%.1f,"
+               "\"spilled_bytes_per_s\":%.1f,\"spill_unread_bytes\":%llu,"
+               "\"latency_p50_us\":%.3f,\"latency_p99_us\":%.3f,\"latency_p999_us\":%.3f}\n",
+               (long)ts.tv_sec, ts.tv_nsec / 1000000, rows[i].name, rows[i].cur->f[F_INO],
+               rows[i].cur->f[F_CLIENTS], rows[i].cur->f[F_SIZE], rows[i].cur->f[F_UNREAD],
+               rows[i].occupancy, rows[i].msgs, rows[i].bytes, rows[i].reads, rows[i].stalls,
+               rows[i].stall_pct, rows[i].wakeups, rows[i].spilled, rows[i].cur->f[F_SPILL_UNREAD],
+               rows[i].p50, rows[i].p99, rows[i].p999);
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = STATS_FILE, *dir = "/dev";
+    struct sample *cur, *prev, *tmp;
+    struct row *rows;
+    double interval = 1, t_prev, t_cur;
+    int opt, count = 0, top = 10, json = 0, major, ncur, nprev, shown, i, j, done = 0;
+
+    while ((opt = getopt(argc, argv, "i:c:n:jf:d:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            interval = atof(optarg);
+            break;
+        case 'c':
+            count = atoi(optarg);
+            break;
+        case 'n':
+            top = atoi(optarg);
+            break;
+        case 'j':
+            json = 1;
+            break;
+        case 'f':
+            path = optarg;
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind != argc || interval <= 0 || count < 0 || top < 0)
+        goto usage;
+
+    cur = calloc(MAX_CHANNELS, sizeof(*cur));
+    prev = calloc(MAX_CHANNELS, sizeof(*prev));
+    rows = calloc(MAX_CHANNELS, sizeof(*rows));
+    if (!cur || !prev || !rows)
+        die("kerneltalk_stat");
+    major = kerneltalk_major();
+
+    // counters run from the channel's creation, rates need a first sample
+    nprev = read_samples(path, prev, MAX_CHANNELS);
+    t_prev = now_s();
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    while (!count || done < count)
+    {
+        usleep((useconds_t)(interval * 1e6));
+        ncur = read_samples(path, cur, MAX_CHANNELS);
+        t_cur = now_s();
+
+        for (i = 0; i < ncur; i++)
+        {
+            for (j = 0; j < nprev && prev[j].f[F_INO] != cur[i].f[F_INO]; j++)
+                ;
+            make_row(&rows[i], &cur[i], j < nprev ? &prev[j] : NULL, t_cur - t_prev);
+        }
+        qsort(rows, ncur, sizeof(*rows), cmp_rows);
+        shown = top && top < ncur ? top : ncur;
+        for (i = 0; i < shown; i++)
+            channel_name(dir, major, rows[i].cur->f[F_INO], rows[i].name, sizeof(rows[i].name));
+        if (json)
+            print_json(rows, shown);
+        else
+            print_table(rows, shown, ncur);
+
+        tmp = prev, prev = cur, cur = tmp;
+        nprev = ncur;
+        t_prev = t_cur;
+        done++;
+    }
+    return EXIT_SUCCESS;
+
+usage:
+    fprintf(stderr, "usage: %s [-i SECONDS] [-c COUNT] [-n TOP] [-j] [-f FILE] [-d DIR]\n",
+            argv[0]);
+    return EXIT_FAILURE;
+}
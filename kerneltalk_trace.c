@@ -0,0 +1,596 @@
+/*
+ * KernelTalk: kernel based chat
+ *
+ * Capture the traffic of a channel and replay it.
+ *
+ *   kerneltalk_trace capture [-d SECONDS] [-n COUNT] [-s SIZE] FILENAME OUTPUT
+ *
+ * capture subscribes to the channel and writes every message to OUTPUT with
+ * the time it arrived, its writer's pid and the module's commit stamp, until
+ * SECONDS or COUNT run out or it is interrupted. Messages longer than SIZE
+ * (64 KiB) are cut short and flagged.
+ *
+ *   kerneltalk_trace replay [-x SPEED] [-w WRITERS] FILENAME CAPTURE
+ *
+ * replay sends the captured messages again, spread over WRITERS processes:
+ * the messages of one original writer all go to the same process, in order.
+ * Each is sent when it arrived in the capture, SPEED times faster (1 is the
+ * original pace, 0 as fast as possible). Meanwhile a reader receives the
+ * channel. Reported are the rate achieved, how late the writers were against
+ * the schedule and the delivery latency from commit to receipt.
+ *
+ *   kerneltalk_trace info CAPTURE
+ *
+ * info prints what a capture holds.
+ *
+ * FILENAME is anything libkerneltalk opens, a device or a shm: channel.
+ *
+ * A capture is a header followed by records, each a struct trace_rec and the
+ * message, padded to 8 bytes, so it can be mapped and walked in place. The
+ * header's count is only filled in when the capture ends cleanly; otherwise
+ * readers walk up to the end of the file.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "kerneltalk.h"
+#include "libkerneltalk.h"
+
+#define TRACE_MAGIC "KTTRACE1"
+#define BATCH 64
+#define OUT_BUF (1 << 20)     // bytes buffered before a write to the capture
+#define SAMPLES (1 << 16)     // latency samples kept per process
+#define MAX_WRITERS 64
+#define MAX_PIDS 1024 // writers told apart by info
+#define DRAIN_IDLE_NS 1000000000LL // the reader gives up this long after the writers
+
+struct trace_header
+{
+    char magic[8];
+    uint64_t count;    // records, 0 if the capture didn't end cleanly
+    uint64_t start_ns; // CLOCK_MONOTONIC of the capture's start
+    uint64_t end_ns;
+};
+
+struct trace_rec
+{
+    uint64_t arrival_ns; // since start_ns
+    uint64_t seq;
+    uint64_t stamp_ns; // commit time, 0 when the channel didn't say
+    int32_t pid;       // writer, 0 when the channel didn't say
+    uint32_t len;
+    uint32_t flags; // KERNELTALK_MSG_*
+    uint32_t pad;
+};
+
+volatile sig_atomic_t stop;
+
+void die(const char *what)
+{
+    perror(what);
+    exit(EXIT_FAILURE);
+}
+
+long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+long long percentile(long long *sorted, int n, double p)
+{
+    int i = (int)(p / 100.0 * (n - 1) + 0.5);
+    return sorted[i];
+}
+
+/*
+ * Keep a sample in a reservoir of SAMPLES, so a long run is sampled evenly.
+ */
+void sample(long long *samples, long long n, unsigned int *seed, long long v)
+{
+    long long j = n < SAMPLES ? n : rand_r(seed) % (n + 1);
+
+    if (j < SAMPLES)
+        samples[j] = v;
+}
+
+void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+size_t rec_size(uint32_t len)
+{
+    return sizeof(struct trace_rec) + ((len + 7) & ~7u);
+}
+
+/*
+ * A streaming writer for the capture.
+ */
+struct out
+{
+    int fd;
+    char *buf;
+    size_t len;
+};
+
+void out_flush(struct out *o)
+{
+    size_t off = 0;
+    ssize_t n;
+
+    while (off < o->len)
+    {
+        n = write(o->fd, o->buf + off, o->len - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            die("write");
+        off += n;
+    }
+    o->len = 0;
+}
+
+void out_put(struct out *o, const void *data, size_t len)
+{
+    size_t n;
+
+    while (len > 0)
+    {
+        if (o->len == OUT_BUF)
+            out_flush(o);
+        n = len < OUT_BUF - o->len ? len : OUT_BUF - o->len;
+        memcpy(o->buf + o->len, data, n);
+        o->len += n;
+        data = (const char *)data + n;
+        len -= n;
+    }
+}
+
+int capture_main(int argc, char **argv)
+{
+    struct trace_header hdr = {.magic = TRACE_MAGIC};
+    struct kt_msg msgs[BATCH];
+    struct trace_rec rec = {0};
+    struct sigaction sa = {.sa_handler = on_signal};
+    struct out o = {0};
+    struct kt_channel *ch;
+    long long count = 0, limit = 0, now;
+    static const char zeros[8];
+    int opt, seconds = 0, size = 65536, i, n;
+
+    while ((opt = getopt(argc, argv, "d:n:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 'n':
+            limit = atoll(optarg);
+            break;
+        case 's':
+            size = atoi(optarg);
+            break;
+        default:
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind + 2 != argc || size < 1)
+    {
+        fprintf(stderr, "usage: kerneltalk_trace capture [-d SECONDS] [-n COUNT] "
+                        "[-s SIZE] FILENAME OUTPUT\n");
+        return EXIT_FAILURE;
+    }
+
+    // the batch ioctls say who wrote a message and when, the mapped ring doesn't
+    ch = kt_open(argv[optind], KT_NOMMAP);
+    if (!ch)
+        die(argv[optind]);
+    o.fd = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (o.fd < 0)
+        die(argv[optind + 1]);
+    o.buf = malloc(OUT_BUF);
+    for (i = 0; i < BATCH; i++)
+        msgs[i].buf = malloc(size);
+    if (!o.buf || !msgs[BATCH - 1].buf)
+        die("kerneltalk_trace");
+
+    // no SA_RESTART: a signal gets us out of a blocking receive
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGALRM, &sa, NULL);
+    alarm(seconds);
+
+    hdr.start_ns = now_ns();
+    out_put(&o, &hdr, sizeof(hdr));
+    while (!stop && (!limit || count < limit))
+    {
+        for (i = 0; i < BATCH; i++)
+            msgs[i].len = size;
+        n = kt_recv_many(ch, msgs, limit && limit - count < BATCH ? limit - count : BATCH);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            die("receive");
+        now = now_ns();
+        for (i = 0; i < n; i++)
+        {
+            rec.arrival_ns = now - hdr.start_ns;
+            rec.seq = msgs[i].info.seq;
+            rec.stamp_ns = msgs[i].info.stamp_ns;
+            rec.pid = msgs[i].info.pid;
+            rec.len = msgs[i].len;
+            rec.flags = msgs[i].info.flags;
+            out_put(&o, &rec, sizeof(rec));
+            out_put(&o, msgs[i].buf, rec.len);
+            out_put(&o, zeros, rec_size(rec.len) - sizeof(rec) - rec.len);
+        }
+        count += n;
+    }
+    out_flush(&o);
+
+    hdr.count = count;
+    hdr.end_ns = now_ns();
+    if (pwrite(o.fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || close(o.fd) < 0)
+        die(argv[optind + 1]);
+    fprintf(stderr, "kerneltalk_trace: captured %lld messages in %.2f s\n", count,
+            (hdr.end_ns - hdr.start_ns) / 1e9);
+    kt_close(ch);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * A capture mapped for reading.
+ */
+struct trace
+{
+    const struct trace_header *hdr;
+    const char *data;
+    size_t size;
+};
+
+void trace_open(struct trace *t, const char *path)
+{
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0)
+        die(path);
+    if ((size_t)st.st_size < sizeof(*t->hdr))
+    {
+        fprintf(stderr, "kerneltalk_trace: %s: not a capture\n", path);
+        exit(EXIT_FAILURE);
+    }
+    t->size = st.st_size;
+    t->data = mmap(NULL, t->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (t->data == MAP_FAILED)
+        die(path);
+    close(fd);
+    t->hdr = (const struct trace_header *)t->data;
+    if (memcmp(t->hdr->magic, TRACE_MAGIC, sizeof(t->hdr->magic)) != 0)
+    {
+        fprintf(stderr, "kerneltalk_trace: %s: not a capture\n", path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * The record at *off, and *off moved past it; NULL at the end, or where a
+ * capture that didn't end cleanly was cut off.
+ */
+const struct trace_rec *trace_next(const struct trace *t, size_t *off)
+{
+    const struct trace_rec *rec;
+
+    if (*off == 0)
+        *off = sizeof(*t->hdr);
+    if (t->size - *off < sizeof(*rec))
+        return NULL;
+    rec = (const struct trace_rec *)(t->data + *off);
+    if (t->size - *off < rec_size(rec->len))
+        return NULL;
+    *off += rec_size(rec->len);
+    return rec;
+}
+
+int info_main(int argc, char **argv)
+{
+    const struct trace_rec *rec;
+    long long count = 0, bytes = 0, last = 0;
+    int pids[MAX_PIDS], npids = 0, i;
+    struct trace t;
+    size_t off = 0;
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: kerneltalk_trace info CAPTURE\n");
+        return EXIT_FAILURE;
+    }
+    trace_open(&t, argv[1]);
+    while ((rec = trace_next(&t, &off)))
+    {
+        count++;
+        bytes += rec->len;
+        last = rec->arrival_ns;
+        for (i = 0; i < npids && pids[i] != rec->pid; i++)
+            ;
+        if (i == npids && npids < MAX_PIDS)
+            pids[npids++] = rec->pid;
+    }
+    printf("%lld messages, %lld bytes, %d writers, %.3f s%s\n", count, bytes, npids,
+           last / 1e9, t.hdr->count ? "" : ", not ended cleanly");
+    if (last > 0)
+        printf("%.0f messages/s, %.2f MiB/s\n", count / (last / 1e9),
+               bytes / (last / 1e9) / (1 << 20));
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Shared between replay's reader and its writer processes.
+ */
+struct replay_shared
+{
+    long long start_ns; // when the first record is due
+    volatile int ready;
+    volatile int writers_done;
+    struct
+    {
+        long long msgs;
+        long long bytes;
+        long long late[SAMPLES]; // ns behind schedule when committed
+    } writers[MAX_WRITERS];
+};
+
+/*
+ * Send one message as a whole, receiving our own copy of the traffic while
+ * we wait for room: blocking instead could leave two writers each waiting for
+ * the other to read.
+ */
+void send_draining(struct kt_channel *ch, const void *msg, size_t len)
+{
+    struct pollfd pfd = {.fd = kt_fd(ch), .events = POLLIN | POLLOUT};
+    struct kt_view view;
+
+    if (kt_send(ch, msg, len, 0) < 0)
+        die("kt_send");
+    for (;;)
+    {
+        while (kt_view(ch, &view) == 0)
+            kt_consume(ch);
+        if (!kt_queued(ch))
+            return;
+        if (kt_flush(ch) < 0 && errno != EAGAIN)
+            die("kt_flush");
+        if (kt_queued(ch))
+            poll(&pfd, 1, 1);
+    }
+}
+
+/*
+ * Which writer process replays a record: by original writer, so each one's
+ * messages stay in order, or round robin if the capture has no pids.
+ */
+int replay_owner(const struct trace_rec *rec, long long n, int writers)
+{
+    return (rec->pid ? (unsigned int)rec->pid : n) % writers;
+}
+
+void replay_writer(struct replay_shared *sh, const struct trace *t, const char *path,
+                   int id, int writers, double speed)
+{
+    const struct trace_rec *rec;
+    struct kt_channel *ch;
+    struct kt_view view;
+    struct timespec ts;
+    unsigned int seed = id + 1;
+    long long n = 0, due, now;
+    size_t off = 0;
+
+    ch = kt_open(path, KT_NONBLOCK);
+    if (!ch)
+        die(path);
+    __atomic_add_fetch(&sh->ready, 1, __ATOMIC_SEQ_CST);
+    while (!sh->start_ns)
+        usleep(1000);
+
+    for (; (rec = trace_next(t, &off)); n++)
+    {
+        if (replay_owner(rec, n, writers) != id)
+            continue;
+        due = sh->start_ns + (speed > 0 ? (long long)(rec->arrival_ns / speed) : 0);
+        ts.tv_sec = due / 1000000000LL;
+        ts.tv_nsec = due % 1000000000LL;
+        if (speed > 0)
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+                ;
+        send_draining(ch, rec + 1, rec->len);
+        now = now_ns();
+        sample(sh->writers[id].late, sh->writers[id].msgs, &seed, speed > 0 ? now - due : 0);
+        sh->writers[id].msgs++;
+        sh->writers[id].bytes += rec->len;
+    }
+    __atomic_add_fetch(&sh->writers_done, 1, __ATOMIC_SEQ_CST);
+    // our own copy must not hold up the others while they finish
+    while (sh->writers_done < writers)
+    {
+        while (kt_view(ch, &view) == 0)
+            kt_consume(ch);
+        usleep(1000);
+    }
+    exit(EXIT_SUCCESS);
+}
+
+int replay_main(int argc, char **argv)
+{
+    struct kt_msg msgs[BATCH];
+    struct replay_shared *sh;
+    struct kt_channel *ch;
+    struct trace t;
+    long long *lat, *late, expected = 0, received = 0, msgs_sent = 0, bytes = 0;
+    long long idle_since = 0, span = 0, now, end;
+    unsigned int seed = 1;
+    double speed = 1, secs;
+    pid_t pids[MAX_WRITERS];
+    int opt, writers = 1, i, n, nlat, nlate = 0, status, failed = 0;
+    const struct trace_rec *rec;
+    size_t off = 0;
+
+    while ((opt = getopt(argc, argv, "x:w:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'x':
+            speed = atof(optarg);
+            break;
+        case 'w':
+            writers = atoi(optarg);
+            break;
+        default:
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind + 2 != argc || speed < 0 || writers < 1 || writers > MAX_WRITERS)
+    {
+        fprintf(stderr, "usage: kerneltalk_trace replay [-x SPEED] [-w WRITERS] "
+                        "FILENAME CAPTURE\n");
+        return EXIT_FAILURE;
+    }
+    trace_open(&t, argv[optind + 1]);
+    while ((rec = trace_next(&t, &off)))
+    {
+        expected++;
+        span = rec->arrival_ns;
+    }
+
+    sh = mmap(NULL, sizeof(*sh), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    lat = malloc(SAMPLES * sizeof(*lat));
+    late = malloc((size_t)writers * SAMPLES * sizeof(*late));
+    for (i = 0; i < BATCH; i++)
+    {
+        msgs[i].buf = malloc(65536);
+        msgs[i].len = 65536;
+    }
+    if (sh == MAP_FAILED || !lat || !late || !msgs[BATCH - 1].buf)
+        die("kerneltalk_trace");
+
+    // subscribe before anything is sent
+    ch = kt_open(argv[optind], KT_NOMMAP | KT_NONBLOCK);
+    if (!ch)
+        die(argv[optind]);
+    for (i = 0; i < writers; i++)
+    {
+        pids[i] = fork();
+        if (pids[i] < 0)
+            die("fork");
+        if (pids[i] == 0)
+            replay_writer(sh, &t, argv[optind], i, writers, speed);
+    }
+    while (sh->ready < writers)
+        usleep(1000);
+    sh->start_ns = now_ns() + 10000000; // let everybody get to the start
+
+    // receive until everything replayed came back, or nothing did for a while
+    for (nlat = 0;;)
+    {
+        for (i = 0; i < BATCH; i++)
+            msgs[i].len = 65536;
+        n = kt_recv_many(ch, msgs, BATCH);
+        if (n < 0 && errno != EAGAIN)
+            die("receive");
+        now = now_ns();
+        for (i = 0; i < n; i++)
+        {
+            if (msgs[i].info.stamp_ns)
+                sample(lat, nlat++, &seed, now - (long long)msgs[i].info.stamp_ns);
+            received++;
+        }
+        if (n > 0)
+            idle_since = now;
+        if (sh->writers_done == writers &&
+            (received >= expected || now - idle_since > DRAIN_IDLE_NS))
+            break;
+        if (n < 0)
+            poll(&(struct pollfd){.fd = kt_fd(ch), .events = POLLIN}, 1, 10);
+    }
+    end = now_ns();
+
+    for (i = 0; i < writers; i++)
+    {
+        waitpid(pids[i], &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+            failed = 1;
+    }
+    if (failed)
+    {
+        fprintf(stderr, "kerneltalk_trace: a writer failed\n");
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < writers; i++)
+    {
+        n = sh->writers[i].msgs < SAMPLES ? sh->writers[i].msgs : SAMPLES;
+        memcpy(late + nlate, sh->writers[i].late, n * sizeof(*late));
+        nlate += n;
+        msgs_sent += sh->writers[i].msgs;
+        bytes += sh->writers[i].bytes;
+    }
+    if (nlat > SAMPLES)
+        nlat = SAMPLES;
+    qsort(lat, nlat, sizeof(*lat), cmp_ll);
+    qsort(late, nlate, sizeof(*late), cmp_ll);
+
+    secs = (end - sh->start_ns) / 1e9;
+    printf("replayed %lld messages, %lld bytes in %.3f s: %.0f messages/s, %.2f MiB/s",
+           msgs_sent, bytes, secs, msgs_sent / secs, bytes / secs / (1 << 20));
+    if (span > 0)
+        printf(", %.2fx the capture", span / 1e9 / secs);
+    printf("\n");
+    if (speed > 0 && nlate)
+        printf("behind schedule: p50 %.1f us, p99 %.1f us, max %.1f us\n",
+               percentile(late, nlate, 50) / 1e3, percentile(late, nlate, 99) / 1e3,
+               late[nlate - 1] / 1e3);
+    printf("received %lld of %lld", received, expected);
+    if (nlat)
+        printf(", delivery p50 %.1f us, p99 %.1f us, p999 %.1f us",
+               percentile(lat, nlat, 50) / 1e3, percentile(lat, nlat, 99) / 1e3,
+               percentile(lat, nlat, 99.9) / 1e3);
+    printf("\n");
+    kt_close(ch);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc >= 2 && strcmp(argv[1], "capture") == 0)
+        return capture_main(argc - 1, argv + 1);
+    if (argc >= 2 && strcmp(argv[1], "replay") == 0)
+        return replay_main(argc - 1, argv + 1);
+    if (argc >= 2 && strcmp(argv[1], "info") == 0)
+        return info_main(argc - 1, argv + 1);
+
+    fprintf(stderr, "usage: %s capture|replay|info [OPTIONS] FILE...\n", argv[0]);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,1294 @@
+/*
+ * KernelTalk: kernel based chat
+ *
+ * libkerneltalk, a client library for the KernelTalk device, and a
+ * shared-memory engine that does the same without it. See libkerneltalk.h for
+ * the interface.
+ */
+
+#define _GNU_SOURCE // MAP_ANONYMOUS, O_CLOEXEC, O_TMPFILE, F_OFD_SETLK, asprintf
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "kerneltalk.h"
+#include "kerneltalk_ring.h"
+#include "libkerneltalk.h"
+
+#define KT_BATCH 64        // messages queued before a send flushes on its own
+#define KT_SEND_BUF 65536  // bytes queued before a send flushes on its own
+#define KT_PLAIN_BUF 65536 // view buffer when the ring size is unknown
+
+#define KT_SHM_PREFIX "shm:"
+#define KT_SHM_DIR "/dev/shm/"
+#define KT_SHM_MAGIC 0x4b545334 // "KTS4"
+#define KT_SHM_RING 65536       // ring size of a new shm channel, unless named
+#define KT_SHM_REAP_MS 100      // how often a waiting writer looks for dead readers
+
+// what a shm client polling its fifo waits for
+#define KT_WANT_DATA 0x1
+#define KT_WANT_ROOM 0x2
+
+/*
+ * A shm channel is a file in /dev/shm that every process using it maps: this
+ * header with its record descriptors, then the ring. Writers take the lock,
+ * readers never do; they only publish how far they have read in their slot.
+ */
+struct kt_shm_client
+{
+    __u32 used; // changed under the lock
+    __s32 pid;
+    __u32 gen;  // bumped on every join, so others can tell their fifo is stale
+    __u32 want; // KT_WANT_*, poke the fifo when that shows up
+    __u64 pos;  // next byte to read, pos and rec are only written by the owner
+    __u64 rec;
+};
+
+struct kt_shm
+{
+    __u32 magic;
+    __u32 ring_size;
+    __u32 ring_offset;
+    pthread_mutex_t lock; // robust, see shm_lock()
+    __u32 seq;      // bumped after commits, readers wait on it
+    __u32 room_seq; // bumped when readers make room, writers wait on it
+    __u32 readers_waiting;
+    __u32 writers_waiting;
+    __u32 wanting; // clients with a want set
+    __u32 nr_recs; // kt_nr_recs() of the ring size
+    __u64 head;
+    __u64 rec_head;
+    struct kt_shm_client clients[KT_SHM_CLIENTS];
+    struct kt_rec recs[];
+};
+
+struct kt_channel
+{
+    int fd;
+    int flags;
+    enum kt_mode mode;
+
+    // queued messages, their buf is an offset into sbuf until they go out
+    struct kerneltalk_msg sq[KT_BATCH];
+    unsigned int sq_len;
+    char *sbuf;
+    size_t sbuf_len;
+
+    // the mapped ring, in KT_MODE_MMAP and KT_MODE_SHM
+    struct kerneltalk_ctrl *ctrl;
+    const char *ring;
+    size_t map_len;
+    unsigned int ring_size;
+    unsigned int nr_recs;         // record descriptors, rec_end entries in ctrl
+    int doubled;                  // the ring is mapped twice in a row, nothing wraps
+    unsigned long long pos;       // next byte to receive, ahead of the module's idea
+    unsigned long long rec;       // record starting at pos
+    unsigned long long unskipped; // received, but not given back with SKIP yet
+    unsigned int unskipped_recs;  // records in unskipped
+
+    // the next message, while it is being viewed
+    int viewing;
+    struct kt_view view;
+    unsigned long long view_end;
+    char *vbuf; // where views that can't point into the ring are copied
+    size_t vbuf_size;
+
+    // the shared-memory channel, in KT_MODE_SHM; fd is our fifo then
+    struct kt_shm *shm;
+    int shm_fd; // the channel's file, where we lock our slot
+    char *path;
+    int slot; // -1 until we have one
+    pid_t pid;
+    __u32 wants;     // KT_WANT_* asked for and not seen yet
+    __u32 want_room; // bytes a send is waiting for
+    struct
+    {
+        int fd;
+        __u32 gen;
+    } peers[KT_SHM_CLIENTS]; // other clients' fifos, opened when first poked
+};
+
+/*
+ * Map the control pages and the ring. If the ring size is a multiple of the
+ * page size it is mapped a second time right behind itself, so a message that
+ * wraps around the end is still contiguous in memory. With ctrl_only the
+ * first control page is just read for the ring size.
+ *
+ * A channel with autosize may move to a ring of another size until somebody
+ * maps it, so the size is checked again once the mapping holds it in place.
+ * On failure nothing stays mapped and ctrl, ring and doubled are left unset.
+ */
+static int map_ring(struct kt_channel *ch, int ctrl_only)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    struct kerneltalk_ctrl *ctrl;
+    struct kerneltalk_pending pending;
+    unsigned long long rec;
+    size_t offset, ring_len, map_len;
+    char *base;
+    int tries = 0, doubled;
+
+again:
+    ctrl = mmap(NULL, page, PROT_READ, MAP_SHARED, ch->fd, 0);
+    if (ctrl == MAP_FAILED)
+        return -1;
+    ch->ring_size = ctrl->ring_size;
+    offset = ctrl->ring_offset;
+    munmap(ctrl, page);
+    ch->vbuf_size = ch->ring_size;
+    if (ctrl_only)
+        return 0;
+
+    // the channel only takes the mapping once it is complete
+    doubled = ch->ring_size % page == 0;
+    ring_len = (ch->ring_size + page - 1) / page * page;
+    map_len = offset + ring_len * (doubled ? 2 : 1);
+
+    // reserve the whole range first, so the two ring mappings are adjacent
+    base = mmap(NULL, map_len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return -1;
+    if (mmap(base, offset + ring_len, PROT_READ, MAP_SHARED | MAP_FIXED, ch->fd, 0) == MAP_FAILED ||
+        (doubled && mmap(base + offset + ring_len, ring_len, PROT_READ,
+                         MAP_SHARED | MAP_FIXED, ch->fd, offset) == MAP_FAILED))
+    {
+        munmap(base, map_len);
+        // the ring may have shrunk under us, which makes the length invalid
+        if (++tries < 3)
+            goto again;
+        return -1;
+    }
+    ctrl = (struct kerneltalk_ctrl *)base;
+    if (ctrl->ring_size != ch->ring_size || ctrl->ring_offset != offset)
+    {
+        munmap(base, map_len);
+        goto again;
+    }
+    // rec_end must fit in front of the ring
+    if (ctrl->nr_recs == 0 || (ctrl->nr_recs & (ctrl->nr_recs - 1)) ||
+        offset < sizeof(*ctrl) + ctrl->nr_recs * sizeof(ctrl->rec_end[0]))
+    {
+        munmap(base, map_len);
+        errno = EINVAL;
+        return -1;
+    }
+
+    /*
+     * Find our record. Nothing was read yet, so pos is where a record starts,
+     * and the records before it end at or before pos. Records after it may
+     * have been committed since, but can't have overwritten its slot.
+     */
+    if (ioctl(ch->fd, KERNELTALK_IOC_PENDING, &pending) < 0)
+    {
+        munmap(base, map_len);
+        return -1;
+    }
+    rec = __atomic_load_n(&ctrl->rec_head, __ATOMIC_ACQUIRE);
+    while (rec > 0 && ctrl->rec_end[(rec - 1) & (ctrl->nr_recs - 1)] > pending.pos)
+        rec--;
+    ch->ctrl = ctrl;
+    ch->nr_recs = ctrl->nr_recs;
+    ch->ring = base + offset;
+    ch->doubled = doubled;
+    ch->map_len = map_len;
+    ch->pos = pending.pos;
+    ch->rec = rec;
+    return 0;
+}
+
+/*
+ * The shared-memory engine, for hosts without the module. It keeps a channel
+ * the way the module does, with the same ring arithmetic, and behaves the
+ * same: every client receives every message, and writers wait for the slowest
+ * reader. Waits are futexes on the header; for poll() every client also has a
+ * FIFO next to the file, which writers poke when data comes and readers poke
+ * when they make room, for clients that asked with a want.
+ */
+static long futex(__u32 *word, int op, __u32 val, const struct timespec *timeout)
+{
+    return syscall(SYS_futex, word, op, val, timeout, NULL, 0);
+}
+
+/*
+ * The lock is a robust, process-shared mutex, so a writer that dies holding
+ * it doesn't hang everybody else: the next one to take it gets EOWNERDEAD and
+ * puts the channel back in order. A writer stores head before rec_head when
+ * it commits, so if it died in between the last record is the truth and head
+ * is set back to its end.
+ */
+static void shm_lock(struct kt_shm *shm)
+{
+    struct kt_rec *rec;
+
+    if (pthread_mutex_lock(&shm->lock) != EOWNERDEAD)
+        return;
+    if (shm->rec_head == 0)
+        __atomic_store_n(&shm->head, 0, __ATOMIC_RELEASE);
+    else
+    {
+        rec = kt_rec(shm->recs, shm->nr_recs, shm->rec_head - 1);
+        __atomic_store_n(&shm->head, rec->pos + rec->len, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_consistent(&shm->lock);
+}
+
+static void shm_unlock(struct kt_shm *shm)
+{
+    pthread_mutex_unlock(&shm->lock);
+}
+
+/*
+ * Room for writers, from the slowest reader. Exact under the lock, a guess
+ * without it. Readers move on meanwhile, but only ever make more room, so a
+ * stale pos or rec just looks slower than it is.
+ */
+static __u32 shm_room(struct kt_channel *ch)
+{
+    struct kt_shm *shm = ch->shm;
+    struct kt_cursor tail = {.pos = UINT64_MAX, .rec = UINT64_MAX};
+    struct kt_shm_client *c;
+    __u64 pos, rec;
+    int i;
+
+    for (i = 0; i < KT_SHM_CLIENTS; i++)
+    {
+        c = &shm->clients[i];
+        if (!c->used)
+            continue;
+        rec = __atomic_load_n(&c->rec, __ATOMIC_ACQUIRE);
+        pos = __atomic_load_n(&c->pos, __ATOMIC_SEQ_CST);
+        if (pos < tail.pos)
+            tail.pos = pos;
+        if (rec < tail.rec)
+            tail.rec = rec;
+    }
+    return kt_room(ch->ring_size, ch->nr_recs, __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE),
+                   __atomic_load_n(&shm->rec_head, __ATOMIC_ACQUIRE),
+                   tail.pos == UINT64_MAX ? NULL : &tail);
+}
+
+/*
+ * Drop a client's slot. Called under the lock.
+ */
+static void shm_drop(struct kt_shm *shm, struct kt_shm_client *c)
+{
+    if (__atomic_exchange_n(&c->want, 0, __ATOMIC_SEQ_CST))
+        __atomic_sub_fetch(&shm->wanting, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&c->used, 0, __ATOMIC_RELEASE);
+}
+
+static int shm_fifo(struct kt_channel *ch, int slot, char *buf, size_t len)
+{
+    if ((size_t)snprintf(buf, len, "%s.%d", ch->path, slot) >= len)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * A client holds a lock on the byte of the channel's file at its slot number
+ * for as long as it has the slot. It is an open file description lock, so the
+ * kernel drops it however the client ends, and unlike a pid it can't be
+ * mistaken for a new process that got the same pid, or one we may not signal.
+ */
+static int shm_slot_lock(struct kt_channel *ch, int slot, short type)
+{
+    struct flock fl = {.l_type = type, .l_whence = SEEK_SET, .l_start = slot, .l_len = 1};
+
+    return fcntl(ch->shm_fd, F_OFD_SETLK, &fl);
+}
+
+/*
+ * Whether anybody holds a slot's lock. Our own lock doesn't count, so we never
+ * ask about our own slot. If we can't tell, it is alive.
+ */
+static int shm_slot_alive(struct kt_channel *ch, int slot)
+{
+    struct flock fl = {.l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = slot, .l_len = 1};
+
+    if (fcntl(ch->shm_fd, F_OFD_GETLK, &fl) < 0)
+        return 1;
+    return fl.l_type != F_UNLCK;
+}
+
+/*
+ * Free the slots of processes that died without closing their channel, so
+ * they don't hold up writers forever, and remove their fifos. Called under
+ * the lock, which keeps anybody from taking a slot before its fifo is gone.
+ */
+static int shm_reap(struct kt_channel *ch)
+{
+    struct kt_shm *shm = ch->shm;
+    char fifo[PATH_MAX];
+    int i, reaped = 0;
+
+    for (i = 0; i < KT_SHM_CLIENTS; i++)
+    {
+        if (shm->clients[i].used && i != ch->slot && !shm_slot_alive(ch, i))
+        {
+            if (shm_fifo(ch, i, fifo, sizeof(fifo)) == 0)
+                unlink(fifo);
+            shm_drop(shm, &shm->clients[i]);
+            reaped++;
+        }
+    }
+    return reaped;
+}
+
+/*
+ * Wake the clients polling for want: clear their wants and write a byte to
+ * their fifos. A full fifo is as good as a written one.
+ */
+static void shm_poke(struct kt_channel *ch, __u32 want)
+{
+    struct kt_shm *shm = ch->shm;
+    struct kt_shm_client *c;
+    char fifo[PATH_MAX];
+    __u32 old, gen;
+    int i;
+
+    if (!__atomic_load_n(&shm->wanting, __ATOMIC_SEQ_CST))
+        return;
+    for (i = 0; i < KT_SHM_CLIENTS; i++)
+    {
+        c = &shm->clients[i];
+        old = __atomic_load_n(&c->want, __ATOMIC_ACQUIRE);
+        do
+        {
+            if (!(old & want))
+                break;
+        } while (!__atomic_compare_exchange_n(&c->want, &old, 0, 0, __ATOMIC_SEQ_CST,
+                                              __ATOMIC_ACQUIRE));
+        if (!(old & want))
+            continue;
+        __atomic_sub_fetch(&shm->wanting, 1, __ATOMIC_SEQ_CST);
+
+        gen = __atomic_load_n(&c->gen, __ATOMIC_ACQUIRE);
+        if (ch->peers[i].fd < 0 || ch->peers[i].gen != gen)
+        {
+            if (ch->peers[i].fd >= 0)
+                close(ch->peers[i].fd);
+            ch->peers[i].fd = -1;
+            if (shm_fifo(ch, i, fifo, sizeof(fifo)) == 0)
+                ch->peers[i].fd = open(fifo, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+            ch->peers[i].gen = gen;
+        }
+        if (ch->peers[i].fd >= 0 && write(ch->peers[i].fd, "", 1) < 0)
+        {
+            // full, or the client is gone
+        }
+    }
+}
+
+/*
+ * Ask for a poke on our fifo, on top of what we asked for before and didn't
+ * get yet. Draining the fifo may eat a poke meant for an earlier want, so if
+ * anything wanted is already there we poke ourselves. The caller checks again
+ * afterwards: whatever happened before the want was visible won't poke us.
+ */
+static void shm_want(struct kt_channel *ch, __u32 want)
+{
+    struct kt_shm *shm = ch->shm;
+    char buf[64];
+
+    while (read(ch->fd, buf, sizeof(buf)) > 0)
+        ;
+    ch->wants |= want;
+    if (!__atomic_fetch_or(&shm->clients[ch->slot].want, ch->wants, __ATOMIC_SEQ_CST))
+        __atomic_add_fetch(&shm->wanting, 1, __ATOMIC_SEQ_CST);
+    if (((ch->wants & KT_WANT_DATA) && ch->rec != __atomic_load_n(&shm->rec_head, __ATOMIC_SEQ_CST)) ||
+        ((ch->wants & KT_WANT_ROOM) && shm_room(ch) >= ch->want_room))
+    {
+        if (write(ch->fd, "", 1) < 0)
+        {
+            // full is fine
+        }
+    }
+}
+
+/*
+ * After commits: wake readers sleeping on the futex and poke the polling ones.
+ */
+static void shm_kick_readers(struct kt_channel *ch)
+{
+    struct kt_shm *shm = ch->shm;
+
+    __atomic_add_fetch(&shm->seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&shm->readers_waiting, __ATOMIC_SEQ_CST))
+        futex(&shm->seq, FUTEX_WAKE, INT_MAX, NULL);
+    shm_poke(ch, KT_WANT_DATA);
+}
+
+/*
+ * After a reader moved on or left: the same for writers waiting for room.
+ */
+static void shm_kick_writers(struct kt_channel *ch)
+{
+    struct kt_shm *shm = ch->shm;
+
+    if (__atomic_load_n(&shm->writers_waiting, __ATOMIC_SEQ_CST))
+    {
+        __atomic_add_fetch(&shm->room_seq, 1, __ATOMIC_SEQ_CST);
+        futex(&shm->room_seq, FUTEX_WAKE, INT_MAX, NULL);
+    }
+    shm_poke(ch, KT_WANT_ROOM);
+}
+
+/*
+ * Commit messages as records, like SENDMMSG: each one whole, waiting for room
+ * unless dontwait or the channel is non-blocking. Returns how many went in.
+ */
+static int shm_send(struct kt_channel *ch, const struct kerneltalk_msg *msgs,
+                    unsigned int count, int dontwait)
+{
+    struct kt_shm *shm = ch->shm;
+    struct timespec ts, reap = {0, KT_SHM_REAP_MS * 1000000L};
+    struct kt_rec *rec;
+    unsigned int sent = 0;
+    __u32 len, room_seq;
+    int err = 0;
+
+    dontwait |= ch->flags & KT_NONBLOCK;
+    shm_lock(shm);
+    while (sent < count)
+    {
+        len = msgs[sent].len;
+        if (len == 0 || len > ch->ring_size)
+        {
+            err = len ? EMSGSIZE : EINVAL;
+            break;
+        }
+
+        // wait until the whole message fits
+        if (shm_room(ch) < len)
+        {
+            if (shm_reap(ch))
+                continue;
+            if (sent)
+                shm_kick_readers(ch);
+            if (dontwait)
+            {
+                ch->want_room = len;
+                shm_want(ch, KT_WANT_ROOM);
+                if (shm_room(ch) >= len)
+                    continue;
+                err = EAGAIN;
+                break;
+            }
+            __atomic_add_fetch(&shm->writers_waiting, 1, __ATOMIC_SEQ_CST);
+            room_seq = __atomic_load_n(&shm->room_seq, __ATOMIC_SEQ_CST);
+            if (shm_room(ch) < len)
+            {
+                // a reader that dies never wakes us, so look for it now and then
+                shm_unlock(shm);
+                futex(&shm->room_seq, FUTEX_WAIT, room_seq, &reap);
+                shm_lock(shm);
+            }
+            __atomic_sub_fetch(&shm->writers_waiting, 1, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        // the ring is mapped twice in a row, so this never wraps
+        memcpy((char *)ch->ring + kt_idx(ch->ring_size, shm->head),
+               (const void *)(uintptr_t)msgs[sent].buf, len);
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        rec = kt_rec(shm->recs, shm->nr_recs, shm->rec_head);
+        rec->pos = shm->head;
+        rec->len = len;
+        rec->pid = ch->pid;
+        rec->stamp = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        __atomic_store_n(&shm->head, shm->head + len, __ATOMIC_RELEASE);
+        __atomic_store_n(&shm->rec_head, shm->rec_head + 1, __ATOMIC_SEQ_CST);
+        sent++;
+    }
+    if (sent == count)
+        ch->wants &= ~KT_WANT_ROOM;
+    shm_unlock(shm);
+
+    if (sent)
+    {
+        shm_kick_readers(ch);
+        return sent;
+    }
+    errno = err;
+    return -1;
+}
+
+/*
+ * Wait for the record at ch->rec to be committed.
+ */
+static int shm_wait(struct kt_channel *ch, int wait)
+{
+    struct kt_shm *shm = ch->shm;
+    __u32 seq;
+
+    while (ch->rec == __atomic_load_n(&shm->rec_head, __ATOMIC_ACQUIRE))
+    {
+        if (!wait)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        if (ch->flags & KT_NONBLOCK)
+        {
+            shm_want(ch, KT_WANT_DATA);
+            if (ch->rec != __atomic_load_n(&shm->rec_head, __ATOMIC_SEQ_CST))
+                break;
+            errno = EAGAIN;
+            return -1;
+        }
+        __atomic_add_fetch(&shm->readers_waiting, 1, __ATOMIC_SEQ_CST);
+        seq = __atomic_load_n(&shm->seq, __ATOMIC_SEQ_CST);
+        if (ch->rec == __atomic_load_n(&shm->rec_head, __ATOMIC_SEQ_CST) &&
+            futex(&shm->seq, FUTEX_WAIT, seq, NULL) < 0 && errno == EINTR)
+        {
+            // like a read() of the device, a signal handler gets us out
+            __atomic_sub_fetch(&shm->readers_waiting, 1, __ATOMIC_SEQ_CST);
+            return -1;
+        }
+        __atomic_sub_fetch(&shm->readers_waiting, 1, __ATOMIC_SEQ_CST);
+    }
+    ch->wants &= ~KT_WANT_DATA;
+    return 0;
+}
+
+/*
+ * Publish how far we have read. Cheap enough to do for every message.
+ */
+static void shm_advance(struct kt_channel *ch)
+{
+    struct kt_shm_client *c = &ch->shm->clients[ch->slot];
+
+    __atomic_store_n(&c->rec, ch->rec, __ATOMIC_RELEASE);
+    __atomic_store_n(&c->pos, ch->pos, __ATOMIC_SEQ_CST);
+    shm_kick_writers(ch);
+}
+
+/*
+ * Make the file of a new channel. It only gets its name once it is set up,
+ * so nobody opens it half done; if somebody else was quicker, that fails
+ * with EEXIST.
+ */
+static int shm_create(const char *path, unsigned int size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    unsigned int nr = kt_nr_recs(size);
+    size_t offset = (sizeof(struct kt_shm) + nr * sizeof(struct kt_rec) + page - 1) / page * page;
+    struct kt_shm *shm;
+    pthread_mutexattr_t attr;
+    char proc[64];
+    int fd, err;
+
+    fd = open(KT_SHM_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0666);
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, offset + size) < 0)
+        goto fail;
+    shm = mmap(NULL, offset, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shm == MAP_FAILED)
+        goto fail;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    err = pthread_mutex_init(&shm->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    shm->ring_size = size;
+    shm->ring_offset = offset;
+    shm->nr_recs = nr;
+    shm->magic = KT_SHM_MAGIC;
+    munmap(shm, offset);
+    if (err)
+    {
+        errno = err;
+        goto fail;
+    }
+
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+    if (linkat(AT_FDCWD, proc, AT_FDCWD, path, AT_SYMLINK_FOLLOW) == 0)
+        return fd;
+fail:
+    err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+}
+
+/*
+ * Map the header and the ring, the ring twice in a row like map_ring() does.
+ */
+static int shm_map(struct kt_channel *ch, int fd)
+{
+    struct kt_shm *shm;
+    struct stat st;
+    size_t offset;
+    char *base;
+
+    if (fstat(fd, &st) < 0)
+        return -1;
+    if ((size_t)st.st_size < sizeof(*shm))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+    if (shm == MAP_FAILED)
+        return -1;
+    ch->ring_size = shm->ring_size;
+    ch->nr_recs = shm->nr_recs;
+    offset = shm->ring_offset;
+    if (shm->magic != KT_SHM_MAGIC || (size_t)st.st_size != offset + ch->ring_size ||
+        ch->nr_recs == 0 || (ch->nr_recs & (ch->nr_recs - 1)) ||
+        offset < sizeof(*shm) + ch->nr_recs * sizeof(struct kt_rec))
+    {
+        munmap(shm, sizeof(*shm));
+        errno = EINVAL;
+        return -1;
+    }
+    munmap(shm, sizeof(*shm));
+
+    ch->map_len = offset + 2 * (size_t)ch->ring_size;
+    base = mmap(NULL, ch->map_len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return -1;
+    if (mmap(base, offset + ch->ring_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(base + offset + ch->ring_size, ch->ring_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED)
+    {
+        munmap(base, ch->map_len);
+        return -1;
+    }
+    ch->shm = (struct kt_shm *)base;
+    ch->ring = base + offset;
+    ch->doubled = 1;
+    return 0;
+}
+
+/*
+ * Take a slot, and its lock, starting at the head like a new client of the
+ * module does, and open our fifo. A free slot whose lock is still held, by a
+ * child that inherited a channel that was closed, is passed over.
+ */
+static int shm_join(struct kt_channel *ch)
+{
+    struct kt_shm *shm = ch->shm;
+    struct kt_shm_client *c;
+    char fifo[PATH_MAX], buf[64];
+    int i, reaped = 0, err;
+
+    shm_lock(shm);
+    for (;;)
+    {
+        for (i = 0; i < KT_SHM_CLIENTS; i++)
+            if (!shm->clients[i].used && shm_slot_lock(ch, i, F_WRLCK) == 0)
+                break;
+        if (i < KT_SHM_CLIENTS || reaped || !shm_reap(ch))
+            break;
+        reaped = 1;
+    }
+    if (i == KT_SHM_CLIENTS)
+    {
+        shm_unlock(shm);
+        errno = EMFILE;
+        return -1;
+    }
+    c = &shm->clients[i];
+    c->pid = ch->pid;
+    c->want = 0;
+    c->pos = shm->head;
+    c->rec = shm->rec_head;
+    __atomic_add_fetch(&c->gen, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&c->used, 1, __ATOMIC_RELEASE);
+    shm_unlock(shm);
+    ch->slot = i;
+    ch->pos = c->pos;
+    ch->rec = c->rec;
+
+    if (shm_fifo(ch, i, fifo, sizeof(fifo)) < 0 ||
+        (mkfifo(fifo, 0666) < 0 && errno != EEXIST) ||
+        (ch->fd = open(fifo, O_RDWR | O_NONBLOCK | O_CLOEXEC)) < 0)
+    {
+        err = errno;
+        shm_lock(shm);
+        unlink(fifo);
+        shm_drop(shm, c);
+        shm_slot_lock(ch, i, F_UNLCK);
+        shm_unlock(shm);
+        ch->slot = -1;
+        errno = err;
+        return -1;
+    }
+    // whatever the previous owner of the slot left behind
+    while (read(ch->fd, buf, sizeof(buf)) > 0)
+        ;
+    return 0;
+}
+
+static void shm_leave(struct kt_channel *ch)
+{
+    char fifo[PATH_MAX];
+
+    // while we hold the slot, nobody else can have made this fifo
+    shm_lock(ch->shm);
+    if (shm_fifo(ch, ch->slot, fifo, sizeof(fifo)) == 0)
+        unlink(fifo);
+    shm_drop(ch->shm, &ch->shm->clients[ch->slot]);
+    shm_slot_lock(ch, ch->slot, F_UNLCK);
+    shm_unlock(ch->shm);
+    // we may have been the reader writers were waiting for
+    shm_kick_writers(ch);
+}
+
+/*
+ * Open "shm:NAME" or "shm:NAME:SIZE". The first to open a name creates the
+ * channel with a ring of SIZE bytes, a power of two of at least a page; later
+ * opens get the channel as it is.
+ */
+static int shm_open_channel(struct kt_channel *ch, const char *spec)
+{
+    const char *name = spec + strlen(KT_SHM_PREFIX);
+    const char *colon = strchr(name, ':');
+    size_t len = colon ? (size_t)(colon - name) : strlen(name);
+    unsigned long size = KT_SHM_RING;
+    int fd, err, i;
+
+    for (i = 0; i < KT_SHM_CLIENTS; i++)
+        ch->peers[i].fd = -1;
+    if (colon)
+        size = strtoul(colon + 1, NULL, 0);
+    if (len == 0 || memchr(name, '/', len) || size < (size_t)sysconf(_SC_PAGESIZE) ||
+        size > 1UL << 30 || (size & (size - 1)))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (asprintf(&ch->path, "%skerneltalk.%.*s", KT_SHM_DIR, (int)len, name) < 0)
+    {
+        ch->path = NULL;
+        return -1;
+    }
+
+    // whoever comes first creates it, everybody else opens that one
+    while ((fd = open(ch->path, O_RDWR | O_CLOEXEC)) < 0)
+    {
+        if (errno != ENOENT)
+            return -1;
+        fd = shm_create(ch->path, size);
+        if (fd >= 0)
+            break;
+        if (errno != EEXIST)
+            return -1;
+    }
+    err = shm_map(ch, fd);
+    if (err < 0)
+    {
+        err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    ch->shm_fd = fd;
+    return shm_join(ch);
+}
+
+struct kt_channel *kt_open(const char *path, int flags)
+{
+    struct kerneltalk_pending pending;
+    struct kt_channel *ch;
+    int err;
+
+    ch = calloc(1, sizeof(*ch));
+    if (!ch)
+        return NULL;
+    ch->flags = flags;
+    ch->mode = KT_MODE_PLAIN;
+    ch->vbuf_size = KT_PLAIN_BUF;
+    ch->pid = getpid();
+
+    if (strncmp(path, KT_SHM_PREFIX, strlen(KT_SHM_PREFIX)) == 0)
+    {
+        ch->mode = KT_MODE_SHM;
+        ch->fd = -1;
+        ch->shm_fd = -1;
+        ch->slot = -1;
+        if (shm_open_channel(ch, path) < 0)
+            goto fail;
+        goto buffers;
+    }
+
+    ch->fd = open(path, O_RDWR | O_CLOEXEC | (flags & KT_NONBLOCK ? O_NONBLOCK : 0));
+    if (ch->fd < 0)
+        goto fail;
+
+    // devices without the ioctls get plain reads and writes
+    if (!(flags & KT_PLAIN) && ioctl(ch->fd, KERNELTALK_IOC_PENDING, &pending) == 0)
+    {
+        ch->mode = KT_MODE_BATCH;
+        // a failed map_ring() leaves ctrl, ring and doubled unset
+        if (!(flags & KT_NOMMAP) && map_ring(ch, 0) == 0)
+            ch->mode = KT_MODE_MMAP;
+        else
+            map_ring(ch, 1);
+    }
+
+buffers:
+    ch->sbuf = malloc(KT_SEND_BUF);
+    if (!ch->ring || !ch->doubled)
+        ch->vbuf = malloc(ch->vbuf_size);
+    if (!ch->sbuf || (!ch->vbuf && (!ch->ring || !ch->doubled)))
+        goto fail;
+    return ch;
+
+fail:
+    err = errno;
+    kt_close(ch);
+    errno = err;
+    return NULL;
+}
+
+int kt_fd(const struct kt_channel *ch)
+{
+    return ch->fd;
+}
+
+enum kt_mode kt_mode(const struct kt_channel *ch)
+{
+    return ch->mode;
+}
+
+unsigned int kt_queued(const struct kt_channel *ch)
+{
+    return ch->sq_len;
+}
+
+/*
+ * Tell the module how far we have read in the mapped ring, so writers get the
+ * room and poll() stops reporting what we already have.
+ */
+static int give_back(struct kt_channel *ch)
+{
+    struct kerneltalk_skip skip = {.count = ch->unskipped};
+
+    if (!ch->unskipped)
+        return 0;
+    if (ioctl(ch->fd, KERNELTALK_IOC_SKIP, &skip) < 0)
+        return -1;
+    ch->unskipped = 0;
+    ch->unskipped_recs = 0;
+    return 0;
+}
+
+/*
+ * Commit messages as records, with the ioctl or into the shared memory.
+ */
+static int send_msgs(struct kt_channel *ch, struct kerneltalk_msg *msgs,
+                     unsigned int count, int dontwait)
+{
+    struct kerneltalk_mmsg mm = {.msgs = (uintptr_t)msgs, .count = count,
+                                 .flags = dontwait ? KERNELTALK_MMSG_DONTWAIT : 0};
+
+    if (ch->mode == KT_MODE_SHM)
+        return shm_send(ch, msgs, count, dontwait);
+    return ioctl(ch->fd, KERNELTALK_IOC_SENDMMSG, &mm);
+}
+
+/*
+ * Push out queued messages. dontwait overrides a blocking channel. more says
+ * the caller is in the middle of a KT_MORE sequence, so the module holds the
+ * last message back like the queue would have.
+ */
+static int flush(struct kt_channel *ch, int dontwait, int more)
+{
+    struct kerneltalk_msg msgs[KT_BATCH];
+    unsigned int i, done = 0;
+    size_t sent = 0;
+    ssize_t n;
+    int err = 0;
+
+    if (ch->sq_len == 0)
+        return 0;
+    // our own unread data takes room too
+    if (ch->mode == KT_MODE_MMAP)
+        give_back(ch);
+
+    if (ch->mode == KT_MODE_PLAIN)
+    {
+        // one write() for everything, there are no records to keep apart
+        while (sent < ch->sbuf_len)
+        {
+            n = write(ch->fd, ch->sbuf + sent, ch->sbuf_len - sent);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+            {
+                err = errno;
+                break;
+            }
+            sent += n;
+        }
+        memmove(ch->sbuf, ch->sbuf + sent, ch->sbuf_len - sent);
+        ch->sbuf_len -= sent;
+        ch->sq_len = ch->sbuf_len ? 1 : 0;
+        errno = err;
+        return err ? -1 : 0;
+    }
+
+    for (i = 0; i < ch->sq_len; i++)
+    {
+        msgs[i] = ch->sq[i];
+        msgs[i].buf = (uintptr_t)(ch->sbuf + ch->sq[i].buf);
+        msgs[i].flags = 0;
+    }
+    if (more)
+        msgs[ch->sq_len - 1].flags = KERNELTALK_MSG_MORE;
+    while (done < ch->sq_len)
+    {
+        n = send_msgs(ch, msgs + done, ch->sq_len - done, dontwait);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            err = errno;
+            break;
+        }
+        done += n;
+    }
+
+    // keep what didn't go out at the front of the queue
+    for (i = 0; i < done; i++)
+        sent += ch->sq[i].len;
+    memmove(ch->sbuf, ch->sbuf + sent, ch->sbuf_len - sent);
+    ch->sbuf_len -= sent;
+    for (i = done; i < ch->sq_len; i++)
+    {
+        ch->sq[i - done] = ch->sq[i];
+        ch->sq[i - done].buf -= sent;
+    }
+    ch->sq_len -= done;
+    errno = err;
+    return err ? -1 : 0;
+}
+
+int kt_flush(struct kt_channel *ch)
+{
+    return flush(ch, 0, 0);
+}
+
+int kt_cork(struct kt_channel *ch, unsigned int timeout_ms)
+{
+    __u32 ms = timeout_ms;
+
+    if (ch->mode == KT_MODE_SHM)
+    {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    // what was queued before goes out first, corked or not
+    if (flush(ch, 0, 0) < 0 && errno != EAGAIN)
+        return -1;
+    return ioctl(ch->fd, KERNELTALK_IOC_CORK, &ms);
+}
+
+int kt_send(struct kt_channel *ch, const void *buf, size_t len, int flags)
+{
+    struct kerneltalk_msg msg = {.buf = (uintptr_t)buf, .len = len,
+                                 .flags = (flags & KT_MORE) ? KERNELTALK_MSG_MORE : 0};
+    int n;
+
+    if (len > UINT32_MAX || (len > KT_SEND_BUF && ch->mode == KT_MODE_PLAIN))
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if ((ch->sq_len == KT_BATCH || ch->sbuf_len + len > KT_SEND_BUF) &&
+        flush(ch, 0, flags & KT_MORE) < 0)
+        return -1;
+
+    // nothing to coalesce with: send straight from the caller's buffer
+    if (ch->mode != KT_MODE_PLAIN && ch->sq_len == 0 && (!(flags & KT_MORE) || len > KT_SEND_BUF))
+    {
+        if (ch->mode == KT_MODE_MMAP)
+            give_back(ch);
+        do
+            n = send_msgs(ch, &msg, 1, 0);
+        while (n < 0 && errno == EINTR);
+        if (n >= 0 || errno != EAGAIN || len > KT_SEND_BUF)
+            return n < 0 ? -1 : 0;
+    }
+
+    memcpy(ch->sbuf + ch->sbuf_len, buf, len);
+    ch->sq[ch->sq_len].buf = ch->sbuf_len;
+    ch->sq[ch->sq_len].len = len;
+    ch->sq_len++;
+    ch->sbuf_len += len;
+
+    if (!(flags & KT_MORE) && kt_flush(ch) < 0 && errno != EAGAIN)
+        return -1;
+    return 0;
+}
+
+/*
+ * Whether the mapped ring has nothing for us: no record at ch->rec, and no
+ * bytes added to the one before it, see ring_view().
+ */
+static int ring_empty(struct kt_channel *ch)
+{
+    return ch->rec == __atomic_load_n(&ch->ctrl->rec_head, __ATOMIC_ACQUIRE) &&
+           ch->pos == __atomic_load_n(&ch->ctrl->head, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Wait for the record at ch->rec to show up in the mapped ring.
+ */
+static int ring_wait(struct kt_channel *ch, int wait)
+{
+    struct kerneltalk_wait w = {.timeout_ms = KERNELTALK_SYNC_FOREVER};
+
+    if (ch->mode == KT_MODE_SHM)
+        return shm_wait(ch, wait);
+    while (ring_empty(ch))
+    {
+        // the module must know what we have read before poll() or WAIT look
+        if (give_back(ch) < 0)
+            return -1;
+        if (!wait || (ch->flags & KT_NONBLOCK))
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        w.seq = __atomic_load_n(&ch->ctrl->seq, __ATOMIC_ACQUIRE);
+        if (!ring_empty(ch))
+            break;
+        if (ioctl(ch->fd, KERNELTALK_IOC_WAIT, &w) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Point the view at the record at ch->rec, which must be there. Nobody
+ * overwrites it before we give it back. A write() to the module that finds
+ * every record descriptor in use extends the newest record instead, so the
+ * record we read last may have grown since: then we view the rest of it.
+ */
+static void ring_view(struct kt_channel *ch)
+{
+    unsigned long long end;
+    size_t idx = ch->pos & (ch->ring_size - 1);
+    size_t len, first = ch->ring_size - idx;
+    struct kt_rec *rec;
+
+    memset(&ch->view.info, 0, sizeof(ch->view.info));
+    if (ch->mode == KT_MODE_SHM)
+    {
+        rec = kt_rec(ch->shm->recs, ch->nr_recs, ch->rec);
+        end = rec->pos + rec->len;
+        ch->view.info.pid = rec->pid;
+        ch->view.info.stamp_ns = rec->stamp;
+    }
+    else
+    {
+        if (ch->rec && ch->pos < ch->ctrl->rec_end[(ch->rec - 1) & (ch->nr_recs - 1)])
+        {
+            ch->rec--;
+            ch->view.info.flags = KERNELTALK_MSG_PARTIAL;
+        }
+        end = ch->ctrl->rec_end[ch->rec & (ch->nr_recs - 1)];
+    }
+    len = end - ch->pos;
+    ch->view.info.seq = ch->rec;
+    ch->view.len = len;
+    if (len <= first || ch->doubled)
+        ch->view.data = ch->ring + idx;
+    else
+    {
+        memcpy(ch->vbuf, ch->ring + idx, first);
+        memcpy(ch->vbuf + first, ch->ring, len - first);
+        ch->view.data = ch->vbuf;
+    }
+    ch->view_end = end;
+}
+
+/*
+ * Receive with the batch ioctl, or read() on devices without it.
+ */
+static int recv_batch(struct kt_channel *ch, struct kt_msg *msgs, unsigned int count)
+{
+    struct kerneltalk_msg km[KT_BATCH];
+    struct kerneltalk_mmsg mm = {.msgs = (uintptr_t)km};
+    unsigned int i;
+    ssize_t n;
+
+    if (ch->mode == KT_MODE_PLAIN)
+    {
+        n = read(ch->fd, msgs[0].buf, msgs[0].len);
+        if (n < 0)
+            return -1;
+        msgs[0].len = n;
+        memset(&msgs[0].info, 0, sizeof(msgs[0].info));
+        return 1;
+    }
+
+    mm.count = count < KT_BATCH ? count : KT_BATCH;
+    memset(km, 0, mm.count * sizeof(*km));
+    for (i = 0; i < mm.count; i++)
+    {
+        km[i].buf = (uintptr_t)msgs[i].buf;
+        km[i].len = msgs[i].len < UINT32_MAX ? msgs[i].len : UINT32_MAX;
+    }
+    n = ioctl(ch->fd, KERNELTALK_IOC_RECVMMSG, &mm);
+    if (n < 0)
+        return -1;
+    for (i = 0; i < n; i++)
+    {
+        msgs[i].len = km[i].len;
+        msgs[i].info.seq = km[i].seq;
+        msgs[i].info.stamp_ns = km[i].stamp_ns;
+        msgs[i].info.pid = km[i].pid;
+        msgs[i].info.flags = km[i].flags;
+    }
+    return n;
+}
+
+int kt_view(struct kt_channel *ch, struct kt_view *view)
+{
+    struct kt_msg msg = {.buf = ch->vbuf, .len = ch->vbuf_size};
+
+    if (!ch->viewing)
+    {
+        if (ch->ring)
+        {
+            if (ring_wait(ch, 1) < 0)
+                return -1;
+            ring_view(ch);
+        }
+        else
+        {
+            if (recv_batch(ch, &msg, 1) < 0)
+                return -1;
+            ch->view.data = msg.buf;
+            ch->view.len = msg.len;
+            ch->view.info = msg.info;
+        }
+        ch->viewing = 1;
+    }
+    *view = ch->view;
+    return 0;
+}
+
+void kt_consume(struct kt_channel *ch)
+{
+    if (!ch->viewing)
+        return;
+    ch->viewing = 0;
+    if (ch->mode == KT_MODE_SHM)
+    {
+        ch->pos = ch->view_end;
+        ch->rec++;
+        shm_advance(ch);
+        return;
+    }
+    if (ch->mode != KT_MODE_MMAP)
+        return;
+
+    ch->unskipped += ch->view_end - ch->pos;
+    ch->unskipped_recs++;
+    ch->pos = ch->view_end;
+    ch->rec++;
+    // give back in big steps, but before writers run short of room or records
+    if (ch->unskipped >= ch->ring_size / 4 || ch->unskipped_recs >= ch->nr_recs / 4)
+        give_back(ch);
+}
+
+ssize_t kt_recv(struct kt_channel *ch, void *buf, size_t len,
+                struct kt_msginfo *info)
+{
+    struct kt_msg msg = {.buf = buf, .len = len};
+    struct kt_view view;
+
+    if (ch->viewing || ch->ring)
+    {
+        if (kt_view(ch, &view) < 0)
+            return -1;
+        msg.info = view.info;
+        if (view.len > len)
+            msg.info.flags |= KERNELTALK_MSG_TRUNC;
+        else
+            msg.len = view.len;
+        memcpy(buf, view.data, msg.len);
+        kt_consume(ch);
+    }
+    else if (recv_batch(ch, &msg, 1) < 0)
+        return -1;
+
+    if (info)
+        *info = msg.info;
+    return msg.len;
+}
+
+int kt_recv_many(struct kt_channel *ch, struct kt_msg *msgs, unsigned int count)
+{
+    unsigned int n = 0;
+    ssize_t len;
+
+    if (count == 0)
+        return 0;
+    if (!ch->viewing && !ch->ring)
+        return recv_batch(ch, msgs, count);
+
+    // out of the ring one by one, only waiting for the first
+    while (n < count)
+    {
+        if (n && (!ch->ring || ring_wait(ch, 0) < 0))
+            break;
+        len = kt_recv(ch, msgs[n].buf, msgs[n].len, &msgs[n].info);
+        if (len < 0)
+            return n ? (int)n : -1;
+        msgs[n++].len = len;
+    }
+    return n;
+}
+
+void kt_close(struct kt_channel *ch)
+{
+    int i;
+
+    if (ch->fd >= 0 && ch->sq_len)
+    {
+        if (ch->mode == KT_MODE_PLAIN)
+            fcntl(ch->fd, F_SETFL, fcntl(ch->fd, F_GETFL) | O_NONBLOCK);
+        flush(ch, 1, 0);
+    }
+    if (ch->ctrl)
+        munmap(ch->ctrl, ch->map_len);
+    if (ch->shm)
+    {
+        if (ch->fd >= 0)
+            shm_leave(ch);
+        for (i = 0; i < KT_SHM_CLIENTS; i++)
+            if (ch->peers[i].fd >= 0)
+                close(ch->peers[i].fd);
+        munmap(ch->shm, ch->map_len);
+        close(ch->shm_fd);
+    }
+    if (ch->fd >= 0)
+        close(ch->fd);
+    free(ch->path);
+    free(ch->sbuf);
+    free(ch->vbuf);
+    free(ch);
+}
@@ -0,0 +1,152 @@
+/*
+ * KernelTalk: kernel based chat
+ *
+ * libkerneltalk, a client library for the KernelTalk device. Messages are the
+ * module's records: every message sent arrives as one message, whole. The
+ * library batches sends, and receives whichever way is fastest on the channel
+ * at hand: straight out of the mapped ring, with the batch ioctls, or with
+ * plain read() and write().
+ *
+ * On hosts without the module, channels named "shm:NAME" live in shared
+ * memory instead and behave the same, see kt_open().
+ *
+ * Functions that can fail return -1 (or NULL) and set errno, like system
+ * calls. A channel must not be used by two threads at once.
+ */
+
+#ifndef LIBKERNELTALK_H
+#define LIBKERNELTALK_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct kt_channel;
+
+/* kt_open() flags */
+#define KT_NONBLOCK 0x1 /* fail with EAGAIN instead of waiting */
+#define KT_NOMMAP 0x2   /* don't map the ring, receive with the batch ioctls */
+#define KT_PLAIN 0x4    /* only read() and write(), messages may be split or merged */
+
+#define KT_SHM_CLIENTS 64 /* channels open on one shm channel at a time */
+
+/* how a channel moves data, see kt_mode() */
+enum kt_mode
+{
+    KT_MODE_MMAP,  /* receive from the mapped ring, send with the batch ioctl */
+    KT_MODE_BATCH, /* batch ioctls both ways */
+    KT_MODE_PLAIN, /* read() and write(), for devices without the ioctls */
+    KT_MODE_SHM,   /* a shared-memory channel, no module involved */
+};
+
+/* kt_send() flags */
+#define KT_MORE 0x1 /* more is coming, hold the message back until a flush */
+
+/*
+ * What is known about a received message. pid and stamp_ns are 0 when the
+ * message came out of the module's mapped ring, seq is 0 in plain mode.
+ */
+struct kt_msginfo
+{
+    unsigned long long seq;      /* record number */
+    unsigned long long stamp_ns; /* commit time, CLOCK_MONOTONIC */
+    int pid;                     /* process id of the writer */
+    unsigned int flags;          /* KERNELTALK_MSG_* */
+};
+
+/* a caller's buffer for kt_recv_many() */
+struct kt_msg
+{
+    void *buf;
+    size_t len; /* in: size of buf, out: bytes received */
+    struct kt_msginfo info;
+};
+
+/* a received message that stays where it is, see kt_view() */
+struct kt_view
+{
+    const void *data;
+    size_t len;
+    struct kt_msginfo info;
+};
+
+/*
+ * Open a channel. Every channel also receives what it sends itself, so keep
+ * receiving or the ring fills up.
+ *
+ * path is a device, or "shm:NAME[:SIZE]" for a channel in shared memory,
+ * /dev/shm/kerneltalk.NAME. The first process to open NAME creates it with a
+ * ring of SIZE bytes (a power of two, at least a page, 64 KiB by default);
+ * the file stays until it is removed, like a device node. KT_NOMMAP and
+ * KT_PLAIN don't apply to it.
+ */
+struct kt_channel *kt_open(const char *path, int flags);
+
+/*
+ * Close a channel. Queued messages go out as far as they fit without waiting.
+ */
+void kt_close(struct kt_channel *ch);
+
+/*
+ * The file descriptor, for poll() or epoll. It only reports readable data
+ * reliably after a receive failed with EAGAIN.
+ *
+ * A shm channel's fd is a FIFO that only ever becomes readable: for data after
+ * a receive failed with EAGAIN, and for room after a send or flush did. Wait
+ * for POLLIN in both cases.
+ */
+int kt_fd(const struct kt_channel *ch);
+enum kt_mode kt_mode(const struct kt_channel *ch);
+
+/*
+ * Send a message of len bytes. With KT_MORE it is copied and queued, and goes
+ * out with the next message sent without KT_MORE, or kt_flush(), in a single
+ * system call. A full queue is flushed on its own.
+ *
+ * On a non-blocking channel a message that doesn't fit the ring yet is queued
+ * too, and kt_send() only fails with EAGAIN when the queue is full. Flush once
+ * the fd is writable; kt_queued() says how many messages are waiting.
+ */
+int kt_send(struct kt_channel *ch, const void *buf, size_t len, int flags);
+int kt_flush(struct kt_channel *ch);
+unsigned int kt_queued(const struct kt_channel *ch);
+
+/*
+ * Cork the channel: what is sent from now on reaches readers all at once, with
+ * a single wakeup, at kt_cork(ch, 0), or once timeout_ms (at most
+ * KERNELTALK_CORK_MAX_MS) have passed since the first of it. Queued messages
+ * are flushed first. While a KT_MORE sequence outgrows the queue, the module
+ * holds its flushed part back the same way. Not for shm channels (EOPNOTSUPP).
+ */
+int kt_cork(struct kt_channel *ch, unsigned int timeout_ms);
+
+/*
+ * Receive one message into buf and return its length. A message longer than
+ * len is cut short and flagged KERNELTALK_MSG_TRUNC; the rest of it is gone.
+ * info may be NULL.
+ */
+ssize_t kt_recv(struct kt_channel *ch, void *buf, size_t len,
+                struct kt_msginfo *info);
+
+/*
+ * Receive up to count messages into the caller's buffers, waiting only for
+ * the first one. Returns how many were received.
+ */
+int kt_recv_many(struct kt_channel *ch, struct kt_msg *msgs, unsigned int count);
+
+/*
+ * Look at the next message without copying it, when the ring is mapped, and
+ * move past it with kt_consume(). Until then kt_view() returns the same
+ * message again. The view is valid up to kt_consume() or the next kt_recv*().
+ */
+int kt_view(struct kt_channel *ch, struct kt_view *view);
+void kt_consume(struct kt_channel *ch);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBKERNELTALK_H */